@@ -1,11 +1,44 @@
 #include "AdvancedHashSet.h"
 
 #include <iostream>
-#include <mutex>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string.h>
+#include <thread>
+#include <vector>
+
+#include "BulkMemory.h"
+#include "RadixSort.h"
+
+uint8_t perms_4[24][4];
+uint32_t sort_lower_4_lut[1 << 16];
+// perms_4 transposed, for unpack_group: lane p of row j is perms_4[p][j]
+alignas(64) static uint16_t perm_cells[4][32];
 
 void initialize_lut() {
+    int perm[4] = { 0, 1, 2, 3 };
+    for (int p = 0; p < 24; ++p) {
+        for (int j = 0; j < 4; ++j) {
+            perms_4[p][j] = perm[j];
+            perm_cells[j][p] = perm[j];
+        }
+        std::next_permutation(perm, perm + 4);
+    }
+    for (int row = 0; row < 1 << 16; ++row) {
+        uint8_t cells[4], sorted[4];
+        for (int j = 0; j < 4; ++j) {
+            cells[j] = sorted[j] = row >> (4 * j) & 0xf;
+        }
+        std::sort(sorted, sorted + 4, std::greater<>());
+        int p = 0;
+        while (!(sorted[perms_4[p][0]] == cells[0] && sorted[perms_4[p][1]] == cells[1]
+                 && sorted[perms_4[p][2]] == cells[2] && sorted[perms_4[p][3]] == cells[3])) {
+            p++;
+        }
+        sort_lower_4_lut[row] = p << 16 | sorted[0] | sorted[1] << 4 | sorted[2] << 8 | sorted[3] << 12;
+    }
+
     for (int i = 0; i < 1 << 12; ++i) {
         Position position(i);
         constexpr int t1 = 0, t2 = 1, t3 = 2;
@@ -44,15 +77,130 @@ void initialize_lut() {
     }
 }
 
+SlotCodec SlotCodec::for_tile_sum(int tile_sum) {
+    SlotCodec codec;
+    // Largest tile representation the tile sum allows
+    int max_tile = tile_sum > 0 ? 31 - __builtin_clz(tile_sum) : 0;
+    codec.radix = max_tile + 1;
+    if (codec.radix > 15) {
+        return SlotCodec();
+    }
+    // Cell 15 on top, below 3
+    unsigned __int128 keys = 3;
+    for (int cell = 1; cell <= 14; ++cell) {
+        keys *= codec.radix;
+    }
+    codec.key_bits = 64 - __builtin_clzll((uint64_t)keys - 1);
+    codec.bytes = (codec.key_bits + 6 + 7) / 8;
+    if (codec.bytes >= 8) {
+        return SlotCodec();
+    }
+    codec.radix_7 = 1;
+    for (int i = 0; i < 7; ++i) {
+        codec.radix_7 *= codec.radix;
+    }
+    codec.radix_divider = libdivide::divider<uint64_t>(codec.radix);
+    codec.lay_out_lines();
+    return codec;
+}
+
+SlotCodec SlotCodec::with_quotient(size_t homes) const {
+    SlotCodec codec = *this;
+    codec.quotient = true;
+    codec.mix_bits = key_bits;
+    codec.bucket_keys = std::max<uint64_t>(((1ULL << key_bits) + homes - 1) / homes, 1);
+    codec.remainder_bits = codec.bucket_keys > 1 ? 64 - __builtin_clzll(codec.bucket_keys - 1) : 0;
+    // Room for displacements of at least 255, and whatever else rounding up to whole bytes leaves
+    codec.bytes = (codec.remainder_bits + 8 + 6 + 7) / 8;
+    if (codec.bytes >= bytes) {
+        return *this;
+    }
+    codec.key_bits = 8 * codec.bytes - 6;
+    codec.max_displacement = (1ULL << (codec.key_bits - codec.remainder_bits)) - 1;
+    codec.bucket_divider = libdivide::divider<uint64_t>(codec.bucket_keys);
+    codec.lay_out_lines();
+    return codec;
+}
+
+void SlotCodec::lay_out_lines() {
+    // As many as fit with the last one's 8-byte window inside the line
+    per_line = (64 - 8) / bytes + 1;
+    line_divider = libdivide::divider<uint64_t>(per_line);
+    spread_mask = 0;
+    for (int lane = 0; lane < 8; ++lane) {
+        for (int b = 0; b < 8; ++b) {
+            spread[lane * 8 + b] = b < bytes ? lane * bytes + b : 0;
+            spread_mask |= (uint64_t)(b < bytes) << (lane * 8 + b);
+        }
+    }
+}
+
+__m512i SlotCodec::widen_keys(__m512i key) const {
+    if (radix == 16) {
+        return key;
+    }
+    __m512i slot = _mm512_setzero_si512();
+    const __m512i r = _mm512_set1_epi64(radix);
+#pragma GCC unroll 14
+    for (int cell = 1; cell <= 14; ++cell) {
+        __m512i quotient = radix_divider.divide(key);
+        __m512i digit = _mm512_sub_epi64(key, _mm512_mullo_epi64(quotient, r));
+        slot = _mm512_or_si512(slot, _mm512_slli_epi64(digit, 4 * (cell - 1)));
+        key = quotient;
+    }
+    return _mm512_or_si512(slot, _mm512_slli_epi64(key, 56));
+}
+
+__m512i SlotCodec::widen(__m512i packed) const {
+    __m512i key = _mm512_and_si512(packed, _mm512_set1_epi64((1ULL << key_bits) - 1));
+    __m512i perms = _mm512_slli_epi64(_mm512_srli_epi64(packed, key_bits), POSITION_BITS);
+    return _mm512_or_si512(widen_keys(key), perms);
+}
+
+__m512i SlotCodec::widen(__m512i packed, __m512i index) const {
+    if (!quotient) {
+        return widen(packed);
+    }
+    __m512i key = _mm512_and_si512(packed, _mm512_set1_epi64((1ULL << key_bits) - 1));
+    __m512i displacement = _mm512_srli_epi64(key, remainder_bits);
+    __m512i home = _mm512_sub_epi64(index, displacement);
+    // Wrapped around the end
+    home = _mm512_mask_add_epi64(home, _mm512_cmplt_epu64_mask(index, displacement), home,
+                                 _mm512_set1_epi64(slots));
+    __m512i mixed = _mm512_add_epi64(_mm512_mullo_epi64(home, _mm512_set1_epi64(bucket_keys)),
+                                     _mm512_and_si512(key, _mm512_set1_epi64((1ULL << remainder_bits) - 1)));
+
+    // unmix
+    const __m512i mask = _mm512_set1_epi64((1ULL << mix_bits) - 1);
+    const int shift = (mix_bits + 1) / 2;
+    __m512i x = _mm512_xor_si512(mixed, _mm512_srli_epi64(mixed, shift));
+    x = _mm512_and_si512(_mm512_mullo_epi64(x, _mm512_set1_epi64(inverse(MIX_2))), mask);
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, shift));
+    x = _mm512_and_si512(_mm512_mullo_epi64(x, _mm512_set1_epi64(inverse(MIX_1))), mask);
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, shift));
+
+    __m512i perms = _mm512_slli_epi64(_mm512_srli_epi64(packed, key_bits), POSITION_BITS);
+    return _mm512_maskz_or_epi64(_mm512_test_epi64_mask(packed, packed), widen_keys(x), perms);
+}
+
 bool AdvancedHashSet::insert(Position position) {
     assert(position.is_canonical());
     assert(position.tile_sum() == tile_sum);
 
+    if (group_cells == 4) {
+        return insert_grouped(position);
+    }
     auto [ index, sorted ] = sort_lower_3(position);
 
-    auto hash = sorted.hash();
+    if (codec.packed()) {
+        return insert_packed(index, sorted);
+    }
+    if (buckets) {
+        return insert_bucketed(index, sorted);
+    }
+    size_t home = home_slot(sorted);
 try_again:
-    size_t hash_index = hash % capacity;
+    size_t hash_index = home;
 
     uint64_t the_bit = 1ULL << (POSITION_BITS + index);
     while (true) {
@@ -75,84 +223,506 @@ try_again:
                 goto try_again;
             return true;
         }
-        hash_index = (hash_index + 1) % capacity;
+        hash_index = hash_index + 1 == capacity ? 0 : hash_index + 1;
     }
 }
 
-void parallel_memcpy(uint64_t *p, uint64_t *p1, uint64_t *p2) {
-    if (p + (p2 - p1) <= p2 - 8 || (p2 - p1 < 1000000)) {
-        // do ST
-        memmove(p, p1, (p2 - p1) * sizeof(uint64_t));
-        return;
+// As in insert, each slot goes from empty to a fixed key just once, and keys go in the first empty slot from their
+// home on, so threads inserting the same key agree on where it is. A bucket is read in one load, but only each
+// slot of it is read atomically, which is all that relies on.
+bool AdvancedHashSet::insert_bucketed(int index, Position sorted) {
+    const uint64_t key = sorted.bits >> 4, the_bit = 1ULL << (POSITION_BITS + index);
+    const __m512i keys = _mm512_set1_epi64(key), key_mask = _mm512_set1_epi64((1ULL << POSITION_BITS) - 1);
+    size_t b = home_bucket(sorted);
+    while (true) {
+        uint64_t *bucket = data + 8 * b;
+        __m512i slots = _mm512_load_si512(bucket);
+        __mmask8 empty = _mm512_testn_epi64_mask(slots, slots);
+        __mmask8 match = _mm512_cmpeq_epi64_mask(_mm512_and_si512(slots, key_mask), keys) & ~empty;
+        if (match) {
+            uint64_t *slot = bucket + __builtin_ctz(match);
+            if (*slot & the_bit) {
+                return false;  // already in there
+            }
+            return !(__atomic_fetch_or(slot, the_bit, __ATOMIC_SEQ_CST) & the_bit);
+        }
+        if (empty) {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(bucket + __builtin_ctz(empty), &expected, key | the_bit, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return true;
+            }
+            continue;  // taken in the meantime; look at the bucket again
+        }
+        b = b + 1 == buckets ? 0 : b + 1;
     }
+}
 
-    // First handle non-aligned beginning
-    while (p1 < p2 && ((uintptr_t)p % 64 != 0)) {
-        *p++ = *p1++;
+bool AdvancedHashSet::contains_bucketed(int index, Position sorted) const {
+    const __m512i keys = _mm512_set1_epi64(sorted.bits >> 4);
+    const __m512i key_mask = _mm512_set1_epi64((1ULL << POSITION_BITS) - 1);
+    for (size_t b = home_bucket(sorted); ; b = b + 1 == buckets ? 0 : b + 1) {
+        __m512i slots = _mm512_load_si512(data + 8 * b);
+        __mmask8 empty = _mm512_testn_epi64_mask(slots, slots);
+        __mmask8 match = _mm512_cmpeq_epi64_mask(_mm512_and_si512(slots, key_mask), keys) & ~empty;
+        if (match) {
+            return data[8 * b + __builtin_ctz(match)] >> (POSITION_BITS + index) & 1;
+        }
+        if (empty) {
+            return false;
+        }
     }
+}
 
-    // Then copy with cache line granularity so that we can use the full memory bandwidth
-#pragma omp parallel for
-    for (size_t i = 0; i < p2 - p1; i += 8) {
-        _mm512_store_si512(&p[i], _mm512_loadu_si512(&p1[i]));
+// Packed slots are not 8-byte aligned, but an 8-byte access is still atomic on x86 as long as it stays inside a
+// cache line, and no slot's 8-byte window crosses a line. So a slot is claimed with a compare-and-swap on its
+// window, which also covers the start of the next slot; a concurrent change there only makes the swap retry.
+bool AdvancedHashSet::insert_packed(int index, Position sorted) {
+    uint64_t key = codec.narrow_key(sorted.bits >> 4), step = 0;
+    size_t home;
+    if (codec.quotient) {
+        // The remainder, with the distance from home above it
+        std::tie(home, key) = codec.split(key);
+        step = 1ULL << codec.remainder_bits;
+    } else {
+        home = home_slot(sorted);
+    }
+    const uint64_t the_bit = 1ULL << (codec.key_bits + index);
+    const uint64_t slot_mask = (1ULL << (8 * codec.bytes)) - 1, key_mask = (1ULL << codec.key_bits) - 1;
+    const size_t lines = capacity / codec.per_line;
+    size_t line = home / codec.line_divider;
+    int k = home - line * codec.per_line;
+    while (true) {
+        uint8_t *p = (uint8_t *)data + line * 64;
+        for (; k < codec.per_line; ++k) {
+            uint64_t *at = (uint64_t *)(p + k * codec.bytes);
+            uint64_t word = __atomic_load_n(at, __ATOMIC_RELAXED);
+            while (true) {
+                uint64_t packed = word & slot_mask;
+                if (packed != 0 && (packed & key_mask) != key) {
+                    break;
+                }
+                if (packed & the_bit) {
+                    return false;  // already in there
+                }
+                if (__atomic_compare_exchange_n(at, &word, word | key | the_bit, false, __ATOMIC_SEQ_CST,
+                                                __ATOMIC_RELAXED)) {
+                    return true;
+                }
+            }
+            if (step) {
+                if (key >> codec.remainder_bits == codec.max_displacement) {
+                    return insert_overflow((sorted.bits >> 4) | 1ULL << (POSITION_BITS + index));
+                }
+                key += step;
+            }
+        }
+        line = line + 1 == lines ? 0 : line + 1;
+        k = 0;
     }
 }
 
-void AdvancedHashSet::gorge() {
-    size_t old_capacity = capacity;
-    // Remove all zero entries, place at the beginning, and truncate capacity
-    if (capacity < 10000) {
-        size_t j = 0;
-        for (size_t i = 0; i < capacity; ++i) {
-            if (data[i] != 0) {
-                data[j++] = data[i];
+bool AdvancedHashSet::insert_grouped(Position position) {
+    auto [ index, sorted ] = sort_lower_4(position);
+    const uint64_t key = sorted.bits >> 4 | GROUP_OCCUPIED, the_bit = 1ULL << index;
+    size_t i = home_slot(sorted);
+    while (true) {
+        uint64_t *slot = data + 2 * i, d = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        // Losing the race for an empty slot to the same key is as good as winning it
+        if (d == 0 && __atomic_compare_exchange_n(slot, &d, key, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            d = key;
+        }
+        if (d == key) {
+            if (__atomic_load_n(slot + 1, __ATOMIC_RELAXED) & the_bit) {
+                return false;  // already in there
             }
+            return !(__atomic_fetch_or(slot + 1, the_bit, __ATOMIC_SEQ_CST) & the_bit);
         }
-        capacity = j;
-    } else {
-        int num_threads = omp_get_max_threads();
-        size_t chunk_size = capacity / num_threads;
-        chunk_size -= chunk_size % 8;  // for alignment purposes
+        i = i + 1 == capacity ? 0 : i + 1;
+    }
+}
 
-        std::vector<uint64_t> ranges;
-        for (size_t i = 0; i < num_threads; ++i) {
-            ranges.push_back(i * chunk_size);
+bool AdvancedHashSet::contains_grouped(Position position) const {
+    auto [ index, sorted ] = sort_lower_4(position);
+    const uint64_t key = sorted.bits >> 4 | GROUP_OCCUPIED;
+    for (size_t i = home_slot(sorted); data[2 * i]; i = i + 1 == capacity ? 0 : i + 1) {
+        if (data[2 * i] == key) {
+            return data[2 * i + 1] >> index & 1;
         }
-        ranges.push_back(capacity);
-        std::vector<uint64_t> count(num_threads);
+    }
+    return false;
+}
 
-        std::mutex mtx;
-        std::vector<std::pair<int, int>> live_ranges;
+int AdvancedHashSet::unpack_group(int tile_sum, uint64_t key, uint64_t perms, uint64_t *out) {
+    uint64_t position = stored_position(tile_sum, key & ~GROUP_OCCUPIED).bits;
+    // The lowest row under each permutation, a 16-bit lane apiece, put together a cell at a time
+    __m512i cells = _mm512_castsi128_si512(_mm_setr_epi16(position & 0xf, position >> 4 & 0xf, position >> 8 & 0xf,
+                                                          position >> 12 & 0xf, 0, 0, 0, 0));
+    __m512i rows = _mm512_setzero_si512();
+    for (int j = 0; j < 4; ++j) {
+        __m512i cell = _mm512_permutexvar_epi16(_mm512_load_si512(perm_cells[j]), cells);
+        rows = _mm512_or_si512(rows, _mm512_sllv_epi16(cell, _mm512_set1_epi16(4 * j)));
+    }
+    // Keep the permutations present, then put the rest of the position back on top
+    alignas(64) uint32_t kept[32];
+    int n_low = __builtin_popcount(perms & 0xffff), n = n_low + __builtin_popcount(perms >> 16 & 0xff);
+    _mm512_mask_compressstoreu_epi32(kept, perms & 0xffff, _mm512_cvtepu16_epi32(_mm512_castsi512_si256(rows)));
+    _mm512_mask_compressstoreu_epi32(kept + n_low, perms >> 16 & 0xff,
+                                     _mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(rows, 1)));
+    const __m512i upper = _mm512_set1_epi64(position & ~0xffffULL);
+    for (int k = 0; k < n; k += 8) {
+        __m512i low = _mm512_cvtepu32_epi64(_mm256_load_si256((const __m256i *)(kept + k)));
+        _mm512_storeu_si512(out + k, _mm512_or_si512(upper, low));
+    }
+    return n;
+}
 
+size_t AdvancedHashSet::split_groups(size_t spare) {
+    TraceScope scope("split groups");
+    constexpr uint64_t key_mask = (1ULL << POSITION_BITS) - 1;
+    // Ordinary slots of grouped slot i. Its positions agree on their lowest four cells up to order, so they fall
+    // in at most four: one per value of the fourth cell.
+    auto split = [&] (size_t i, uint64_t *out) {
+        alignas(64) uint64_t positions[32];
+        int n = unpack_group(tile_sum, data[2 * i], data[2 * i + 1], positions), slots = 0;
+        for (int k = 0; k < n; ++k) {
+            auto [ index, sorted ] = sort_lower_3(Position { positions[k] });
+            int s = 0;
+            while (s < slots && (out[s] & key_mask) != sorted.bits >> 4) {
+                s++;
+            }
+            if (s == slots) {
+                out[slots++] = sorted.bits >> 4;
+            }
+            out[s] |= 1ULL << (POSITION_BITS + index);
+        }
+        return slots;
+    };
+
+    constexpr size_t CHUNK = 1 << 14;
+    const size_t chunks = (capacity + CHUNK - 1) / CHUNK;
+    std::vector<size_t> offsets(chunks + 1);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < chunks; ++c) {
+        uint64_t scratch[4];
+        size_t count = 0;
+        for (size_t i = c * CHUNK; i < std::min(capacity, (c + 1) * CHUNK); ++i) {
+            count += data[2 * i] ? split(i, scratch) : 0;
+        }
+        offsets[c + 1] = count;
+    }
+    for (size_t c = 0; c < chunks; ++c) {
+        offsets[c + 1] += offsets[c];
+    }
+    const size_t count = offsets[chunks];
+
+    size_t bytes = std::max((count + spare) * sizeof(uint64_t), 4096UL);
+    HugePageMapping split_mapping = arena ? arena->acquire(bytes) : HugePageMapping(bytes);
+    uint64_t *out = (uint64_t *)split_mapping.data;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t j = offsets[c];
+        for (size_t i = c * CHUNK; i < std::min(capacity, (c + 1) * CHUNK); ++i) {
+            j += data[2 * i] ? split(i, out + j) : 0;
+        }
+    }
+    if (arena) {
+        arena->release(std::move(mapping));
+    }
+    mapping = std::move(split_mapping);
+    data = (uint64_t *)mapping.data;
+    group_cells = 3;
+    return count;
+}
+
+size_t AdvancedHashSet::count_groups() const {
+    TraceScope scope("count groups");
+    // The positions in a slot agree on their lowest four cells up to order, so one key per slot will do. A sorted
+    // layer keeps the slots that share cells 4-15 next to each other, so their keys can be counted run by run in
+    // one pass. Anything else is copied and sorted.
+    constexpr uint64_t key_mask = (1ULL << POSITION_BITS) - 1;
+    constexpr size_t BLOCK = 1 << 16;
+    auto cells_4_15 = [] (uint64_t d) { return (d & key_mask) >> 12; };
+    size_t groups = 0;
+    bool sorted = true;
+#pragma omp parallel for schedule(dynamic) reduction(+:groups) reduction(&&:sorted)
+    for (size_t block = 0; block < capacity; block += BLOCK) {
+        // A run is counted by the block it starts in
+        size_t i = block, end = std::min(capacity, block + BLOCK);
+        while (i > 0 && i < end && cells_4_15(data[i]) == cells_4_15(data[i - 1])) {
+            ++i;
+        }
+        std::vector<uint64_t> run;
+        while (i < end && sorted) {
+            run.clear();
+            size_t j = i;
+            for (; j < capacity && cells_4_15(data[j]) == cells_4_15(data[i]); ++j) {
+                sorted = sorted && data[j] && (j == 0 || (data[j - 1] & key_mask) < (data[j] & key_mask));
+                run.push_back(sort_lower_4(stored_position(data[j])).second.bits);
+            }
+            std::sort(run.begin(), run.end());
+            groups += std::unique(run.begin(), run.end()) - run.begin();
+            i = j;
+        }
+    }
+    if (sorted) {
+        return groups;
+    }
+
+    std::vector<uint64_t> keys(capacity);
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < capacity; ++i) {
+        keys[i] = data[i] ? sort_lower_4(stored_position(data[i])).second.bits : 0;
+    }
+    radix_sort(keys.data(), keys.size(), ~0ULL);
+    groups = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        groups += keys[i] && (i == 0 || keys[i] != keys[i - 1]);
+    }
+    return groups;
+}
+
+bool AdvancedHashSet::insert_overflow(uint64_t slot) {
+    constexpr uint64_t key_mask = (1ULL << POSITION_BITS) - 1;
+    std::lock_guard lock(overflow_mutex);
+    uint64_t& d = overflow[slot & key_mask];
+    bool added = !(d & slot & ~key_mask);
+    d |= slot;
+    return added;
+}
+
+bool AdvancedHashSet::contains_quotient(int index, Position sorted) const {
+    auto [ home, key ] = codec.split(codec.narrow_key(sorted.bits >> 4));
+    const uint64_t key_mask = (1ULL << codec.key_bits) - 1;
+    size_t i = home;
+    for (uint64_t displacement = 0; displacement <= codec.max_displacement; ++displacement) {
+        uint64_t packed = packed_slot(i);
+        if (packed == 0) {
+            return false;
+        }
+        if ((packed & key_mask) == (key | displacement << codec.remainder_bits)) {
+            return packed >> (codec.key_bits + index) & 1;
+        }
+        i = i + 1 == capacity ? 0 : i + 1;
+    }
+    std::lock_guard lock(overflow_mutex);
+    auto it = overflow.find(sorted.bits >> 4);
+    return it != overflow.end() && it->second >> (POSITION_BITS + index) & 1;
+}
+
+size_t AdvancedHashSet::widen_compact(size_t spare) {
+    TraceScope scope("widen");
+    const int w = codec.bytes, per_line = codec.per_line;
+    uint8_t *bytes = (uint8_t *)data;
+    const size_t lines = capacity / per_line;
+
+    // Squeeze out empty slots and line padding, keeping w bytes per slot. Slots only move down, and a chunk's
+    // output ends before the next chunk's input starts, but it may start inside the input of earlier chunks.
+    constexpr size_t CHUNK_LINES = 1 << 12;
+    const size_t chunks = (lines + CHUNK_LINES - 1) / CHUNK_LINES;
+    std::vector<size_t> offsets(chunks + 1);
+    // Under quotient, slots only decode at their own index, so which ones were kept is recorded. Chunks start on
+    // a word of this.
+    std::vector<uint64_t> occupied(codec.quotient ? capacity / 64 + 1 : 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < chunks; ++c) {
+        size_t count = 0;
+        for (size_t i = c * CHUNK_LINES * per_line; i < std::min(lines, (c + 1) * CHUNK_LINES) * per_line; ++i) {
+            bool kept = packed_slot(i) != 0;
+            count += kept;
+            if (codec.quotient) {
+                occupied[i / 64] |= (uint64_t)kept << (i % 64);
+            }
+        }
+        offsets[c + 1] = count;
+    }
+    for (size_t c = 0; c < chunks; ++c) {
+        offsets[c + 1] += offsets[c];
+    }
+    // So each chunk is compacted into a scratch buffer, publishes that its input has been read, and copies its
+    // output out once the earlier chunks it lands on have done the same. Chunks are claimed in increasing order and
+    // only wait on earlier chunks, which publish before they wait, so this can't deadlock.
+    constexpr size_t CHUNK_BYTES = CHUNK_LINES * 64;
+    auto read = std::make_unique<std::atomic<bool>[]>(chunks);
+    std::atomic<size_t> next_chunk = 0;
 #pragma omp parallel
-        {
-            int tid = omp_get_thread_num();
-            size_t j = ranges[tid];
-            for (size_t i = ranges[tid]; i < ranges[tid + 1]; ++i) {
-                if (data[i] != 0) {
-                    data[j++] = data[i];
+    {
+        std::vector<uint8_t> scratch(CHUNK_BYTES);
+        size_t c;
+        while ((c = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+            uint8_t *out = scratch.data();
+            for (size_t i = c * CHUNK_LINES * per_line; i < std::min(lines, (c + 1) * CHUNK_LINES) * per_line; ++i) {
+                if (packed_slot(i)) {
+                    memcpy(out, packed_address(i), w);
+                    out += w;
                 }
             }
-            {
-                std::lock_guard lg(mtx);
-                live_ranges.push_back({ ranges[tid], j });
+            read[c].store(true, std::memory_order_release);
+            for (size_t owner = offsets[c] * w / CHUNK_BYTES; owner < c; ++owner) {
+                for (int spins = 1; !read[owner].load(std::memory_order_acquire); ++spins) {
+                    if (spins % 64) {
+                        _mm_pause();
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
             }
+            memcpy(bytes + offsets[c] * w, scratch.data(), out - scratch.data());
         }
+    }
+    const size_t kept = offsets[chunks], count = kept + overflow.size();
 
-        std::sort(live_ranges.begin(), live_ranges.end(), [&] (auto a, auto b) {
-            return a.first < b.first;
-        });
-
-        size_t offset = 0;
-        for (auto [low, high] : live_ranges) {
-            parallel_memcpy(&data[offset], &data[low], &data[high]);
-            offset += high - low;
+    // Index the j-th kept slot came from
+    auto source_index = [&] (size_t j) {
+        size_t c = std::upper_bound(offsets.begin(), offsets.end(), j) - offsets.begin() - 1;
+        size_t rank = j - offsets[c];
+        for (size_t word = c * CHUNK_LINES * per_line / 64; ; ++word) {
+            size_t ones = __builtin_popcountll(occupied[word]);
+            if (rank < ones) {
+                return word * 64 + __builtin_ctzll(_pdep_u64(1ULL << rank, occupied[word]));
+            }
+            rank -= ones;
+        }
+    };
+    // Fill index with the source indices of the next n kept slots, continuing from word and bits
+    auto next_indices = [&] (uint64_t *index, int n, size_t& word, uint64_t& bits) {
+        for (int k = 0; k < n; ++k) {
+            while (!bits) {
+                bits = occupied[++word];
+            }
+            index[k] = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+    };
+    auto widen_range = [&] (const uint8_t *in, uint64_t *out, size_t begin, size_t end) {
+        if (!codec.quotient) {
+#pragma omp parallel for schedule(static)
+            for (size_t j = begin; j < end; j += 8) {
+                int n = std::min<size_t>(8, end - j);
+                _mm512_mask_storeu_epi64(out + j, (1 << n) - 1, codec.widen(codec.load(in + j * w, n)));
+            }
+            return;
+        }
+        constexpr size_t BLOCK = 1 << 12;
+#pragma omp parallel for schedule(static)
+        for (size_t block = begin; block < end; block += BLOCK) {
+            size_t block_end = std::min(end, block + BLOCK), i = source_index(block), word = i / 64;
+            uint64_t bits = occupied[word] & ~0ULL << (i % 64);
+            for (size_t j = block; j < block_end; j += 8) {
+                int n = std::min<size_t>(8, block_end - j);
+                alignas(64) uint64_t index[8] = { };
+                next_indices(index, n, word, bits);
+                _mm512_mask_storeu_epi64(out + j, (1 << n) - 1,
+                                         codec.widen(codec.load(in + j * w, n), _mm512_load_si512(index)));
+            }
+        }
+    };
+    if ((count + spare) * sizeof(uint64_t) <= mapping.bytes) {
+        // In place, from the back, in rounds: slots from w * n / 8 up land past all input not yet read
+        size_t n = kept;
+        while (n > 4096) {
+            size_t first = (w * n + 7) / 8;
+            widen_range(bytes, data, first, n);
+            n = first;
+        }
+        std::vector<uint64_t> index(n);
+        if (codec.quotient && n > 0) {
+            size_t i = source_index(0), word = i / 64;
+            uint64_t bits = occupied[word] & ~0ULL << (i % 64);
+            next_indices(index.data(), n, word, bits);
         }
-        capacity = offset;
+        for (size_t j = n; j-- > 0; ) {
+            uint64_t packed = 0;
+            memcpy(&packed, bytes + j * w, w);
+            data[j] = packed ? codec.widen(packed, index[j]) : 0;
+        }
+    } else {
+        // Give back what the packed slots no longer need first
+        if (arena) {
+            arena->release(mapping.split_tail(kept * w));
+        } else {
+            mapping.shrink(kept * w);
+        }
+        size_t wide_bytes = std::max((count + spare) * sizeof(uint64_t), 4096UL);
+        HugePageMapping wide = arena ? arena->acquire(wide_bytes) : HugePageMapping(wide_bytes);
+        widen_range(bytes, (uint64_t *)wide.data, 0, kept);
+        if (arena) {
+            arena->release(std::move(mapping));
+        }
+        mapping = std::move(wide);
+        data = (uint64_t *)mapping.data;
+    }
+    size_t j = kept;
+    for (auto [ key, d ] : overflow) {
+        data[j++] = d;
     }
+    overflow.clear();
+    codec = SlotCodec();
+    return count;
+}
+
+void AdvancedHashSet::gorge() {
+    // Remove all zero entries, place at the beginning, and truncate capacity
+    capacity = group_cells == 4 ? split_groups()
+        : codec.packed() ? widen_compact() : bulk_compact(data, data, capacity);
+    truncate();
+}
+
+void AdvancedHashSet::truncate() {
     divider = libdivide::divider(capacity);
-    data = (uint64_t*)mremap(data, old_capacity * sizeof(uint64_t), capacity * sizeof(uint64_t), MREMAP_MAYMOVE);
-    if (data == MAP_FAILED || !data) {
-        throw std::runtime_error("Failed to remap");
+    // Home slots mean nothing once the table is compacted
+    placement = nullptr;
+    buckets = 0;
+    if (arena) {
+        arena->release(mapping.split_tail(capacity * sizeof(uint64_t)));
+    } else {
+        mapping.shrink(capacity * sizeof(uint64_t));
+    }
+}
+
+void AdvancedHashSet::drop() {
+    if (arena) {
+        arena->release(std::move(mapping));
+    } else {
+        mapping.release();
+    }
+    data = nullptr;
+    capacity = 0;
+    buckets = 0;
+    group_cells = 3;
+    overflow.clear();
+}
+
+void AdvancedHashSet::gorge_sorted() {
+    constexpr uint64_t key_mask = (1ULL << POSITION_BITS) - 1;
+    if (!placement) {
+        gorge();
+        TraceScope scope("gorge sort");
+        radix_sort(data, capacity, key_mask);
+        return;
+    }
+
+    // Probe sequences that ran off the end wrapped around to the front; those keys belong at the back. They all
+    // sit in the first occupied run.
+    std::vector<uint64_t> wrapped;
+    for (size_t i = 0; i < capacity && slot(i); ++i) {
+        uint64_t d = slot(i);
+        if (placement->slot(d & key_mask, capacity) > i) {
+            wrapped.push_back(d);
+            if (codec.packed()) {
+                memset(packed_address(i), 0, codec.bytes);
+            } else {
+                data[i] = 0;
+            }
+        }
+    }
+    size_t count = codec.packed() ? widen_compact(wrapped.size()) : bulk_compact(data, data, capacity);
+    std::copy(wrapped.begin(), wrapped.end(), data + count);
+    capacity = count + wrapped.size();
+
+    TraceScope scope("gorge sort");
+    if (!sort_nearly_sorted(data, capacity, key_mask)) {
+        radix_sort(data, capacity, key_mask);
     }
+    truncate();
 }
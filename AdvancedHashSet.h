@@ -6,6 +6,7 @@
 #define ADVANCEDHASHSET_H
 
 #include <cstdint>
+#include <cstring>
 #include <atomic>
 #include <pthread.h>
 #include <cassert>
@@ -13,10 +14,19 @@
 #include <iostream>
 #include <omp.h>
 #include <functional>
+#include <mutex>
+#include <unordered_map>
 #include <sys/mman.h>
 
+#include "KeyCdf.h"
+// For SlotCodec, which divides eight slots at a time
+#define LIBDIVIDE_AVX512
 #include "libdivide.h"
+#include "MemoryBudget.h"
 #include "Position.h"
+#include "Progress.h"
+#include "TableArena.h"
+#include "Trace.h"
 
 static __m256i goose = _mm256_setr_epi8(
                 2, 1, 0, -1,
@@ -71,6 +81,161 @@ inline std::pair<int, Position> sort_lower_3(Position position) {
     //return { m >> 12, Position((position.bits & ~0xfffULL) | (m & 0xfffULL))};
 }
 
+// Permutations of four cells, in lexicographic order: cell j of a row is cell perms_4[p][j] of the row sorted
+extern uint8_t perms_4[24][4];
+// Indexed by a row: the row with its cells sorted, largest first, and above it the first p in perms_4 that gives
+// back the row
+extern uint32_t sort_lower_4_lut[1 << 16];
+
+// Like sort_lower_3, over the lowest four cells, for tables with grouped slots
+inline std::pair<int, Position> sort_lower_4(Position position) {
+    uint32_t m = sort_lower_4_lut[position.nth_row(0)];
+    return { m >> 16, Position((position.bits & ~0xffffULL) | (m & 0xffff)) };
+}
+
+// Narrower slots for a table that is being filled, chosen from its tile sum. The key (cells 1-15 of the position
+// with its lower three cells sorted) is written in mixed radix: a digit per cell, up to the largest tile the tile
+// sum allows, except for cell 15, which is at most 2 in canonical positions. The 6 permutation bits go on top.
+// Packing keeps keys in order. Slots are at most 6 bytes below tile sum 128 and 7 below 1024; past that nothing
+// is saved, and bytes stays 8.
+//
+// In quotient mode (see with_quotient), keys are first put through an invertible mix. A key's home slot is its
+// mixed value divided by bucket_keys, and its slot keeps only the remainder, with the distance from home above
+// it. Decoding a slot then needs its index.
+//
+// Packed slots fill 64-byte lines, per_line to a line, so that each can be read and swapped as 8 bytes without
+// crossing a line.
+struct SlotCodec {
+    constexpr static int POSITION_BITS = 58;  // as in AdvancedHashSet
+
+    int bytes = 8;
+    int per_line = 8;
+    int radix = 16;
+    // Bits below the permutation bits
+    int key_bits = POSITION_BITS;
+    uint64_t radix_7 = 1ULL << 28;  // radix^7
+    libdivide::divider<uint64_t> radix_divider { 16 }, line_divider { 8 };
+    // Byte shuffle and mask that spread eight consecutive packed slots over the lanes of a vector
+    alignas(64) uint8_t spread[64];
+    uint64_t spread_mask = 0;
+
+    bool quotient = false;
+    int mix_bits = POSITION_BITS;  // of the narrowed keys
+    int remainder_bits = 0;
+    uint64_t bucket_keys = 1;
+    libdivide::divider<uint64_t> bucket_divider { 1 };
+    uint64_t max_displacement = 0;
+    // Slots in the table; displacements wrap around at the end
+    size_t slots = 0;
+
+    static SlotCodec for_tile_sum(int tile_sum);
+    // The same narrowing, quotiented over the given number of home slots. Unchanged if that saves nothing.
+    SlotCodec with_quotient(size_t homes) const;
+
+    bool packed() const {
+        return bytes < 8;
+    }
+
+    uint64_t narrow_key(uint64_t key) const {
+        if (radix == 16) {
+            return key;
+        }
+        assert((key >> 56) < 3);
+        // Two independent halves, cells 8-15 and 1-7
+        uint64_t high = key >> 56, low = 0;
+#pragma GCC unroll 7
+        for (int cell = 14; cell >= 8; --cell) {
+            high = high * radix + ((key >> (4 * (cell - 1))) & 0xf);
+            low = low * radix + ((key >> (4 * (cell - 8))) & 0xf);
+        }
+        return high * radix_7 + low;
+    }
+
+    uint64_t widen_key(uint64_t key) const {
+        if (radix == 16) {
+            return key;
+        }
+        uint64_t slot = 0;
+        for (int cell = 1; cell <= 14; ++cell) {
+            slot |= key % radix << (4 * (cell - 1));
+            key /= radix;
+        }
+        return slot | key << 56;
+    }
+
+    // Not in quotient mode
+    uint64_t narrow(uint64_t slot) const {
+        return narrow_key(slot & ((1ULL << POSITION_BITS) - 1)) | (slot >> POSITION_BITS) << key_bits;
+    }
+
+    uint64_t widen(uint64_t packed) const {
+        return widen_key(packed & ((1ULL << key_bits) - 1)) | (packed >> key_bits) << POSITION_BITS;
+    }
+
+    // Nonzero packed slot i, in either mode
+    uint64_t widen(uint64_t packed, size_t i) const {
+        if (!quotient) {
+            return widen(packed);
+        }
+        uint64_t displacement = (packed & ((1ULL << key_bits) - 1)) >> remainder_bits;
+        size_t home = i >= displacement ? i - displacement : i + slots - displacement;
+        uint64_t mixed = home * bucket_keys + (packed & ((1ULL << remainder_bits) - 1));
+        return widen_key(unmix(mixed)) | (packed >> key_bits) << POSITION_BITS;
+    }
+
+    // Home slot and remainder of a narrowed key, in quotient mode
+    std::pair<size_t, uint64_t> split(uint64_t key) const {
+        uint64_t mixed = mix(key);
+        uint64_t home = mixed / bucket_divider;
+        return { home, mixed - home * bucket_keys };
+    }
+
+    // Invertible over mix_bits bits: xor-shifts by at least half the width, and odd multipliers
+    constexpr static uint64_t MIX_1 = 0xff51afd7ed558ccdULL, MIX_2 = 0xc4ceb9fe1a85ec53ULL;
+    constexpr static uint64_t inverse(uint64_t odd) {
+        uint64_t x = odd;  // right to 3 bits; each step doubles that
+        for (int i = 0; i < 5; ++i) {
+            x *= 2 - odd * x;
+        }
+        return x;
+    }
+
+    uint64_t mix(uint64_t x) const {
+        const uint64_t mask = (1ULL << mix_bits) - 1;
+        const int shift = (mix_bits + 1) / 2;
+        x ^= x >> shift;
+        x = x * MIX_1 & mask;
+        x ^= x >> shift;
+        x = x * MIX_2 & mask;
+        return x ^ x >> shift;
+    }
+
+    uint64_t unmix(uint64_t x) const {
+        const uint64_t mask = (1ULL << mix_bits) - 1;
+        const int shift = (mix_bits + 1) / 2;
+        x ^= x >> shift;
+        x = x * inverse(MIX_2) & mask;
+        x ^= x >> shift;
+        x = x * inverse(MIX_1) & mask;
+        return x ^ x >> shift;
+    }
+
+    // Eight narrowed keys, one per lane
+    __m512i widen_keys(__m512i keys) const;
+    // Eight packed slots, one per lane; not in quotient mode
+    __m512i widen(__m512i packed) const;
+    // Eight packed slots and their indices, in either mode. Empty slots stay zero.
+    __m512i widen(__m512i packed, __m512i index) const;
+    // The first n <= 8 of the packed slots at p, one per lane; the remaining lanes are zero
+    __m512i load(const uint8_t *p, int n) const {
+        __m512i raw = _mm512_maskz_loadu_epi8((1ULL << (n * bytes)) - 1, p);
+        return _mm512_maskz_permutexvar_epi8(spread_mask, _mm512_load_si512(spread), raw);
+    }
+
+private:
+    void lay_out_lines();
+};
+
 // Stores canonical positions with a tile sum fixed at creation. Supports concurrent insertions
 // and lookups, but not deletions.
 //
@@ -81,60 +246,200 @@ struct AdvancedHashSet {
 
     constexpr static int POSITION_BITS = 58;
 
-    // Capacity, in 64-bit words.
+    // Capacity, in slots; 64-bit words unless the table is packed
     libdivide::divider<uint64_t> divider;
     size_t capacity;
+    // Owns the memory behind data
+    HugePageMapping mapping;
+    // If set, memory is borrowed from and returned to this arena instead of being mapped and unmapped
+    TableArena *arena;
+    // If set, keys are placed in order of this model of their distribution instead of by hash, so the table
+    // is nearly sorted once gorged. Must outlive the inserts.
+    const KeyCdf *placement;
+    // Layout of the slots until gorge, which widens them to 64 bits
+    SlotCodec codec;
+    // Under Config::bucketed, the number of 64-byte buckets of 8 slots; 0 for plain linear probing
+    size_t buckets = 0;
+    // 3, or 4 for grouped slots: two words each, the key (with its lowest four cells sorted) marked by
+    // GROUP_OCCUPIED, then a bitset of the 24 permutations in perms_4. Only until gorge, which splits each
+    // grouped slot into the ordinary slots of its positions.
+    int group_cells = 3;
+    constexpr static uint64_t GROUP_OCCUPIED = 1ULL << 63;
+    // In quotient mode, keys that probed past the largest displacement a slot can hold, as 64-bit slots. Rare
+    // unless the table is nearly full. Stored key -> slot.
+    std::unordered_map<uint64_t, uint64_t> overflow;
+    mutable std::mutex overflow_mutex;
 
     struct Config {
         int tile_sum;
         size_t initial_size;
         double load_factor;
+        TableArena *arena = nullptr;
+        const KeyCdf *placement = nullptr;
+        // Pack slots as narrowly as the tile sum allows (see SlotCodec)
+        bool packed = false;
+        // Keep only key remainders in the slots (see SlotCodec::with_quotient). Can't be combined with a placement.
+        bool quotient = false;
+        // Cells sorted into each key: 3, or 4 for grouped slots. Grouped slots are 16 bytes and pay off only if
+        // positions share them densely enough (see count_groups). Can't be combined with the options above.
+        int group_cells = 3;
+        // Probe whole buckets of 8 slots, one cache line each, comparing all 8 keys at once. The home bucket is
+        // picked by fastrange rather than a modulo. Can't be combined with the options above.
+        bool bucketed = false;
     };
 
-    AdvancedHashSet(Config config) {
-        auto huge = config.initial_size > (1 << 20) ? (MAP_HUGETLB | (30 << MAP_HUGE_SHIFT)) : 0;
-        try_again:
-        tile_sum = config.tile_sum;
-        auto ptr = mmap(NULL, std::max(config.initial_size * sizeof(uint64_t), 4096UL), PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS | huge, -1, 0);
-        if (ptr == MAP_FAILED || !ptr) {
-            if (huge) {
-                huge = 0;
-                goto try_again;
+    AdvancedHashSet(Config config) : tile_sum(config.tile_sum), arena(config.arena), placement(config.placement),
+                                     group_cells(config.group_cells) {
+        if (group_cells == 4 && (config.packed || config.quotient || placement)) {
+            throw std::runtime_error("Grouped slots can't be packed or placed");
+        }
+        if (config.bucketed && (config.packed || config.quotient || placement || group_cells == 4)) {
+            throw std::runtime_error("Bucketed tables can't be packed, placed or grouped");
+        }
+        if (config.bucketed) {
+            buckets = std::max<size_t>((config.initial_size + 7) / 8, 1);
+            config.initial_size = buckets * 8;
+        }
+        if (config.packed) {
+            codec = SlotCodec::for_tile_sum(tile_sum);
+        }
+        if (config.quotient) {
+            if (placement) {
+                throw std::runtime_error("Quotient tables place keys by hash");
             }
-            throw std::runtime_error("map failed");
+            codec = codec.with_quotient(config.initial_size);
         }
-        data = (uint64_t*)ptr;
-        capacity = config.initial_size;
+        size_t lines = (config.initial_size + codec.per_line - 1) / codec.per_line;
+        size_t bytes = std::max(codec.packed() ? lines * 64 : config.initial_size * slot_words() * sizeof(uint64_t),
+                                4096UL);
+        bool allow_huge = config.initial_size > (1 << 20);
+        mapping = arena ? arena->acquire(bytes, allow_huge) : HugePageMapping(bytes, allow_huge);
+        data = (uint64_t*)mapping.data;
+        capacity = codec.packed() ? lines * codec.per_line : config.initial_size;
+        codec.slots = capacity;
         divider = libdivide::divider(capacity);
     }
 
     ~AdvancedHashSet() {
-        munmap(data, capacity * sizeof(uint64_t));
+        if (arena) {
+            arena->release(std::move(mapping));
+        }
+    }
+
+    PageBacking backing() const {
+        return mapping.backing;
+    }
+
+    int slot_words() const {
+        return group_cells == 4 ? 2 : 1;
+    }
+
+    // Bytes spanned by the slots
+    size_t table_bytes() const {
+        return codec.packed() ? capacity / codec.per_line * 64 : capacity * slot_words() * sizeof(uint64_t);
+    }
+
+    uint8_t *packed_address(size_t i) const {
+        size_t line = i / codec.line_divider;
+        return (uint8_t *)data + line * 64 + (i - line * codec.per_line) * codec.bytes;
+    }
+
+    uint64_t packed_slot(size_t i) const {
+        uint64_t packed;
+        memcpy(&packed, packed_address(i), sizeof(packed));
+        return packed & ((1ULL << (8 * codec.bytes)) - 1);
+    }
+
+    // Slot i, widened if the table is packed
+    uint64_t slot(size_t i) const {
+        if (!codec.packed()) {
+            return data[i];
+        }
+        uint64_t packed = packed_slot(i);
+        return packed ? codec.widen(packed, i) : 0;
+    }
+
+    // First slot probed for a position with sorted lower three tiles
+    size_t home_slot(Position sorted) const {
+        if (codec.quotient) {
+            return codec.split(codec.narrow_key(sorted.bits >> 4)).first;
+        }
+        return placement ? placement->slot(sorted.bits >> 4, capacity) : sorted.hash() % capacity;
     }
 
     bool insert(Position position);
+    bool insert_packed(int index, Position sorted);
+    bool insert_overflow(uint64_t slot);
+    bool insert_grouped(Position position);
+    bool insert_bucketed(int index, Position sorted);
+
+    size_t home_bucket(Position sorted) const {
+        return (unsigned __int128)sorted.hash() * buckets >> 64;
+    }
 
+    // Only valid before gorge; query a finished layer through FrozenLayer
     bool contains(Position position) const {
+        if (group_cells == 4) {
+            return contains_grouped(position);
+        }
         auto [ index, sorted ] = sort_lower_3(position);
-        size_t hash_index = sorted.hash() / divider;
+        if (codec.quotient) {
+            return contains_quotient(index, sorted);
+        }
+        if (buckets) {
+            return contains_bucketed(index, sorted);
+        }
+        size_t hash_index = home_slot(sorted);
 
         uint64_t the_bit = 1ULL << (POSITION_BITS + index);
         while (true) {
-            if ((data[hash_index] << 6 >> 6) == (sorted.bits >> 4)) {
-                return (data[hash_index] & the_bit);
+            uint64_t d = slot(hash_index);
+            if (d == 0) {
+                return false;
+            }
+            if ((d << 6 >> 6) == (sorted.bits >> 4)) {
+                return (d & the_bit);
             }
-            hash_index = (hash_index + 1) % capacity;
+            hash_index = hash_index + 1 == capacity ? 0 : hash_index + 1;
         }
     }
 
+    bool contains_quotient(int index, Position sorted) const;
+    bool contains_grouped(Position position) const;
+    bool contains_bucketed(int index, Position sorted) const;
+
+    // Remove empty slots, widening packed ones
     void gorge();
+    // Give back all memory, leaving an empty table; for a layer that has been copied elsewhere
+    void drop();
+    // gorge, then sort the slots by stored key, in place. The layout is then independent of insertion order
+    // and thread count. With an ordered placement, only a local fix-up is needed.
+    void gorge_sorted();
+    // Drop the slots past capacity
+    void truncate();
+    // Remove empty slots from a packed table and widen the rest, leaving room for spare more. Returns the number
+    // of slots kept.
+    size_t widen_compact(size_t spare = 0);
+    // Replace the grouped slots with ordinary ones, in a new mapping with room for spare more. Returns the number
+    // of slots.
+    size_t split_groups(size_t spare = 0);
+    // Positions of a grouped slot, in perms_4 order; returns how many. out must have room for 32.
+    static int unpack_group(int tile_sum, uint64_t key, uint64_t perms, uint64_t *out);
+    // Slots the layer would take with four cells sorted into each key instead of three; only after gorge
+    size_t count_groups() const;
 
     AdvancedHashSet& operator=(AdvancedHashSet&& rhs) noexcept {
         tile_sum = rhs.tile_sum;
-        if (data) {
-            munmap(data, capacity * sizeof(uint64_t));
+        if (arena) {
+            arena->release(std::move(mapping));
         }
+        mapping = std::move(rhs.mapping);
+        arena = rhs.arena;
+        placement = rhs.placement;
+        codec = rhs.codec;
+        group_cells = rhs.group_cells;
+        buckets = rhs.buckets;
+        overflow = std::move(rhs.overflow);
         data = rhs.data;
         rhs.data = nullptr;
         capacity = rhs.capacity;
@@ -143,35 +448,121 @@ struct AdvancedHashSet {
     }
 
 
+    // The position with sorted lower three tiles stored in a nonzero slot
+    Position stored_position(uint64_t d) const {
+        return stored_position(tile_sum, d);
+    }
+
+    static Position stored_position(int tile_sum, uint64_t d) {
+        uint64_t low_bits = d & ((1ULL << POSITION_BITS) - 1);
+
+        uint32_t recovered_tile = tile_sum - Position(low_bits).tile_sum();
+        assert(recovered_tile == 0 || __builtin_popcount(recovered_tile) == 1);
+        uint64_t recovered_position = (low_bits << 4) | (recovered_tile == 0 ? 0 : __builtin_ctz(recovered_tile));
+        assert(Position(recovered_position).tile_sum() == tile_sum);
+        return Position { recovered_position };
+    }
+
+    // Call f on each position stored in a nonzero slot.
     template <typename F>
-    void for_each_position_parallel(F&& f, int threads=omp_get_max_threads() ) const {
-#pragma omp parallel for num_threads(threads)
-        for (size_t i = 0; i < capacity; ++i) {
-            uint64_t d = data[i];
-            if (d) {
-                uint64_t low_bits = d & ((1ULL << POSITION_BITS) - 1);
-
-                uint32_t recovered_tile = tile_sum - Position(low_bits).tile_sum();
-                assert(recovered_tile == 0 || __builtin_popcount(recovered_tile) == 1);
-                uint64_t recovered_position = (low_bits << 4) | (recovered_tile == 0 ? 0 : __builtin_ctz(recovered_tile));
-                assert(Position(recovered_position).tile_sum() == tile_sum);
-
-                int perms[6] = { 0x012, 0x102, 0x120, 0x210, 0x021, 0x201 };
-                uint64_t perm_list[6];
-                size_t perm_count = 0;
+    void unpack_slot(uint64_t d, F&& f) const {
+        unpack_slot(tile_sum, d, std::forward<F>(f));
+    }
+
+    // Same, for a slot of a layer with the given tile sum stored elsewhere (e.g. EliasFanoLayer)
+    template <typename F>
+    static void unpack_slot(int tile_sum, uint64_t d, F&& f) {
+        uint64_t recovered_position = stored_position(tile_sum, d).bits;
+
+        int perms[6] = { 0x012, 0x102, 0x120, 0x210, 0x021, 0x201 };
+        uint64_t perm_list[6];
+        size_t perm_count = 0;
 #pragma GCC unroll 6
-                for (int perm_i = 0; perm_i < 6; ++perm_i) {
-                    if (((d >> POSITION_BITS) & (1 << perm_i))) {
-                        int perm = perms[perm_i];
-                        Position permed { recovered_position };
-                        for (int j = 0; j < 3; ++j) {
-                            permed = permed.set_tile(j, Position(recovered_position)[(perm >> (4*j)) & 0xf]);
-                        }
-                        perm_list[perm_count++] = permed.bits;
+        for (int perm_i = 0; perm_i < 6; ++perm_i) {
+            if (((d >> POSITION_BITS) & (1 << perm_i))) {
+                int perm = perms[perm_i];
+                Position permed { recovered_position };
+                for (int j = 0; j < 3; ++j) {
+                    permed = permed.set_tile(j, Position(recovered_position)[(perm >> (4*j)) & 0xf]);
+                }
+                perm_list[perm_count++] = permed.bits;
+            }
+        }
+        for (int i = 0; i < perm_count; ++i) {
+            f(Position { perm_list[i] });
+        }
+    }
+
+    // Slots per work item of for_each_position_parallel
+    constexpr static size_t FOR_EACH_CHUNK = 1 << 14;
+
+    template <typename F>
+    void for_each_position_parallel(F&& f, int threads=omp_get_max_threads() ) const {
+        if (codec.packed()) {
+            for_each_packed_position_parallel(f, threads);
+            return;
+        }
+        if (group_cells == 4) {
+            for_each_grouped_position_parallel(f, threads);
+            return;
+        }
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t chunk = 0; chunk < capacity; chunk += FOR_EACH_CHUNK) {
+            TraceScope scope("for_each chunk", chunk / FOR_EACH_CHUNK);
+            size_t chunk_end = std::min(capacity, chunk + FOR_EACH_CHUNK);
+            progress_add(thread_progress().slots_scanned, chunk_end - chunk);
+            for (size_t i = chunk; i < chunk_end; ++i) {
+                if (data[i]) {
+                    unpack_slot(data[i], f);
+                }
+            }
+        }
+    }
+
+    // Same, before gorge on a packed table: a line at a time, widened eight slots at once
+    template <typename F>
+    void for_each_packed_position_parallel(F&& f, int threads) const {
+        const size_t lines = capacity / codec.per_line, chunk_lines = FOR_EACH_CHUNK / codec.per_line;
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t chunk = 0; chunk < lines; chunk += chunk_lines) {
+            TraceScope scope("for_each chunk", chunk / chunk_lines);
+            size_t chunk_end = std::min(lines, chunk + chunk_lines);
+            progress_add(thread_progress().slots_scanned, (chunk_end - chunk) * codec.per_line);
+            alignas(64) uint64_t slots[16];
+            const __m512i lane = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+            for (size_t line = chunk; line < chunk_end; ++line) {
+                const uint8_t *p = (const uint8_t *)data + line * 64;
+                __m512i index = _mm512_add_epi64(_mm512_set1_epi64(line * codec.per_line), lane);
+                _mm512_store_si512(slots, codec.widen(codec.load(p, 8), index));
+                _mm512_store_si512(slots + 8, codec.widen(codec.load(p + 8 * codec.bytes, codec.per_line - 8),
+                                                          _mm512_add_epi64(index, _mm512_set1_epi64(8))));
+                for (int k = 0; k < codec.per_line; ++k) {
+                    if (slots[k]) {
+                        unpack_slot(slots[k], f);
                     }
                 }
-                for (int i = 0; i < perm_count; ++i) {
-                    f(Position { perm_list[i] });
+            }
+        }
+        for (auto [ key, d ] : overflow) {
+            unpack_slot(d, f);
+        }
+    }
+
+    // Same, before gorge on a table with grouped slots
+    template <typename F>
+    void for_each_grouped_position_parallel(F&& f, int threads) const {
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t chunk = 0; chunk < capacity; chunk += FOR_EACH_CHUNK) {
+            TraceScope scope("for_each chunk", chunk / FOR_EACH_CHUNK);
+            size_t chunk_end = std::min(capacity, chunk + FOR_EACH_CHUNK);
+            progress_add(thread_progress().slots_scanned, chunk_end - chunk);
+            alignas(64) uint64_t positions[32];
+            for (size_t i = chunk; i < chunk_end; ++i) {
+                if (data[2 * i]) {
+                    int n = unpack_group(tile_sum, data[2 * i], data[2 * i + 1], positions);
+                    for (int k = 0; k < n; ++k) {
+                        f(Position { positions[k] });
+                    }
                 }
             }
         }
@@ -179,6 +570,23 @@ struct AdvancedHashSet {
 
     size_t parallel_count() const {
         size_t count = 0;
+        if (group_cells == 4) {
+#pragma omp parallel for reduction(+:count)
+            for (size_t i = 0; i < capacity; ++i) {
+                count += __builtin_popcountll(data[2 * i + 1]);
+            }
+            return count;
+        }
+        if (codec.packed()) {
+#pragma omp parallel for reduction(+:count)
+            for (size_t i = 0; i < capacity; ++i) {
+                count += __builtin_popcountll(packed_slot(i) >> codec.key_bits);
+            }
+            for (auto [ key, d ] : overflow) {
+                count += __builtin_popcountll(d >> POSITION_BITS);
+            }
+            return count;
+        }
 #pragma omp parallel for reduction(+:count)
         for (size_t i = 0; i < capacity; ++i) {
             count += __builtin_popcount(data[i] >> POSITION_BITS);
@@ -0,0 +1,884 @@
+// Microbenchmarks for the enumeration kernels. All inputs are generated in-process from the real layer
+// recurrence, so runs are deterministic and need no data files. Results are written as JSON.
+//
+// Usage: bench [--tile-sum N] [--reps N] [--filter substring] [--out results.json] [--stream-bytes N]
+//              [--stream-target 0.7]
+//        bench --scaling [--tile-sum N | --h1-file F --h2-file F] [--max-threads N] [--reps N] [--out results.json]
+//
+// Scaling mode rebuilds one layer at 1, 2, 4, ... threads, pinned with and without SMT siblings, and reports
+// per-phase speedup, parallel efficiency and the bandwidth reached by gorge and parallel_count.
+//
+// The bulk_* results are STREAM-style: each BulkMemory operation over --stream-bytes arrays, reported as a
+// fraction of the best bandwidth reached by plain parallel read and copy loops. Operations below --stream-target are
+// flagged on stderr.
+//
+// The placement results compare hash placement with the order-preserving placement (KeyCdf) on the same layer.
+//
+// The layout results compare linear probing with buckets of 8 slots, at loads from 0.7 to 0.95.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+
+#include "AdvancedHashSet.h"
+#include "BulkLoad.h"
+#include "BulkMemory.h"
+#include "EliasFanoLayer.h"
+#include "Enumeration.h"
+#include "FrozenLayer.h"
+#include "LayerFilter.h"
+#include "LayerMph.h"
+#include "LayerRank.h"
+#include "MoveLUT.h"
+#include "Position.h"
+#include "Prefault.h"
+#include "StupidHashMap.h"
+#include "Topology.h"
+
+template <typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult {
+    std::string kernel;
+    std::string params;
+    size_t items;
+    size_t bytes;  // bytes of memory traffic per repetition, 0 if not meaningful
+    int threads;
+    std::vector<double> seconds;
+};
+
+struct BenchOptions {
+    uint32_t tile_sum = 44;
+    int reps = 5;
+    std::string filter;
+    std::string out;
+    // Thread-scaling mode: rebuild one layer at increasing thread counts instead of running the microbenchmarks
+    bool scaling = false;
+    std::string h1_file, h2_file;
+    int max_threads = omp_get_max_threads();
+    // Array size for the bulk memory benchmarks, and the fraction of peak bandwidth they should reach
+    size_t stream_bytes = 1UL << 30;
+    double stream_target = 0.7;
+};
+
+static std::vector<BenchResult> results;
+static BenchOptions options;
+
+// Run f() options.reps times (after one warmup) and record the wall time of each run. setup() runs before
+// every repetition, outside the timed region. Returns false if the kernel was filtered out, and nothing ran.
+template <typename Setup, typename F>
+bool measure(const std::string& kernel, const std::string& params, size_t items, size_t bytes, Setup&& setup, F&& f) {
+    if (!options.filter.empty() && kernel.find(options.filter) == std::string::npos) {
+        return false;
+    }
+    BenchResult result { kernel, params, items, bytes, omp_get_max_threads(), {} };
+    for (int rep = -1; rep < options.reps; ++rep) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        if (rep >= 0) {
+            result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+        }
+    }
+    std::sort(result.seconds.begin(), result.seconds.end());
+    std::cerr << kernel << " [" << params << "]: " << result.seconds[0] * 1e9 / std::max(items, 1UL) << " ns/item\n";
+    results.push_back(std::move(result));
+    return true;
+}
+
+template <typename F>
+bool measure(const std::string& kernel, const std::string& params, size_t items, size_t bytes, F&& f) {
+    return measure(kernel, params, items, bytes, [] {}, std::forward<F>(f));
+}
+
+// Enumerate layers up to the largest requested tile sum and return the requested layers' positions, sorted.
+std::map<uint32_t, std::vector<uint64_t>> generate_layers(const std::vector<uint32_t>& tile_sums) {
+    std::map<uint32_t, std::vector<uint64_t>> out;
+    uint32_t max_tile_sum = *std::max_element(tile_sums.begin(), tile_sums.end());
+    Enumeration enumeration({ .max_tile_sum = max_tile_sum, .min_capacity = 100000, .verbose = false });
+    enumeration.run([&] (const LayerStats& stats, const AdvancedHashSet& layer) {
+        if (std::find(tile_sums.begin(), tile_sums.end(), stats.tile_sum) != tile_sums.end()) {
+            auto& v = out[stats.tile_sum];
+            layer.for_each_position_parallel([&] (Position p) {
+                v.push_back(p.bits);
+            }, 1);
+            std::sort(v.begin(), v.end());
+        }
+        return true;
+    });
+    return out;
+}
+
+// Read a file of 64-bit positions, raw or compressed, as written by the enumeration.
+std::vector<uint64_t> read_positions_file(const std::string& filename) {
+    TraceScope scope("read positions");
+    PositionsFile file(filename);
+    return std::vector<uint64_t>(file.data, file.data + file.count);
+}
+
+void bench_scalar_kernels(const std::vector<uint64_t>& positions) {
+    const size_t n = positions.size();
+    const std::string params = "tile_sum=" + std::to_string(options.tile_sum);
+
+    // Throughput: independent calls. Latency: each call depends on the previous result.
+    measure("move_right", params + ",mode=throughput", n, 0, [&] {
+        for (size_t i = 0; i < n; ++i) {
+            do_not_optimize(move_right(positions[i]));
+        }
+    });
+    measure("move_right", params + ",mode=latency", n, 0, [&] {
+        uint64_t x = 0;
+        for (size_t i = 0; i < n; ++i) {
+            x = move_right(positions[i] ^ (x & 1));
+        }
+        do_not_optimize(x);
+    });
+
+    measure("canonical_form", params + ",mode=throughput", n, 0, [&] {
+        for (size_t i = 0; i < n; ++i) {
+            do_not_optimize(Position { positions[i] }.canonical_form().bits);
+        }
+    });
+    measure("canonical_form", params + ",mode=latency", n, 0, [&] {
+        uint64_t x = 0;
+        for (size_t i = 0; i < n; ++i) {
+            x = Position { positions[i] ^ (x & 1) }.canonical_form().bits;
+        }
+        do_not_optimize(x);
+    });
+
+    std::vector<uint64_t> scratch(positions);
+    measure("canonicalize_positions", params, n - n % 8, 0, [&] {
+        std::copy(positions.begin(), positions.end(), scratch.begin());
+    }, [&] {
+        for (size_t i = 0; i + 8 <= n; i += 8) {
+            canonicalize_positions(&scratch[i]);
+        }
+        do_not_optimize(scratch[0]);
+    });
+
+    measure("hash", params + ",mode=throughput", n, 0, [&] {
+        for (size_t i = 0; i < n; ++i) {
+            do_not_optimize(Position { positions[i] }.hash());
+        }
+    });
+    measure("hash", params + ",mode=latency", n, 0, [&] {
+        uint64_t x = 0;
+        for (size_t i = 0; i < n; ++i) {
+            x = Position { positions[i] ^ (x & 1) }.hash();
+        }
+        do_not_optimize(x);
+    });
+
+    measure("sort_lower_3", params + ",mode=throughput", n, 0, [&] {
+        for (size_t i = 0; i < n; ++i) {
+            auto [index, sorted] = sort_lower_3(Position { positions[i] });
+            do_not_optimize(sorted.bits + index);
+        }
+    });
+    measure("sort_lower_3", params + ",mode=latency", n, 0, [&] {
+        uint64_t x = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto [index, sorted] = sort_lower_3(Position { positions[i] ^ (x & 1) });
+            x = sorted.bits + index;
+        }
+        do_not_optimize(x);
+    });
+
+    measure("list_successors", params, n, 0, [&] {
+#pragma omp parallel
+        {
+            std::vector<uint64_t> succ;
+#pragma omp for
+            for (size_t i = 0; i < n; ++i) {
+                list_successors(succ, positions[i], 1);
+                do_not_optimize(succ.data());
+            }
+        }
+    });
+}
+
+void bench_hash_set(const std::vector<uint64_t>& positions) {
+    // Insert in a fixed pseudorandom order, as the enumeration would produce them
+    std::vector<uint64_t> shuffled(positions);
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(2048));
+    const size_t n = shuffled.size();
+
+    // Count the number of occupied slots so load factors refer to slots, not positions
+    size_t slots;
+    {
+        AdvancedHashSet probe({ .tile_sum = (int)options.tile_sum, .initial_size = 2 * n + 1000, .load_factor = 1.0 });
+        for (auto p : shuffled) {
+            probe.insert(Position { p });
+        }
+        probe.gorge();
+        slots = probe.capacity;
+    }
+
+    for (double load : { 0.5, 0.7, 0.9, 0.95 }) {
+        size_t capacity = (size_t)(slots / load) + 1;
+        std::unique_ptr<AdvancedHashSet> set;
+        std::ostringstream params;
+        params << "tile_sum=" << options.tile_sum << ",load=" << load;
+        measure("AdvancedHashSet::insert", params.str(), n, 0, [&] {
+            set.reset();
+            set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+                .tile_sum = (int)options.tile_sum, .initial_size = capacity, .load_factor = load });
+        }, [&] {
+#pragma omp parallel for
+            for (size_t i = 0; i < n; ++i) {
+                set->insert(Position { shuffled[i] });
+            }
+        });
+    }
+
+    // Linear probing against buckets of 8 slots (AdvancedHashSet::Config::bucketed): filling, then looking up
+    // every position
+    for (double load : { 0.7, 0.8, 0.9, 0.95 }) {
+        for (bool bucketed : { false, true }) {
+            size_t capacity = (size_t)(slots / load) + 1;
+            std::unique_ptr<AdvancedHashSet> set;
+            std::ostringstream params;
+            params << "tile_sum=" << options.tile_sum << ",load=" << load << ",layout="
+                << (bucketed ? "bucketed" : "linear");
+            auto reset = [&] {
+                set.reset();
+                set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+                    .tile_sum = (int)options.tile_sum, .initial_size = capacity, .load_factor = load,
+                    .bucketed = bucketed });
+            };
+            auto fill = [&] {
+#pragma omp parallel for
+                for (size_t i = 0; i < n; ++i) {
+                    set->insert(Position { shuffled[i] });
+                }
+            };
+            // set is full from the last repetition, or filled here if that was filtered out
+            if (!measure("layout insert", params.str(), n, 0, reset, fill)) {
+                reset();
+                fill();
+            }
+            measure("layout contains", params.str(), n, 0, [&] {
+                size_t found = 0;
+#pragma omp parallel for reduction(+:found)
+                for (size_t i = 0; i < n; ++i) {
+                    found += set->contains(Position { shuffled[i] });
+                }
+                do_not_optimize(found);
+            });
+        }
+    }
+
+    // Table at the load factor main.cpp typically reaches
+    size_t capacity = (size_t)(slots / 0.8) + 1;
+    auto fill = [&] {
+        auto set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+            .tile_sum = (int)options.tile_sum, .initial_size = capacity, .load_factor = 0.8 });
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            set->insert(Position { shuffled[i] });
+        }
+        return set;
+    };
+    const std::string params = "tile_sum=" + std::to_string(options.tile_sum) + ",load=0.8";
+    const size_t bytes = capacity * sizeof(uint64_t);
+
+    auto set = fill();
+    measure("AdvancedHashSet::parallel_count", params, capacity, bytes, [&] {
+        do_not_optimize(set->parallel_count());
+    });
+    measure("AdvancedHashSet::for_each_position_parallel", params, n, bytes, [&] {
+        std::vector<uint64_t> sums(omp_get_max_threads() * 8);
+        set->for_each_position_parallel([&] (Position p) {
+            sums[omp_get_thread_num() * 8] += p.bits;
+        });
+        do_not_optimize(sums.data());
+    });
+    measure("AdvancedHashSet::gorge", params, capacity, 2 * bytes, [&] {
+        set = fill();
+    }, [&] {
+        set->gorge();
+    });
+    measure("AdvancedHashSet::gorge_sorted", params, capacity, 0, [&] {
+        set = fill();
+    }, [&] {
+        set->gorge_sorted();
+    });
+
+    // Building the same sorted layer from a positions list: sorted input skips hashing
+    for (bool sorted : { true, false }) {
+        const std::vector<uint64_t>& input = sorted ? positions : shuffled;
+        std::string bulk_params = "tile_sum=" + std::to_string(options.tile_sum) + (sorted ? ",input=sorted" : ",input=shuffled");
+        measure("bulk_load", bulk_params, n, n * sizeof(uint64_t), [&] {
+            do_not_optimize(bulk_load(input.data(), n, { .tile_sum = (int)options.tile_sum, .sort = true })->capacity);
+        });
+    }
+
+    // Query every position, in insertion order
+    set = fill();
+    set->gorge_sorted();
+    FrozenLayer frozen(*set);
+    std::cerr << "FrozenLayer index: " << frozen.index_bytes() * 8.0 / n << " bits/position\n";
+    measure("FrozenLayer::contains", params, n, 0, [&] {
+        size_t found = 0;
+#pragma omp parallel for reduction(+:found)
+        for (size_t i = 0; i < n; ++i) {
+            found += frozen.contains(Position { shuffled[i] });
+        }
+        do_not_optimize(found);
+    });
+    std::unique_ptr<bool[]> found(new bool[n]);
+    measure("FrozenLayer::contains_batch", params, n, 0, [&] {
+        frozen.contains_batch(shuffled.data(), n, found.get());
+        do_not_optimize(found.get());
+    });
+
+    EliasFanoLayer succinct(*set);
+    std::cerr << "EliasFanoLayer: " << succinct.bytes() * 8.0 / succinct.slots << " bits/slot, "
+        << succinct.low_width << " low bits\n";
+    measure("EliasFanoLayer::for_each_position_parallel", params, n, succinct.bytes(), [&] {
+        std::vector<uint64_t> sums(omp_get_max_threads() * 8);
+        succinct.for_each_position_parallel([&] (Position p) {
+            sums[omp_get_thread_num() * 8] += p.bits;
+        });
+        do_not_optimize(sums.data());
+    });
+    measure("EliasFanoLayer::contains", params, n, 0, [&] {
+        size_t found = 0;
+#pragma omp parallel for reduction(+:found)
+        for (size_t i = 0; i < n; ++i) {
+            found += succinct.contains(Position { shuffled[i] });
+        }
+        do_not_optimize(found);
+    });
+
+    LayerRank ranks(*set);
+    std::vector<uint64_t> indices(n);
+    std::vector<size_t> ranked(n);
+    for (size_t i = 0; i < n; ++i) {
+        indices[i] = (i * 7919) % n;
+    }
+    measure("LayerRank::rank", params, n, 0, [&] {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            ranked[i] = ranks.rank(Position { shuffled[i] });
+        }
+        do_not_optimize(ranked.data());
+    });
+    measure("LayerRank::rank_batch", params, n, 0, [&] {
+        ranks.rank_batch(shuffled.data(), n, ranked.data());
+        do_not_optimize(ranked.data());
+    });
+    std::vector<uint64_t> unranked(n);
+    measure("LayerRank::unrank", params, n, 0, [&] {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            unranked[i] = ranks.unrank(indices[i]).bits;
+        }
+        do_not_optimize(unranked.data());
+    });
+    measure("LayerRank::unrank_batch", params, n, 0, [&] {
+        ranks.unrank_batch(indices.data(), n, unranked.data());
+        do_not_optimize(unranked.data());
+    });
+
+    for (double gamma : { 1.0, 2.0 }) {
+        std::string mph_params = params + ",gamma=" + std::to_string(gamma).substr(0, 3);
+        LayerMph mph;
+        if (!measure("LayerMph::build", mph_params, n, 0, [&] {
+            mph = LayerMph::build(*set, gamma);
+        })) {
+            mph = LayerMph::build(*set, gamma);
+        }
+        std::cerr << "LayerMph: " << mph.bytes() * 8.0 / n << " bits/position, " << mph.level_sizes.size()
+            << " levels, " << mph.leftovers.size() << " leftovers\n";
+        measure("LayerMph::index", mph_params, n, 0, [&] {
+#pragma omp parallel for
+            for (size_t i = 0; i < n; ++i) {
+                ranked[i] = mph.index(Position { shuffled[i] });
+            }
+            do_not_optimize(ranked.data());
+        });
+    }
+
+    // Negatives: members with two cells swapped, where that is not a member
+    std::vector<uint64_t> negatives;
+    std::mt19937_64 rng(44);
+    for (uint64_t m : shuffled) {
+        Position p { m };
+        int a = rng() % 16, b = rng() % 16;
+        Position q = p.set_tile(a, p[b]).set_tile(b, p[a]).canonical_form();
+        if (!frozen.contains(q)) {
+            negatives.push_back(q.bits);
+        }
+    }
+    LayerFilter filter;
+    if (!measure("LayerFilter::build", params, n, 0, [&] {
+        filter = LayerFilter::build(*set);
+    })) {
+        filter = LayerFilter::build(*set);
+    }
+    std::unique_ptr<bool[]> passed(new bool[std::max(n, negatives.size())]);
+    filter.may_contain_batch(negatives.data(), negatives.size(), passed.get());
+    std::cerr << "LayerFilter: " << filter.bytes() * 8.0 / n << " bits/position, "
+        << std::count(passed.get(), passed.get() + negatives.size(), true) / (double)negatives.size()
+        << " false positive rate\n";
+    measure("LayerFilter::may_contain", params + ",queries=negative", negatives.size(), 0, [&] {
+        size_t passed = 0;
+#pragma omp parallel for reduction(+:passed)
+        for (size_t i = 0; i < negatives.size(); ++i) {
+            passed += filter.may_contain(Position { negatives[i] });
+        }
+        do_not_optimize(passed);
+    });
+    measure("LayerFilter::may_contain_batch", params + ",queries=negative", negatives.size(), 0, [&] {
+        filter.may_contain_batch(negatives.data(), negatives.size(), passed.get());
+        do_not_optimize(passed.get());
+    });
+    // Negatives through the index alone, and behind the filter
+    measure("FrozenLayer::contains", params + ",queries=negative", negatives.size(), 0, [&] {
+        size_t found = 0;
+#pragma omp parallel for reduction(+:found)
+        for (size_t i = 0; i < negatives.size(); ++i) {
+            found += frozen.contains(Position { negatives[i] });
+        }
+        do_not_optimize(found);
+    });
+    measure("LayerFilter+FrozenLayer::contains", params + ",queries=negative", negatives.size(), 0, [&] {
+        size_t found = 0;
+#pragma omp parallel for reduction(+:found)
+        for (size_t i = 0; i < negatives.size(); ++i) {
+            Position p { negatives[i] };
+            found += filter.may_contain(p) && frozen.contains(p);
+        }
+        do_not_optimize(found);
+    });
+}
+
+// Hash placement against the order-preserving placement of Enumeration::Config::ordered_placement, on the real
+// layer tile_sum with the model fitted from the layers it is built from. Besides the insert and gorge_sorted
+// timings, prints the probe displacement and how sorted the gorged table is to stderr.
+void bench_placement(const std::vector<uint64_t>& h1_positions, const std::vector<uint64_t>& h2_positions,
+                     const std::vector<uint64_t>& positions) {
+    auto build = [] (const std::vector<uint64_t>& layer) {
+        auto set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+            .tile_sum = (int)Position(layer[0]).tile_sum(), .initial_size = 2 * layer.size() + 1000,
+            .load_factor = 0.5 });
+#pragma omp parallel for
+        for (size_t i = 0; i < layer.size(); ++i) {
+            set->insert(Position { layer[i] });
+        }
+        set->gorge();
+        return set;
+    };
+    KeyCdf cdf = fit_successor_cdf(*build(h1_positions), *build(h2_positions), 1 << 20);
+
+    std::vector<uint64_t> shuffled(positions);
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(2048));
+    const size_t n = shuffled.size();
+    size_t slots = build(positions)->capacity;
+    constexpr uint64_t key_mask = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+
+    for (bool ordered : { false, true }) {
+        for (double load : { 0.7, 0.8, 0.9 }) {
+            size_t capacity = (size_t)(slots / load) + 1;
+            std::ostringstream params;
+            params << "tile_sum=" << options.tile_sum << ",load=" << load << ",placement=" << (ordered ? "cdf" : "hash");
+            std::unique_ptr<AdvancedHashSet> set;
+            auto reset = [&] {
+                set.reset();
+                set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+                    .tile_sum = (int)options.tile_sum, .initial_size = capacity, .load_factor = load,
+                    .placement = ordered ? &cdf : nullptr });
+            };
+            auto fill = [&] {
+#pragma omp parallel for
+                for (size_t i = 0; i < n; ++i) {
+                    set->insert(Position { shuffled[i] });
+                }
+            };
+            // set is full from the last repetition, or filled here if that was filtered out
+            if (!measure("placement insert", params.str(), n, 0, reset, fill)) {
+                reset();
+                fill();
+            }
+            size_t total = 0, longest = 0;
+#pragma omp parallel for reduction(+:total) reduction(max:longest)
+            for (size_t i = 0; i < capacity; ++i) {
+                if (set->data[i]) {
+                    size_t home = set->home_slot(set->stored_position(set->data[i]));
+                    size_t displacement = (i + capacity - home) % capacity;
+                    total += displacement;
+                    longest = std::max(longest, displacement);
+                }
+            }
+            set->gorge();
+            size_t in_order = 0;
+#pragma omp parallel for reduction(+:in_order)
+            for (size_t i = 1; i < set->capacity; ++i) {
+                in_order += (set->data[i - 1] & key_mask) < (set->data[i] & key_mask);
+            }
+            std::cerr << "placement [" << params.str() << "]: mean displacement " << total / (double)slots
+                << ", max " << longest << ", " << in_order / (double)std::max<size_t>(set->capacity - 1, 1)
+                << " of neighbours in order after gorge\n";
+
+            measure("placement gorge_sorted", params.str(), capacity, 0, [&] {
+                reset();
+                fill();
+            }, [&] {
+                set->gorge_sorted();
+            });
+        }
+    }
+}
+
+void bench_stupid_hash_map(const std::vector<uint64_t>& positions) {
+    const size_t n = positions.size();
+    std::unique_ptr<StupidHashMap> map;
+    std::vector<uint64_t> out;
+    const std::string params = "tile_sum=" + std::to_string(options.tile_sum);
+
+    const uint64_t needed = (uint64_t)(n / 0.7);
+    const size_t bytes = (1ULL << std::max(64 - __builtin_clzll(needed - 1), MIN_CAP_LG2)) * sizeof(uint64_t);
+
+    // parallel_copy_into drains the map, so it is refilled before every repetition
+    measure("StupidHashMap::parallel_copy_into", params, n, 2 * bytes, [&] {
+        map.reset();
+        map = std::make_unique<StupidHashMap>(needed);
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            map->insert(positions[i]);
+        }
+    }, [&] {
+        map->parallel_copy_into(out);
+    });
+}
+
+// Best bandwidth of the plain STREAM-style loops, the reference for the bulk operations
+static double peak_gb_per_second = 0;
+
+void bench_bulk_memory() {
+    const size_t bytes = options.stream_bytes - options.stream_bytes % 256;
+    const size_t n = bytes / sizeof(uint64_t);
+    const std::string params = "bytes=" + std::to_string(bytes);
+    HugePageMapping a(bytes), b(bytes);
+    uint64_t *src = (uint64_t*)a.data, *dst = (uint64_t*)b.data;
+    populate_parallel(a.data, bytes);
+    populate_parallel(b.data, bytes);
+
+    // Half the words nonzero, in a pattern with no runs for compact
+    auto fill = [&] {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            src[i] = (i * 0x9e3779b97f4a7c15ULL) >> 63 ? i + 1 : 0;
+        }
+    };
+    fill();
+
+    measure("stream_read", params, n, bytes, [&] {
+        uint64_t sum = 0;
+#pragma omp parallel reduction(+:sum)
+        {
+            // Independent accumulators so the loop is bound by loads, not add latency
+            __m512i acc[4] = {};
+#pragma omp for
+            for (size_t i = 0; i < n; i += 32) {
+                for (int j = 0; j < 4; ++j) {
+                    acc[j] = _mm512_add_epi64(acc[j], _mm512_load_si512(&src[i + 8 * j]));
+                }
+            }
+            for (int j = 0; j < 4; ++j) {
+                sum += _mm512_reduce_add_epi64(acc[j]);
+            }
+        }
+        do_not_optimize(sum);
+    });
+    measure("stream_copy", params, n, 2 * bytes, [&] {
+#pragma omp parallel for
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] = src[i];
+        }
+        do_not_optimize(dst[0]);
+    });
+    measure("bulk_copy", params, n, 2 * bytes, [&] {
+        bulk_copy(dst, src, bytes);
+    });
+    // Slide down by an eighth, as gorge does with live ranges
+    measure("bulk_move", params + ",overlap=7/8", n, 2 * bytes * 7 / 8, [&] {
+        bulk_move(dst, dst + n / 8, bytes * 7 / 8);
+    });
+    measure("bulk_clear", params, n, bytes, [&] {
+        bulk_clear(dst, bytes);
+    });
+    measure("bulk_compact", params + ",density=0.5", n, bytes + bytes / 2, [&] {
+        do_not_optimize(bulk_compact(dst, src, n));
+    });
+    measure("bulk_compact", params + ",density=0.5,in_place", n, bytes + bytes / 2, fill, [&] {
+        do_not_optimize(bulk_compact(src, src, n));
+    });
+
+    for (auto& r : results) {
+        if (r.kernel.starts_with("stream_")) {
+            peak_gb_per_second = std::max(peak_gb_per_second, r.bytes / r.seconds.front() / 1e9);
+        }
+    }
+    for (auto& r : results) {
+        double fraction = r.bytes / r.seconds.front() / 1e9 / peak_gb_per_second;
+        if (!r.kernel.starts_with("bulk_") || !peak_gb_per_second || fraction >= options.stream_target) {
+            continue;
+        }
+        std::cerr << r.kernel << " [" << r.params << "] reaches only " << fraction * 100 << "% of "
+            << peak_gb_per_second << " GB/s\n";
+    }
+}
+
+struct ScalingResult {
+    int threads;
+    bool smt;
+    std::string phase;
+    double seconds;
+    size_t bytes;  // memory traffic of the phase, 0 if not meaningful
+};
+
+// Rebuild layer h1 + 4 from h1 (tile sum s - 4) and h2 (tile sum s - 2) at 1, 2, 4, ... threads, with and
+// without SMT siblings, timing each phase of the layer loop.
+std::vector<ScalingResult> run_scaling(const std::vector<uint64_t>& h1_positions, const std::vector<uint64_t>& h2_positions) {
+    auto topology = read_cpu_topology();
+    bool has_smt = std::any_of(topology.begin(), topology.end(), [] (auto& c) { return c.smt_index > 0; });
+    int cores = pick_cpus(topology, topology.size(), false).size();
+    int tile_sum = Position(h2_positions.at(0)).tile_sum() + 2;
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < options.max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(options.max_threads);
+
+    auto build = [&] (const std::vector<uint64_t>& positions) {
+        auto set = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+            .tile_sum = (int)Position(positions.at(0)).tile_sum(), .initial_size = positions.size() + 1000, .load_factor = 1.0 });
+#pragma omp parallel for
+        for (size_t i = 0; i < positions.size(); ++i) {
+            set->insert(Position { positions[i] });
+        }
+        set->gorge();
+        return set;
+    };
+
+    std::vector<ScalingResult> out;
+    for (bool smt : { false, true }) {
+        if (smt && !has_smt) {
+            continue;
+        }
+        for (int threads : thread_counts) {
+            if (!smt && threads > cores) {
+                continue;
+            }
+            auto cpus = pick_cpus(topology, threads, smt);
+            omp_set_num_threads(threads);
+#pragma omp parallel num_threads(threads)
+            {
+                pin_current_thread({ cpus[omp_get_thread_num() % cpus.size()] });
+            }
+
+            auto h1 = build(h1_positions), h2 = build(h2_positions);
+            std::map<std::string, std::pair<double, size_t>> best;
+            auto record = [&] (const std::string& phase, size_t bytes, auto&& f) {
+                auto start = std::chrono::steady_clock::now();
+                f();
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                auto it = best.find(phase);
+                if (it == best.end() || seconds < it->second.first) {
+                    best[phase] = { seconds, bytes };
+                }
+            };
+
+            for (int rep = 0; rep < options.reps; ++rep) {
+                // Sized as Enumeration would, from the growth of h2 over h1
+                double projected = h2->capacity * ((double)h2->capacity / h1->capacity);
+                AdvancedHashSet h3({ .tile_sum = tile_sum,
+                    .initial_size = std::max<size_t>(projected / 0.9, 100000), .load_factor = 1.0 });
+                auto expand = [&] (const AdvancedHashSet& from, int tile) {
+                    from.for_each_position_parallel([&] (Position p) {
+                        thread_local std::vector<uint64_t> next;
+                        list_successors(next, p.bits, tile);
+                        for (auto s : next) {
+                            h3.insert(Position { s });
+                        }
+                    }, threads);
+                };
+                record("insert_h1", 0, [&] { expand(*h1, 2); });
+                record("insert_h2", 0, [&] { expand(*h2, 1); });
+                size_t table_bytes = h3.capacity * sizeof(uint64_t);
+                record("parallel_count", table_bytes, [&] { do_not_optimize(h3.parallel_count()); });
+                record("gorge", 2 * table_bytes, [&] { h3.gorge(); });
+            }
+            for (auto& [phase, r] : best) {
+                out.push_back({ threads, smt, phase, r.first, r.second });
+                std::cerr << "threads=" << threads << (smt ? " smt " : " ") << phase << ": " << r.first << " s\n";
+            }
+        }
+    }
+
+#pragma omp parallel
+    {
+        pin_current_thread({});
+    }
+    omp_set_num_threads(options.max_threads);
+    return out;
+}
+
+void write_scaling_json(std::ostream& out, const std::vector<ScalingResult>& scaling, size_t h1_count, size_t h2_count) {
+    out << "{\n  \"h1_positions\": " << h1_count << ",\n  \"h2_positions\": " << h2_count
+        << ",\n  \"reps\": " << options.reps << ",\n  \"scaling\": [\n";
+    for (size_t i = 0; i < scaling.size(); ++i) {
+        auto& r = scaling[i];
+        // Speedup relative to one thread in the same phase
+        double single = r.seconds;
+        for (auto& s : scaling) {
+            if (s.threads == 1 && s.phase == r.phase) {
+                single = s.seconds;
+            }
+        }
+        double speedup = single / r.seconds;
+        out << "    { \"threads\": " << r.threads << ", \"smt\": " << (r.smt ? "true" : "false")
+            << ", \"phase\": \"" << r.phase << "\", \"seconds\": " << r.seconds
+            << ", \"speedup\": " << speedup << ", \"efficiency\": " << speedup / r.threads;
+        if (r.bytes) {
+            out << ", \"gb_per_second\": " << r.bytes / r.seconds / 1e9;
+        }
+        out << " }" << (i + 1 < scaling.size() ? "," : "") << '\n';
+    }
+    out << "  ]\n}\n";
+}
+
+void write_json(std::ostream& out, const std::vector<uint64_t>& positions) {
+    out << "{\n  \"tile_sum\": " << options.tile_sum
+        << ",\n  \"dataset_positions\": " << positions.size()
+        << ",\n  \"max_threads\": " << omp_get_max_threads()
+        << ",\n  \"reps\": " << options.reps
+        << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& r = results[i];
+        double best = r.seconds.front(), median = r.seconds[r.seconds.size() / 2];
+        out << "    { \"kernel\": \"" << r.kernel << "\", \"params\": \"" << r.params
+            << "\", \"items\": " << r.items << ", \"threads\": " << r.threads
+            << ", \"best_seconds\": " << best << ", \"median_seconds\": " << median
+            << ", \"items_per_second\": " << r.items / best
+            << ", \"ns_per_item\": " << best * 1e9 / std::max(r.items, 1UL);
+        if (r.bytes) {
+            out << ", \"gb_per_second\": " << r.bytes / best / 1e9;
+        }
+        if (r.bytes && peak_gb_per_second && r.kernel.starts_with("bulk_")) {
+            out << ", \"fraction_of_peak\": " << r.bytes / best / 1e9 / peak_gb_per_second;
+        }
+        out << " }" << (i + 1 < results.size() ? "," : "") << '\n';
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        auto arg = [&] {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << argv[i] << '\n';
+                exit(1);
+            }
+            return std::string(argv[++i]);
+        };
+        if (!strcmp(argv[i], "--tile-sum")) {
+            options.tile_sum = std::stoul(arg());
+        } else if (!strcmp(argv[i], "--reps")) {
+            options.reps = std::max(1, std::stoi(arg()));
+        } else if (!strcmp(argv[i], "--filter")) {
+            options.filter = arg();
+        } else if (!strcmp(argv[i], "--out")) {
+            options.out = arg();
+        } else if (!strcmp(argv[i], "--scaling")) {
+            options.scaling = true;
+        } else if (!strcmp(argv[i], "--h1-file")) {
+            options.h1_file = arg();
+        } else if (!strcmp(argv[i], "--h2-file")) {
+            options.h2_file = arg();
+        } else if (!strcmp(argv[i], "--max-threads")) {
+            options.max_threads = std::max(1, std::stoi(arg()));
+        } else if (!strcmp(argv[i], "--stream-bytes")) {
+            options.stream_bytes = std::max(256UL, std::stoul(arg()));
+        } else if (!strcmp(argv[i], "--stream-target")) {
+            options.stream_target = std::stod(arg());
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--tile-sum N] [--reps N] [--filter substring] [--out file.json]"
+                " [--stream-bytes N] [--stream-target 0.7]\n"
+                "       " << argv[0] << " --scaling [--tile-sum N | --h1-file F --h2-file F] [--max-threads N] [--reps N] [--out file.json]\n";
+            return 1;
+        }
+    }
+    if (options.tile_sum < 4 || options.tile_sum % 2) {
+        std::cerr << "Tile sum must be even and at least 4\n";
+        return 1;
+    }
+
+    auto emit = [&] (auto&& write) {
+        if (options.out.empty()) {
+            write(std::cout);
+        } else {
+            std::ofstream file(options.out);
+            write(file);
+        }
+    };
+
+    if (options.scaling) {
+        // Inputs are the two layers that layer --tile-sum is built from
+        std::vector<uint64_t> h1, h2;
+        if (!options.h1_file.empty() && !options.h2_file.empty()) {
+            h1 = read_positions_file(options.h1_file);
+            h2 = read_positions_file(options.h2_file);
+        } else {
+            if (options.tile_sum < 12) {
+                std::cerr << "Scaling mode needs a tile sum of at least 12\n";
+                return 1;
+            }
+            std::cerr << "Generating layers " << options.tile_sum - 4 << " and " << options.tile_sum - 2 << "...\n";
+            auto layers = generate_layers({ options.tile_sum - 4, options.tile_sum - 2 });
+            h1 = std::move(layers[options.tile_sum - 4]);
+            h2 = std::move(layers[options.tile_sum - 2]);
+        }
+        if (h1.empty() || h2.empty() || Position(h2[0]).tile_sum() != Position(h1[0]).tile_sum() + 2) {
+            std::cerr << "Input layers must be non-empty with consecutive tile sums\n";
+            return 1;
+        }
+        auto scaling = run_scaling(h1, h2);
+        emit([&] (std::ostream& out) { write_scaling_json(out, scaling, h1.size(), h2.size()); });
+        return 0;
+    }
+
+    std::cerr << "Generating layer " << options.tile_sum << "...\n";
+    // The layers it is built from are only needed for bench_placement
+    auto layers = generate_layers(options.tile_sum >= 12
+        ? std::vector<uint32_t> { options.tile_sum - 4, options.tile_sum - 2, options.tile_sum }
+        : std::vector<uint32_t> { options.tile_sum });
+    auto positions = std::move(layers[options.tile_sum]);
+    std::cerr << positions.size() << " positions\n";
+
+    bench_scalar_kernels(positions);
+    bench_hash_set(positions);
+    if (options.tile_sum >= 12) {
+        bench_placement(layers[options.tile_sum - 4], layers[options.tile_sum - 2], positions);
+    }
+    bench_stupid_hash_map(positions);
+    bench_bulk_memory();
+
+    emit([&] (std::ostream& out) { write_json(out, positions); });
+}
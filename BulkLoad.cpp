@@ -0,0 +1,236 @@
+#include "BulkLoad.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <omp.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "Trace.h"
+
+constexpr uint32_t ZSTD_FRAME_MAGIC = 0xfd2fb528;
+constexpr int POSITION_BITS = AdvancedHashSet::POSITION_BITS;
+constexpr uint64_t KEY_MASK = (1ULL << POSITION_BITS) - 1;
+
+PositionsFile::PositionsFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Could not stat " + filename);
+    }
+    map_bytes = st.st_size;
+    if (map_bytes == 0) {
+        close(fd);
+        return;
+    }
+    map = mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = nullptr;
+        throw std::runtime_error("Could not map " + filename);
+    }
+    // The loader walks the file in a few large sequential streams
+    madvise(map, map_bytes, MADV_SEQUENTIAL);
+    madvise(map, map_bytes, MADV_WILLNEED);
+
+    if (map_bytes < 4 || *(const uint32_t *)map != ZSTD_FRAME_MAGIC) {
+        if (map_bytes % sizeof(uint64_t)) {
+            munmap(map, map_bytes);
+            throw std::runtime_error(filename + " is not a whole number of positions");
+        }
+        data = (const uint64_t *)map;
+        count = map_bytes / sizeof(uint64_t);
+        return;
+    }
+
+    TraceScope scope("decompress positions");
+    compressed = true;
+    unsigned long long content = ZSTD_getFrameContentSize(map, map_bytes);
+    size_t capacity = content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR ? content
+        : 4 * map_bytes;
+    decompressed.resize(capacity / sizeof(uint64_t) + 1);
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_inBuffer in { map, map_bytes, 0 };
+    size_t out_pos = 0, ret = 0;
+    while (in.pos < in.size || ret != 0) {
+        if (out_pos == decompressed.size() * sizeof(uint64_t)) {
+            decompressed.resize(decompressed.size() * 2);
+        }
+        ZSTD_outBuffer out { decompressed.data(), decompressed.size() * sizeof(uint64_t), out_pos };
+        size_t in_before = in.pos;
+        ret = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(ret) || (in.pos == in_before && out.pos == out_pos)) {
+            ZSTD_freeDCtx(dctx);
+            munmap(map, map_bytes);
+            throw std::runtime_error("Could not decompress " + filename + (ZSTD_isError(ret)
+                ? std::string(": ") + ZSTD_getErrorName(ret) : std::string(": truncated")));
+        }
+        out_pos = out.pos;
+    }
+    ZSTD_freeDCtx(dctx);
+    munmap(map, map_bytes);
+    map = nullptr;
+    decompressed.resize(out_pos / sizeof(uint64_t));
+    data = decompressed.data();
+    count = decompressed.size();
+}
+
+PositionsFile::~PositionsFile() {
+    if (map) {
+        munmap(map, map_bytes);
+    }
+}
+
+// Tile sums of eight positions
+static __m512i tile_sums(__m512i p) {
+    __m512i sum = _mm512_setzero_si512(), one = _mm512_set1_epi64(1), nibble_mask = _mm512_set1_epi64(0xf);
+#pragma GCC unroll 16
+    for (int i = 0; i < 16; ++i) {
+        __m512i nibble = _mm512_and_si512(_mm512_srli_epi64(p, 4 * i), nibble_mask);
+        // 2^nibble, or 0 for an empty cell
+        sum = _mm512_add_epi64(sum, _mm512_maskz_sllv_epi64(_mm512_test_epi64_mask(nibble, nibble), one, nibble));
+    }
+    return sum;
+}
+
+// Load up to eight positions from i; lanes past count are zero
+static __m512i load_positions(const uint64_t *positions, size_t i, size_t count, __mmask8& valid) {
+    valid = count - i >= 8 ? 0xff : (1 << (count - i)) - 1;
+    return _mm512_maskz_loadu_epi64(valid, positions + i);
+}
+
+// Sorted input: positions sharing cells 3-15 are contiguous, and their keys differ only in the bottom three
+// cells, so sorting each such run by key puts the whole layer in key order. Calls emit on each slot in order.
+template <typename F>
+static void for_each_sorted_slot(const uint64_t *positions, size_t begin, size_t end, F&& emit) {
+    std::vector<uint64_t> run;
+    for (size_t i = begin; i < end; ) {
+        size_t j = i;
+        run.clear();
+        for (; j < end && (positions[j] >> 12) == (positions[i] >> 12); ++j) {
+            auto [ index, sorted ] = sort_lower_3(Position { positions[j] });
+            run.push_back(1ULL << (POSITION_BITS + index) | sorted.bits >> 4);
+        }
+        std::sort(run.begin(), run.end(), [] (uint64_t a, uint64_t b) {
+            return (a & KEY_MASK) < (b & KEY_MASK);
+        });
+        for (size_t k = 0; k < run.size(); ) {
+            uint64_t slot = run[k++];
+            while (k < run.size() && (run[k] & KEY_MASK) == (slot & KEY_MASK)) {
+                slot |= run[k++];
+            }
+            emit(slot);
+        }
+        i = j;
+    }
+}
+
+std::unique_ptr<AdvancedHashSet> bulk_load(const uint64_t *positions, size_t count, const BulkLoadConfig& config,
+                                           BulkLoadStats *stats) {
+    TraceScope scope("bulk load");
+    BulkLoadStats local;
+    stats = stats ? stats : &local;
+    *stats = {};
+    stats->positions = count;
+    if (count == 0) {
+        throw std::runtime_error("No positions to load");
+    }
+    int tile_sum = config.tile_sum ? config.tile_sum : (int)Position(positions[0]).canonical_form().tile_sum();
+
+    // Validate: tile sums, canonical form and order, in chunks per thread
+    auto start = std::chrono::steady_clock::now();
+    int chunks = omp_get_max_threads() * 4;
+    size_t chunk_size = (count / chunks + 8) / 8 * 8;
+    size_t wrong_sum = 0, canonicalized = 0, unsorted = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:wrong_sum, canonicalized, unsorted)
+    for (int c = 0; c < chunks; ++c) {
+        size_t begin = std::min(count, c * chunk_size), end = std::min(count, begin + chunk_size);
+        uint64_t previous = begin ? positions[begin - 1] : 0;
+        for (size_t i = begin; i < end; i += 8) {
+            __mmask8 valid;
+            __m512i p = load_positions(positions, i, end, valid), canonical = canonicalize_positions(p);
+            wrong_sum += __builtin_popcount(_mm512_mask_cmpneq_epi64_mask(valid, tile_sums(canonical),
+                _mm512_set1_epi64(tile_sum)));
+            canonicalized += __builtin_popcount(_mm512_mask_cmpneq_epi64_mask(valid, p, canonical));
+            // Each lane against the one before it
+            __m512i before = _mm512_alignr_epi64(p, _mm512_set1_epi64(previous), 7);
+            unsorted += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(valid, p, before));
+            previous = positions[std::min(end, i + 8) - 1];
+        }
+    }
+    if (wrong_sum) {
+        throw std::runtime_error(std::to_string(wrong_sum) + " positions do not have tile sum "
+            + std::to_string(tile_sum));
+    }
+    stats->canonicalized = canonicalized;
+    stats->sorted_path = config.sorted_fast_path && !unsorted && !canonicalized;
+    auto validated = std::chrono::steady_clock::now();
+    stats->validate_seconds = std::chrono::duration<double>(validated - start).count();
+
+    std::unique_ptr<AdvancedHashSet> layer;
+    if (stats->sorted_path) {
+        TraceScope sorted_scope("bulk load sorted");
+        // Chunk boundaries move forward to the start of a run, so runs are never split
+        std::vector<size_t> bounds(chunks + 1, count);
+        for (int c = 0; c < chunks; ++c) {
+            size_t b = std::min(count, c * chunk_size);
+            while (b > 0 && b < count && (positions[b] >> 12) == (positions[b - 1] >> 12)) {
+                ++b;
+            }
+            bounds[c] = b;
+        }
+        std::vector<size_t> offsets(chunks + 1);
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int c = 0; c < chunks; ++c) {
+            size_t slots = 0;
+            for_each_sorted_slot(positions, bounds[c], std::max(bounds[c], bounds[c + 1]), [&] (uint64_t) {
+                slots++;
+            });
+            offsets[c + 1] = slots;
+        }
+        for (int c = 0; c < chunks; ++c) {
+            offsets[c + 1] += offsets[c];
+        }
+        layer = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+            .tile_sum = tile_sum, .initial_size = offsets[chunks], .load_factor = 1.0 });
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int c = 0; c < chunks; ++c) {
+            uint64_t *out = layer->data + offsets[c];
+            for_each_sorted_slot(positions, bounds[c], std::max(bounds[c], bounds[c + 1]), [&] (uint64_t slot) {
+                *out++ = slot;
+            });
+        }
+        layer->truncate();
+    } else {
+        TraceScope hash_scope("bulk load hashed");
+        layer = std::make_unique<AdvancedHashSet>(AdvancedHashSet::Config {
+            .tile_sum = tile_sum, .initial_size = (size_t)(count / config.load_factor) + 64,
+            .load_factor = config.load_factor });
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < count; i += 8) {
+            __mmask8 valid;
+            alignas(64) uint64_t lanes[8];
+            _mm512_store_si512(lanes, canonicalize_positions(load_positions(positions, i, count, valid)));
+            for (int lane = 0; lane < __builtin_popcount(valid); ++lane) {
+                layer->insert(Position { lanes[lane] });
+            }
+        }
+        if (config.sort) {
+            layer->gorge_sorted();
+        } else {
+            layer->gorge();
+        }
+    }
+    stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - validated).count();
+    return layer;
+}
@@ -0,0 +1,66 @@
+//
+// Created by root on 7/3/25.
+//
+
+#ifndef BULKLOAD_H
+#define BULKLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AdvancedHashSet.h"
+
+// A file of 64-bit positions, raw or zstd-compressed (detected from the frame magic). Raw files are mapped,
+// so pages are read as the loader touches them; compressed ones are decompressed into memory up front.
+// Throws std::runtime_error on I/O or decompression errors.
+struct PositionsFile {
+    const uint64_t *data = nullptr;
+    size_t count = 0;
+    bool compressed = false;
+
+    explicit PositionsFile(const std::string& filename);
+    ~PositionsFile();
+    PositionsFile(const PositionsFile&) = delete;
+    PositionsFile& operator=(const PositionsFile&) = delete;
+
+private:
+    void *map = nullptr;
+    size_t map_bytes = 0;
+    std::vector<uint64_t> decompressed;
+};
+
+struct BulkLoadConfig {
+    // Tile sum of the layer; 0 takes it from the first position
+    int tile_sum = 0;
+    // Load factor of the table on the hashing path
+    double load_factor = 0.8;
+    // Sort the table after gorge on the hashing path; the sorted path always produces a sorted table
+    bool sort = false;
+    // If the positions turn out to be sorted, write the gorged slots directly instead of hashing
+    bool sorted_fast_path = true;
+};
+
+struct BulkLoadStats {
+    size_t positions = 0;  // read, including duplicates
+    size_t canonicalized = 0;  // that were not in canonical form
+    bool sorted_path = false;
+    double validate_seconds = 0;
+    double build_seconds = 0;
+};
+
+// Build a gorged layer from positions, which all need the same tile sum (else std::runtime_error). The
+// positions are canonicalized and checked eight at a time with AVX-512. If they are sorted and canonical, slots
+// are assembled in key order straight from the input, in parallel, with no hashing: the result is the same as
+// gorge_sorted would produce. Otherwise they are inserted into a table in parallel and gorged.
+std::unique_ptr<AdvancedHashSet> bulk_load(const uint64_t *positions, size_t count, const BulkLoadConfig& config = {},
+                                           BulkLoadStats *stats = nullptr);
+
+inline std::unique_ptr<AdvancedHashSet> bulk_load(const PositionsFile& file, const BulkLoadConfig& config = {},
+                                                  BulkLoadStats *stats = nullptr) {
+    return bulk_load(file.data, file.count, config, stats);
+}
+
+#endif //BULKLOAD_H
@@ -0,0 +1,307 @@
+#include "BulkMemory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <immintrin.h>
+#include <memory>
+#include <omp.h>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Trace.h"
+
+// Copy with 64-byte stores; dst is 64-byte aligned
+static void copy_lines(char *dst, const char *src, size_t bytes, bool nt) {
+    size_t i = 0;
+    if (nt) {
+        for (; i + 64 <= bytes; i += 64) {
+            _mm512_stream_si512((__m512i*)(dst + i), _mm512_loadu_si512(src + i));
+        }
+        _mm_sfence();
+    } else {
+        for (; i + 64 <= bytes; i += 64) {
+            _mm512_store_si512(dst + i, _mm512_loadu_si512(src + i));
+        }
+    }
+    memcpy(dst + i, src + i, bytes - i);
+}
+
+static void clear_lines(char *dst, size_t bytes, bool nt) {
+    size_t i = 0;
+    if (nt) {
+        for (; i + 64 <= bytes; i += 64) {
+            _mm512_stream_si512((__m512i*)(dst + i), _mm512_setzero_si512());
+        }
+        _mm_sfence();
+    } else {
+        for (; i + 64 <= bytes; i += 64) {
+            _mm512_store_si512(dst + i, _mm512_setzero_si512());
+        }
+    }
+    memset(dst + i, 0, bytes - i);
+}
+
+// Call f(thread, begin, end) on one contiguous block of [0, n) per thread, with block boundaries at multiples
+// of granule.
+template <typename F>
+static void for_each_block(size_t n, size_t granule, F&& f) {
+#pragma omp parallel
+    {
+        size_t threads = omp_get_num_threads(), t = omp_get_thread_num();
+        size_t units = n / granule;
+        size_t begin = units * t / threads * granule;
+        size_t end = t + 1 == threads ? n : units * (t + 1) / threads * granule;
+        f(t, begin, end);
+    }
+}
+
+void bulk_copy(void *dst, const void *src, size_t bytes) {
+    char *d = (char*)dst;
+    const char *s = (const char*)src;
+    if (bytes < BULK_PARALLEL_THRESHOLD) {
+        memcpy(d, s, bytes);
+        return;
+    }
+    // Align the destination so the main loop can use aligned (and streaming) stores
+    size_t head = (64 - (uintptr_t)d % 64) % 64;
+    memcpy(d, s, head);
+    bool nt = bytes >= BULK_NT_THRESHOLD;
+    for_each_block(bytes - head, 64, [&] (size_t, size_t begin, size_t end) {
+        copy_lines(d + head + begin, s + head + begin, end - begin, nt);
+    });
+}
+
+void bulk_move(void *dst, const void *src, size_t bytes) {
+    char *d = (char*)dst;
+    const char *s = (const char*)src;
+    size_t distance = d > s ? d - s : s - d;
+    if (distance >= bytes) {
+        bulk_copy(dst, src, bytes);
+        return;
+    }
+    size_t threads = omp_get_max_threads();
+    if (bytes < BULK_PARALLEL_THRESHOLD || threads == 1) {
+        memmove(dst, src, bytes);
+        return;
+    }
+    if (distance < BULK_PARALLEL_THRESHOLD && (distance + 128) * threads <= bytes) {
+        // Steps of distance would be too short to split, so each thread moves one block of more than distance
+        // bytes. A block's source runs distance bytes into the destination of the neighbouring block on the side
+        // the data comes from, which that block's thread may overwrite first; every thread saves those bytes of
+        // its source before a barrier, and writes them from the copy afterwards.
+        for_each_block(bytes, 64, [&] (size_t, size_t begin, size_t end) {
+            std::unique_ptr<char[]> seam(new char[distance]);
+            bool down = d < s, edge = down ? end == bytes : begin == 0;
+            if (!edge) {
+                memcpy(seam.get(), s + (down ? end - distance : begin), distance);
+            }
+#pragma omp barrier
+            if (edge) {
+                memmove(d + begin, s + begin, end - begin);
+            } else if (down) {
+                memmove(d + begin, s + begin, end - begin - distance);
+                memcpy(d + end - distance, seam.get(), distance);
+            } else {
+                memmove(d + begin + distance, s + begin + distance, end - begin - distance);
+                memcpy(d + begin, seam.get(), distance);
+            }
+        });
+        return;
+    }
+    // Move in steps of distance, starting at the end that is read before it is overwritten. Within a step the
+    // source and destination don't overlap, and earlier steps only overwrote source bytes already moved.
+    if (d < s) {
+        for (size_t offset = 0; offset < bytes; offset += distance) {
+            bulk_copy(d + offset, s + offset, std::min(distance, bytes - offset));
+        }
+    } else {
+        for (size_t end = bytes; end > 0; ) {
+            size_t step = std::min(distance, end);
+            end -= step;
+            bulk_copy(d + end, s + end, step);
+        }
+    }
+}
+
+void bulk_clear(void *dst, size_t bytes) {
+    char *d = (char*)dst;
+    if (bytes < BULK_PARALLEL_THRESHOLD) {
+        memset(d, 0, bytes);
+        return;
+    }
+    size_t head = (64 - (uintptr_t)d % 64) % 64;
+    memset(d, 0, head);
+    bool nt = bytes >= BULK_NT_THRESHOLD;
+    for_each_block(bytes - head, 64, [&] (size_t, size_t begin, size_t end) {
+        clear_lines(d + head + begin, end - begin, nt);
+    });
+}
+
+// Compact the nonzero words of src[0, n) to dst and return how many there were. dst may equal src.
+static size_t compact_serial(uint64_t *dst, uint64_t *src, size_t n, bool clear_source) {
+    size_t j = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i d = _mm512_loadu_si512(&src[i]);
+        __mmask8 nonzero = _mm512_test_epi64_mask(d, d);
+        if (clear_source && dst != src) {
+            _mm512_storeu_si512(&src[i], _mm512_setzero_si512());
+        }
+        // Compress in a register and store with a mask, avoiding the microcoded vpcompressq [mem] on Zen 4
+        __m512i compressed = _mm512_maskz_compress_epi64(nonzero, d);
+        _mm512_mask_storeu_epi64(&dst[j], _pext_u32((uint32_t)-1, nonzero), compressed);
+        j += __builtin_popcount(nonzero);
+    }
+    for (; i < n; ++i) {
+        uint64_t v = src[i];
+        if (clear_source && dst != src) {
+            src[i] = 0;
+        }
+        if (v) {
+            dst[j++] = v;
+        }
+    }
+    return j;
+}
+
+// Words per chunk of the in-place compaction (512 KB, to stay in L2 between its two reads), and how often a chunk publishes how far it has read
+constexpr size_t COMPACT_CHUNK = 1 << 16;
+constexpr size_t COMPACT_PUBLISH = 1 << 9;
+
+// In-place compaction with every thread writing its output directly to its final place, in a single pass
+// over memory. A chunk (sized to stay in L2) is counted, then its output offset is chained from the previous
+// chunk's running total, then it is compacted from cache. The output range [offset, offset + count) lies at
+// or before the chunk's own input but may cover the input of earlier chunks, so before writing each word the
+// chunk waits until the chunk owning that word has published that it read it. Chunks are claimed in
+// increasing order and only ever wait on earlier chunks, which are already running, so this can't deadlock;
+// in practice the waits are short since earlier chunks started earlier.
+static size_t compact_in_place(uint64_t *data, size_t n) {
+    size_t chunks = (n + COMPACT_CHUNK - 1) / COMPACT_CHUNK;
+    constexpr size_t NOT_READY = SIZE_MAX;
+    // Running total of nonzero words up to and including each chunk, and words of each chunk compacted so far
+    auto inclusive = std::make_unique<std::atomic<size_t>[]>(chunks);
+    auto read = std::make_unique<std::atomic<size_t>[]>(chunks);
+    for (size_t c = 0; c < chunks; ++c) {
+        inclusive[c].store(NOT_READY, std::memory_order_relaxed);
+    }
+    std::atomic<size_t> next_chunk = 0;
+
+    auto spin = [] (int& spins) {
+        if (++spins % 64) {
+            _mm_pause();
+        } else {
+            std::this_thread::yield();
+        }
+    };
+
+    TraceScope scope("compact in place");
+#pragma omp parallel
+    {
+        size_t c;
+        while ((c = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+            size_t begin = c * COMPACT_CHUNK, end = std::min(n, begin + COMPACT_CHUNK);
+
+            size_t count = 0, i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m512i d = _mm512_loadu_si512(&data[i]);
+                count += __builtin_popcount(_mm512_test_epi64_mask(d, d));
+            }
+            for (; i < end; ++i) {
+                count += data[i] != 0;
+            }
+
+            size_t out = 0;
+            int spins = 0;
+            if (c > 0) {
+                while ((out = inclusive[c - 1].load(std::memory_order_acquire)) == NOT_READY) {
+                    spin(spins);
+                }
+            }
+            inclusive[c].store(out + count, std::memory_order_release);
+
+            size_t safe = out;  // words below this may be overwritten
+
+            // Wait until [out, until) has been read by the chunks that own it
+            auto wait_for = [&] (size_t until) {
+                while (safe < until) {
+                    size_t owner = safe / COMPACT_CHUNK;
+                    if (owner >= c) {
+                        safe = SIZE_MAX;
+                        break;
+                    }
+                    size_t owner_safe = owner * COMPACT_CHUNK + read[owner].load(std::memory_order_acquire);
+                    if (owner_safe > safe) {
+                        safe = owner_safe;
+                    } else {
+                        spin(spins);
+                    }
+                }
+            };
+
+            size_t published = begin;
+            for (i = begin; i + 8 <= end; i += 8) {
+                __m512i d = _mm512_loadu_si512(&data[i]);
+                __mmask8 nonzero = _mm512_test_epi64_mask(d, d);
+                if (i + 8 - published >= COMPACT_PUBLISH) {
+                    published = i + 8;
+                    read[c].store(published - begin, std::memory_order_release);
+                }
+                if (nonzero) {
+                    int k = __builtin_popcount(nonzero);
+                    wait_for(out + k);
+                    __m512i compressed = _mm512_maskz_compress_epi64(nonzero, d);
+                    _mm512_mask_storeu_epi64(&data[out], _pext_u32((uint32_t)-1, nonzero), compressed);
+                    out += k;
+                }
+            }
+            for (; i < end; ++i) {
+                uint64_t v = data[i];
+                if (v) {
+                    wait_for(out + 1);
+                    data[out++] = v;
+                }
+            }
+            read[c].store(end - begin, std::memory_order_release);
+        }
+    }
+    return chunks ? inclusive[chunks - 1].load() : 0;
+}
+
+size_t bulk_compact(uint64_t *dst, uint64_t *src, size_t n, bool clear_source) {
+    if (dst != src && dst < src + n && src < dst + n) {
+        throw std::runtime_error("bulk_compact: overlapping ranges must be identical");
+    }
+    size_t total;
+    if (n * sizeof(uint64_t) < BULK_PARALLEL_THRESHOLD || omp_get_max_threads() == 1) {
+        total = compact_serial(dst, src, n, clear_source);
+    } else if (dst != src) {
+        // Count, prefix sum, then each thread compresses its block to its offset
+        std::vector<size_t> counts(omp_get_max_threads() + 1);
+        for_each_block(n, 8, [&] (size_t t, size_t begin, size_t end) {
+            size_t count = 0, i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m512i d = _mm512_loadu_si512(&src[i]);
+                count += __builtin_popcount(_mm512_test_epi64_mask(d, d));
+            }
+            for (; i < end; ++i) {
+                count += src[i] != 0;
+            }
+            counts[t + 1] = count;
+#pragma omp barrier
+#pragma omp single
+            for (size_t i = 1; i < counts.size(); ++i) {
+                counts[i] += counts[i - 1];
+            }
+            TraceScope scope("compact block");
+            compact_serial(dst + counts[t], src + begin, end - begin, clear_source);
+        });
+        total = counts.back();
+    } else {
+        total = compact_in_place(src, n);
+    }
+    if (clear_source && dst == src) {
+        bulk_clear(src + total, (n - total) * sizeof(uint64_t));
+    }
+    return total;
+}
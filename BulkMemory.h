@@ -0,0 +1,36 @@
+//
+// Created by root on 6/26/25.
+//
+
+#ifndef BULKMEMORY_H
+#define BULKMEMORY_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Parallel bulk memory operations over large arrays. Work is split into one contiguous block per OpenMP
+// thread, in thread order, so with threads pinned per NUMA node (numa_pin_omp_threads) each thread stays in
+// its node's slice of a partitioned table, and destination pages touched first land on the writer's node.
+//
+// Above BULK_NT_THRESHOLD bytes the destination is written with non-temporal stores: it won't be read back
+// soon and would otherwise evict everything else and cost a read-for-ownership per line.
+constexpr size_t BULK_NT_THRESHOLD = 32 << 20;
+// Below this, a single thread does the work
+constexpr size_t BULK_PARALLEL_THRESHOLD = 1 << 20;
+
+// Copy bytes from src to dst. The ranges must not overlap.
+void bulk_copy(void *dst, const void *src, size_t bytes);
+
+// Copy bytes from src to dst, where the ranges may overlap (like memmove).
+void bulk_move(void *dst, const void *src, size_t bytes);
+
+// Zero bytes at dst.
+void bulk_clear(void *dst, size_t bytes);
+
+// Copy the nonzero words of src[0, n) to dst, in order, and return how many there were. dst may equal src
+// (in-place compaction) but must not otherwise overlap it. With clear_source, the source words are zeroed;
+// in place, only the words past the returned count are. Either way, all threads write their output straight
+// to its final position after a counting pass and a prefix sum.
+size_t bulk_compact(uint64_t *dst, uint64_t *src, size_t n, bool clear_source = false);
+
+#endif //BULKMEMORY_H
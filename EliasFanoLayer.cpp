@@ -0,0 +1,128 @@
+#include "EliasFanoLayer.h"
+
+#include <stdexcept>
+
+constexpr uint64_t KEY_MASK = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+
+// Position of the r-th set bit of word, which must have more than r
+static int select_in_word(uint64_t word, int r) {
+    return __builtin_ctzll(_pdep_u64(1ULL << r, word));
+}
+
+EliasFanoLayer::EliasFanoLayer(const AdvancedHashSet& layer) : tile_sum(layer.tile_sum), slots(layer.capacity) {
+    TraceScope scope("elias-fano encode");
+    const uint64_t *data = layer.data;
+    bool sorted = true;
+#pragma omp parallel for reduction(&&:sorted)
+    for (size_t i = 1; i < slots; ++i) {
+        sorted = sorted && (data[i - 1] & KEY_MASK) < (data[i] & KEY_MASK);
+    }
+    if (!sorted) {
+        throw std::runtime_error("EliasFanoLayer needs a layer sorted by key");
+    }
+
+    universe = slots ? (data[slots - 1] & KEY_MASK) + 1 : 1;
+    // floor(log2(universe / slots)) low bits per key balances the two halves
+    low_width = slots && universe / slots > 1 ? 63 - __builtin_clzll(universe / slots) : 0;
+    low = PackedInts(slots, low_width);
+    perms = PackedInts(slots, 64 - AdvancedHashSet::POSITION_BITS);
+    size_t high_bits = slots + (universe >> low_width) + 1;
+    high.assign((high_bits + 63) / 64 + 1, 0);
+
+    // Runs of 64 slots fill whole words of the packed arrays; the high words are shared, so set them atomically
+#pragma omp parallel for schedule(static)
+    for (size_t run = 0; run < slots; run += 64) {
+        for (size_t i = run; i < std::min(slots, run + 64); ++i) {
+            uint64_t key = data[i] & KEY_MASK;
+            low.set(i, key & ((1ULL << low_width) - 1));
+            perms.set(i, data[i] >> AdvancedHashSet::POSITION_BITS);
+            size_t bit = (key >> low_width) + i;
+            __atomic_fetch_or(&high[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+        }
+    }
+
+    // Select samples, in one pass over the high bits
+    size_t seen_ones = 0, seen_zeros = 0;
+    for (size_t w = 0; w < (high_bits + 63) / 64; ++w) {
+        uint64_t word = high[w];
+        if (w * 64 + 64 > high_bits) {
+            // Zeros past the end are not part of the encoding
+            word |= ~0ULL << (high_bits - w * 64);
+        }
+        int word_ones = __builtin_popcountll(word);
+        size_t next_one = (seen_ones + SELECT_SAMPLE - 1) / SELECT_SAMPLE * SELECT_SAMPLE;
+        if (next_one < seen_ones + word_ones) {
+            ones.push_back(w * 64 + select_in_word(word, next_one - seen_ones));
+        }
+        size_t next_zero = (seen_zeros + SELECT_SAMPLE - 1) / SELECT_SAMPLE * SELECT_SAMPLE;
+        if (next_zero < seen_zeros + 64 - word_ones) {
+            zeros.push_back(w * 64 + select_in_word(~word, next_zero - seen_zeros));
+        }
+        seen_ones += word_ones;
+        seen_zeros += 64 - word_ones;
+    }
+}
+
+size_t EliasFanoLayer::select1(size_t i) const {
+    size_t bit = ones[i / SELECT_SAMPLE];
+    size_t r = i % SELECT_SAMPLE;
+    size_t w = bit / 64;
+    uint64_t word = high[w] & (~0ULL << (bit % 64));
+    while (true) {
+        size_t count = __builtin_popcountll(word);
+        if (r < count) {
+            return w * 64 + select_in_word(word, r);
+        }
+        r -= count;
+        word = high[++w];
+    }
+}
+
+size_t EliasFanoLayer::select0(size_t i) const {
+    size_t bit = zeros[i / SELECT_SAMPLE];
+    size_t r = i % SELECT_SAMPLE;
+    size_t w = bit / 64;
+    uint64_t word = ~high[w] & (~0ULL << (bit % 64));
+    while (true) {
+        size_t count = __builtin_popcountll(word);
+        if (r < count) {
+            return w * 64 + select_in_word(word, r);
+        }
+        r -= count;
+        word = ~high[++w];
+    }
+}
+
+bool EliasFanoLayer::contains(Position position) const {
+    if (!slots || position.tile_sum() != tile_sum) {
+        return false;
+    }
+    auto [ index, sorted ] = sort_lower_3(position);
+    uint64_t key = sorted.bits >> 4;
+    uint64_t high_part = key >> low_width, low_part = key & ((1ULL << low_width) - 1);
+    if (high_part > (universe - 1) >> low_width) {
+        return false;
+    }
+    // Slots with this high part are the ones between zeros high_part - 1 and high_part. Keys are far from
+    // uniform, so that can be a long run: binary search its low parts.
+    size_t begin = high_part ? select0(high_part - 1) + 1 - high_part : 0;
+    size_t bucket_end = select0(high_part) - high_part, end = bucket_end;
+    while (begin < end) {
+        size_t mid = begin + (end - begin) / 2;
+        if (low.get(mid) < low_part) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return begin < bucket_end && low.get(begin) == low_part && (perms.get(begin) >> index & 1);
+}
+
+size_t EliasFanoLayer::parallel_count() const {
+    size_t count = 0;
+#pragma omp parallel for reduction(+:count)
+    for (size_t i = 0; i < slots; ++i) {
+        count += __builtin_popcountll(perms.get(i));
+    }
+    return count;
+}
@@ -0,0 +1,123 @@
+//
+// Created by root on 6/29/25.
+//
+
+#ifndef ELIASFANOLAYER_H
+#define ELIASFANOLAYER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+#include <omp.h>
+#include <vector>
+
+#include "AdvancedHashSet.h"
+#include "Progress.h"
+#include "Trace.h"
+
+// Fixed-width integers packed back to back into 64-bit words, with a padding word so any value can be read
+// with two loads.
+struct PackedInts {
+    std::vector<uint64_t> words;
+    int width = 0;
+
+    PackedInts() = default;
+    PackedInts(size_t n, int width) : words((n * width + 63) / 64 + 1), width(width) {}
+
+    uint64_t get(size_t i) const {
+        size_t bit = i * width;
+        const uint64_t *w = words.data() + bit / 64;
+        unsigned __int128 pair = (unsigned __int128)w[1] << 64 | w[0];
+        return (uint64_t)(pair >> (bit % 64)) & ((1ULL << width) - 1);
+    }
+
+    // Not thread-safe within a word: parallel writers must own whole words, e.g. runs of 64 values
+    void set(size_t i, uint64_t value) {
+        size_t bit = i * width;
+        uint64_t *w = words.data() + bit / 64;
+        unsigned __int128 pair = (unsigned __int128)w[1] << 64 | w[0];
+        unsigned __int128 mask = (unsigned __int128)((1ULL << width) - 1) << (bit % 64);
+        pair = (pair & ~mask) | ((unsigned __int128)value << (bit % 64) & mask);
+        w[0] = (uint64_t)pair;
+        if (bit % 64 + width > 64) {
+            w[1] = (uint64_t)(pair >> 64);
+        }
+    }
+
+    size_t bytes() const {
+        return words.size() * sizeof(uint64_t);
+    }
+};
+
+// Succinct, read-only copy of a layer sorted by key (gorge_sorted). The 58-bit keys are Elias–Fano coded: the
+// low bits of each key in a packed array, the high bits in unary in a bitvector with sampled select. The
+// 6-bit permutation masks are kept in a side stream of the same order. Takes about 2 + log2(universe / n) + 6
+// bits per slot, against 64 for the table.
+//
+// Supports the same parallel scan as AdvancedHashSet, and membership through select on the high bits.
+struct EliasFanoLayer {
+    // One select sample per this many ones (or zeros) of the high bits
+    constexpr static size_t SELECT_SAMPLE = 256;
+
+    int tile_sum;
+    size_t slots = 0;
+    uint64_t universe;  // largest key + 1
+    int low_width = 0;
+    PackedInts low;
+    PackedInts perms;
+    // Bit high(i) + i is set for slot i
+    std::vector<uint64_t> high;
+    // Bit positions of every SELECT_SAMPLE-th one and zero of high
+    std::vector<uint64_t> ones, zeros;
+
+    // Throws std::runtime_error if the layer is not sorted
+    explicit EliasFanoLayer(const AdvancedHashSet& layer);
+
+    // Stored slot word (key | permutation mask << 58) of slot i
+    uint64_t slot(size_t i) const {
+        return decode(i, select1(i));
+    }
+
+    bool contains(Position position) const;
+
+    size_t bytes() const {
+        return low.bytes() + perms.bytes() + (high.size() + ones.size() + zeros.size()) * sizeof(uint64_t);
+    }
+
+    size_t parallel_count() const;
+
+    template <typename F>
+    void for_each_position_parallel(F&& f, int threads=omp_get_max_threads()) const {
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (size_t chunk = 0; chunk < slots; chunk += AdvancedHashSet::FOR_EACH_CHUNK) {
+            TraceScope scope("for_each chunk", chunk / AdvancedHashSet::FOR_EACH_CHUNK);
+            size_t chunk_end = std::min(slots, chunk + AdvancedHashSet::FOR_EACH_CHUNK);
+            progress_add(thread_progress().slots_scanned, chunk_end - chunk);
+            // Walk the ones of the high bits from the chunk's first slot
+            size_t bit = select1(chunk);
+            uint64_t word = high[bit / 64] & (~0ULL << (bit % 64));
+            size_t word_i = bit / 64;
+            for (size_t i = chunk; i < chunk_end; ++i) {
+                while (!word) {
+                    word = high[++word_i];
+                }
+                bit = word_i * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                AdvancedHashSet::unpack_slot(tile_sum, decode(i, bit), f);
+            }
+        }
+    }
+
+private:
+    // Slot word of slot i, whose one in high is at bit
+    uint64_t decode(size_t i, size_t bit) const {
+        uint64_t key = (bit - i) << low_width | low.get(i);
+        return perms.get(i) << AdvancedHashSet::POSITION_BITS | key;
+    }
+
+    // Position of the i-th one (zero) of high, counting from 0
+    size_t select1(size_t i) const;
+    size_t select0(size_t i) const;
+};
+
+#endif //ELIASFANOLAYER_H
@@ -0,0 +1,347 @@
+#include "Enumeration.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "BulkLoad.h"
+#include "Progress.h"
+#include "Timing.h"
+
+static thread_local std::vector<uint64_t> next_tl;
+
+KeyCdf fit_successor_cdf(const LayerSlots& h1, const LayerSlots& h2, size_t samples) {
+    TraceScope scope("fit placement");
+    std::vector<uint64_t> keys, next;
+    keys.reserve(samples);
+    // Fixed seed, so the placement and hence the table layout is reproducible
+    std::mt19937_64 rng(h2.tile_sum);
+    size_t slots = h1.slots + h2.slots;
+    for (size_t attempt = 0; attempt < 64 * samples && keys.size() < samples && slots; ++attempt) {
+        size_t i = rng() % slots;
+        bool from_h1 = i < h1.slots;
+        const LayerSlots& source = from_h1 ? h1 : h2;
+        uint64_t d = source.slot(from_h1 ? i : i - h1.slots);
+        if (!d) {
+            continue;
+        }
+        AdvancedHashSet::unpack_slot(source.tile_sum, d, [&] (Position p) {
+            list_successors(next, p.bits, from_h1 ? 2 : 1);
+            for (auto succ : next) {
+                keys.push_back(sort_lower_3(Position { succ }).second.bits >> 4);
+            }
+        });
+    }
+    // A key reached from many predecessors would otherwise pull knots towards itself
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    // Keys are far from uniform between neighbouring quantiles, so the knots have to be dense
+    return KeyCdf::fit(keys, keys.size() / 4);
+}
+
+static AdvancedHashSet::Config initial_config(int tile_sum) {
+    return { .tile_sum = tile_sum, .initial_size = 100, .load_factor = 1.0 };
+}
+
+Enumeration::Enumeration(Config config) : config(config), numa_nodes(read_numa_nodes()),
+    h1(initial_config(4)), h2(initial_config(6)), h3(initial_config(8)) {
+    if (numa_nodes.size() > 1 && config.numa_pin_threads) {
+        numa_pin_omp_threads(numa_nodes);
+    }
+    if (numa_nodes.size() > 1 && config.numa_policy != NumaPolicy::none) {
+        arena.place = [this] (const HugePageMapping& mapping) {
+            numa_place(mapping, this->config.numa_policy, numa_nodes);
+        };
+    }
+
+    std::vector<uint64_t> all = starting_positions();
+
+    for (auto b : all) {
+        auto sum = tile_sum(b);
+        (sum == 4 ? h1 : sum == 6 ? h2 : h3).insert(Position { b });
+    }
+
+    // Build additional elements of c2 from c1
+    std::vector<uint64_t> next;
+    h1.for_each_position_parallel([&] (Position pos) {
+        list_successors(next, pos.bits, 1);
+        for (auto succ : next) {
+            h2.insert(Position { succ });
+        }
+    }, 1);
+
+    for (AdvancedHashSet* layer : { &h1, &h2 }) {
+        if (config.sort_layers || config.succinct_sources) {
+            layer->gorge_sorted();
+        } else {
+            layer->gorge();
+        }
+    }
+}
+
+void Enumeration::run(const std::function<bool(const LayerStats&, const AdvancedHashSet&)>& on_layer) {
+    for (AdvancedHashSet* layer : { &h1, &h2 }) {
+        LayerStats stats { .tile_sum = (uint32_t)layer->tile_sum, .positions = layer->parallel_count(),
+            .slots = layer->capacity };
+        positions_per_slot = stats.positions / (double)std::max<size_t>(stats.slots, 1);
+        stats.perm_occupancy = positions_per_slot;
+        if (config.layer_filters) {
+            filter = LayerFilter::build(*layer, config.filter_bits_per_key);
+        }
+        if (stats.tile_sum > config.max_tile_sum || !on_layer(stats, *layer)) {
+            return;
+        }
+    }
+    if (config.succinct_sources) {
+        s1 = std::make_unique<EliasFanoLayer>(h1);
+        s2 = std::make_unique<EliasFanoLayer>(h2);
+        h1.drop();
+        h2.drop();
+    }
+    // Scan a source layer from whichever copy of it is left
+    auto for_each_source = [] (const AdvancedHashSet& table, const std::unique_ptr<EliasFanoLayer>& succinct,
+                               auto&& f) {
+        if (succinct) {
+            succinct->for_each_position_parallel(f);
+        } else {
+            table.for_each_position_parallel(f);
+        }
+    };
+    auto source_slots = [] (const AdvancedHashSet& table, const std::unique_ptr<EliasFanoLayer>& succinct) {
+        return succinct ? succinct->slots : table.capacity;
+    };
+
+    uint32_t h1_tile_sum = h1.tile_sum;
+    while (h1_tile_sum + 4 <= config.max_tile_sum) {
+        h1_tile_sum += 2;
+        LayerStats stats {};
+        stats.tile_sum = h1_tile_sum + 2;
+        TraceScope layer_scope("layer", stats.tile_sum);
+
+        auto start = std::chrono::steady_clock::now();
+        reset_peak_rss();
+
+        std::vector<std::array<uint64_t, 16>> per_thread_census(omp_get_max_threads());
+        std::vector<uint64_t> slots_scanned_before(MAX_PROGRESS_THREADS);
+        for (size_t t = 0; t < slots_scanned_before.size(); ++t) {
+            slots_scanned_before[t] = progress_counters[t].slots_scanned;
+        }
+        auto insert_successors = [&] (Position p, int tile) {
+            list_successors(next_tl, p.bits, tile);
+            uint64_t added = 0;
+            for (auto succ : next_tl) {
+                added += b3 ? b3->insert(Position { succ }) : h3.insert(Position { succ });
+            }
+            progress_add(thread_progress().positions_inserted, added);
+        };
+
+        {
+            std::unique_ptr<ProgressReporter> reporter;
+            if (config.progress_interval > 0) {
+                reporter = std::make_unique<ProgressReporter>(ProgressReporter::Config {
+                    .label = "Tile sum " + std::to_string(stats.tile_sum),
+                    .total_slots = source_slots(h1, s1) + source_slots(h2, s2),
+                    .destination_capacity = b3 ? b3->space : h3.capacity,
+                    .positions_per_slot = b3 ? 1 : positions_per_slot,
+                    .interval_seconds = config.progress_interval
+                });
+            }
+
+            // Build c3 from c1, c2
+            stats.insert_h1_seconds = timed_run("insert h1", [&] {
+                for_each_source(h1, s1, [&] (Position p) {
+                    insert_successors(p, 2);
+                });
+            }, config.verbose);
+            stats.insert_h2_seconds = timed_run("insert h2", [&] {
+                for_each_source(h2, s2, [&] (Position p) {
+                    per_thread_census[omp_get_thread_num()][p.max_tile()]++;
+                    insert_successors(p, 1);
+                });
+            }, config.verbose);
+        }
+
+        if (prefault) {
+            stats.prefaulted_bytes = prefault->faulted_bytes();
+            prefault.reset();
+        }
+
+        // Walking smaps and asking where pages live is slow on big tables, so it is timed on its own and left out of
+        // total_seconds
+        std::vector<size_t> node_bytes;
+        stats.profile_seconds = timed_run("memory profile", [&] {
+            stats.h1_backing = read_mapping_backing(h1.data, h1.capacity * sizeof(uint64_t));
+            stats.h2_backing = read_mapping_backing(h2.data, h2.capacity * sizeof(uint64_t));
+            void *h3_data = b3 ? (void *)b3->words : (void *)h3.data;
+            size_t h3_bytes = b3 ? b3->bytes() : h3.table_bytes();
+            stats.h3_backing = read_mapping_backing(h3_data, h3_bytes);
+            node_bytes = numa_resident_bytes(h3_data, h3_bytes, numa_nodes);
+        }, config.verbose);
+        stats.source_bytes = stats.h1_backing.mapped_bytes + stats.h2_backing.mapped_bytes
+            + (s1 ? s1->bytes() : 0) + (s2 ? s2->bytes() : 0);
+        size_t resident_total = 0;
+        for (size_t b : node_bytes) {
+            resident_total += b;
+        }
+        stats.numa.resize(numa_nodes.size());
+        for (size_t i = 0; i < numa_nodes.size(); ++i) {
+            stats.numa[i].node = numa_nodes[i].node;
+            stats.numa[i].table_bytes = node_bytes[i];
+            stats.numa[i].remote_probe_fraction = resident_total ? 1 - node_bytes[i] / (double)resident_total : 0;
+        }
+        for (size_t t = 0; t < slots_scanned_before.size(); ++t) {
+            int node = numa_node_of_cpu(progress_counters[t].cpu, numa_nodes);
+            stats.numa[node].slots_scanned += progress_counters[t].slots_scanned - slots_scanned_before[t];
+        }
+        for (auto& node : stats.numa) {
+            double seconds = stats.insert_h1_seconds + stats.insert_h2_seconds;
+            node.scan_gb_per_second = seconds > 0 ? node.slots_scanned * sizeof(uint64_t) / seconds / 1e9 : 0;
+        }
+
+        for (auto& census : per_thread_census) {
+            for (int tile_i = 0; tile_i < 16; ++tile_i) {
+                stats.max_tile_census[tile_i] += census[tile_i];
+            }
+        }
+        if (config.verbose) {
+            std::cout << "Max tile census: ";
+            for (int tile_i = 1; tile_i < 12; ++tile_i) {
+                std::cout << (1 << tile_i) << ": " << stats.max_tile_census[tile_i] << "; ";
+            }
+            std::cout << std::endl;
+        }
+
+        // c1 = c2, c2 = c3, allocate new c3
+        h1 = std::move(h2);
+        s1 = std::move(s2);
+        stats.rank_bitmap = b3 != nullptr;
+        stats.slot_bytes = b3 ? 0 : h3.group_cells == 4 ? 16 : h3.codec.bytes;
+        stats.gorge_seconds = timed_run("h3 gorge", [&] {
+            if (b3) {
+                // Ranks are in position order, so this takes the sorted path, with no hashing
+                std::vector<uint64_t> positions = b3->positions();
+                b3.reset();
+                h3 = std::move(*bulk_load(positions.data(), positions.size(), { .tile_sum = h3.tile_sum }));
+            } else if (config.sort_layers || config.succinct_sources) {
+                h3.gorge_sorted();
+            } else {
+                h3.gorge();
+            }
+        }, config.verbose);
+        h2 = std::move(h3);
+        stats.slots = h2.capacity;
+        if (config.layer_filters) {
+            stats.filter_seconds = timed_run("h2 filter", [&] {
+                filter = LayerFilter::build(h2, config.filter_bits_per_key);
+            }, config.verbose);
+        }
+
+        if (config.grouped_tables) {
+            stats.grouped_slots = h2.count_groups();
+        }
+
+        int next_tile_sum = (int)h1_tile_sum + 4;
+        // Layers grow by a ratio that only falls slowly with the tile sum, so the next one is projected from how much
+        // this one grew over the last
+        double projected = h2.capacity * ((double)h2.capacity / std::max<size_t>(source_slots(h1, s1), 1));
+        auto next = std::max({ (uint64_t)(h2.capacity * config.growth), (uint64_t)(projected / config.max_load),
+                               config.min_capacity });
+        bool bitmap = config.rank_bitmaps && RankBitmap::fits(next_tile_sum)
+            && RankBitmap::bytes_for(next_tile_sum) <= next * sizeof(uint64_t);
+        // Grouped slots are twice the size, so they need fewer than half as many
+        bool grouped = config.grouped_tables && !bitmap && !config.ordered_placement
+            && 2.0 * stats.grouped_slots <= config.grouped_table_ratio * h2.capacity;
+        if (grouped) {
+            next = std::max((uint64_t)(next * (double)stats.grouped_slots / h2.capacity), config.min_capacity);
+        }
+        if (config.ordered_placement && !bitmap) {
+            placement = fit_successor_cdf(s1 ? LayerSlots(*s1) : LayerSlots(h1), h2, config.placement_samples);
+        }
+
+        if (config.verbose) {
+            if (bitmap) {
+                std::cout << "Allocating a rank bitmap of " << (RankBitmap::bytes_for(next_tile_sum) >> 20)
+                    << " MB for tile sum " << next_tile_sum << '\n';
+            } else if (grouped) {
+                std::cout << "Allocating " << next << " grouped slots for tile sum " << next_tile_sum << '\n';
+            } else {
+                std::cout << "Allocating " << next << " for tile sum " << next_tile_sum << '\n';
+            }
+        }
+
+        AdvancedHashSet::Config table_config {
+            .tile_sum = next_tile_sum,
+            .initial_size = next,
+            .load_factor = 1.0,
+            .arena = config.reuse_tables ? &arena : nullptr,
+            .placement = config.ordered_placement ? &placement : nullptr,
+            .packed = config.packed_tables && !grouped,
+            .quotient = config.quotient_tables && !config.ordered_placement && !grouped,
+            .group_cells = grouped ? 4 : 3,
+            .bucketed = config.bucketed_tables && !config.packed_tables && !config.quotient_tables && !grouped
+                && !config.ordered_placement
+        };
+        size_t reused_before = arena.reused_bytes();
+        if (bitmap) {
+            b3 = std::make_unique<RankBitmap>(next_tile_sum, table_config.arena);
+            // Stands in until the bitmap is converted
+            new (&h3) AdvancedHashSet(initial_config(next_tile_sum));
+        } else {
+            new (&h3) AdvancedHashSet(table_config);
+            if (!table_config.arena) {
+                // Before anything touches the fresh pages. The arena places what it hands out itself, before it
+                // clears anything.
+                numa_place(h3.mapping, config.numa_policy, numa_nodes);
+            }
+        }
+        stats.arena_reused_bytes = arena.reused_bytes() - reused_before;
+        if (table_config.arena) {
+            // Idle pieces beyond what the table after this one is projected to need would never be handed out
+            double ratio = projected / std::max<size_t>(h2.capacity, 1);
+            arena.trim((size_t)(next * sizeof(uint64_t) * ratio));
+        }
+        if (config.prefault_threads > 0 && !bitmap) {
+            prefault = std::make_unique<Prefaulter>(h3.mapping.data, h3.table_bytes(),
+                Prefaulter::Config {
+                    .threads = config.prefault_threads,
+                    .bytes_per_second = config.prefault_bytes_per_second
+                });
+        }
+
+        stats.count_seconds = timed_run("h2 count", [&] {
+            stats.positions = h2.parallel_count();
+        }, config.verbose);
+        positions_per_slot = stats.positions / (double)std::max<size_t>(stats.slots, 1);
+        stats.perm_occupancy = positions_per_slot;
+        stats.profile_seconds += timed_run("memory profile", [&] {
+            stats.peak_rss = read_peak_rss();
+            stats.hugepages_1gb = read_hugepage_pool(1024 * 1024);
+        }, false);
+        if (config.verbose) {
+            print_backing(std::cout, "h1", stats.h1_backing);
+            print_backing(std::cout, "h2", stats.h2_backing);
+            print_backing(std::cout, "h3", stats.h3_backing);
+            std::cout << "Source layers held " << (stats.source_bytes >> 20) << " MB\n";
+            std::cout << "Next h3 is in " << to_string(h3.backing()) << ", " << (stats.arena_reused_bytes >> 20)
+                << " MB reused from retired tables, " << (arena.free_bytes() >> 20) << " MB idle in the arena\n";
+            if (numa_nodes.size() > 1) {
+                std::cout << "NUMA policy " << to_string(config.numa_policy) << '\n';
+                print_numa_stats(std::cout, stats.numa);
+            }
+            std::cout << "Peak RSS " << (stats.peak_rss >> 20) << " MB; 1GB hugepages free: "
+                << stats.hugepages_1gb.free << "/" << stats.hugepages_1gb.total << '\n';
+        }
+        auto end = std::chrono::steady_clock::now();
+        stats.total_seconds = std::chrono::duration<double>(end - start).count() - stats.profile_seconds;
+
+        if (!on_layer(stats, h2)) {
+            return;
+        }
+        if (config.succinct_sources) {
+            s2 = std::make_unique<EliasFanoLayer>(h2);
+            h2.drop();
+        }
+    }
+}
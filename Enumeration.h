@@ -0,0 +1,154 @@
+//
+// Created by root on 6/21/25.
+//
+
+#ifndef ENUMERATION_H
+#define ENUMERATION_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "AdvancedHashSet.h"
+#include "EliasFanoLayer.h"
+#include "LayerFilter.h"
+#include "MemoryProfile.h"
+#include "Numa.h"
+#include "Prefault.h"
+#include "RankBitmap.h"
+
+// Timings and counts for one finished layer.
+struct LayerStats {
+    uint32_t tile_sum;
+    size_t positions;  // number of positions in the layer
+    size_t slots;  // occupied slots after gorge
+    double insert_h1_seconds;  // successors of the layer two below (placing a 4)
+    double insert_h2_seconds;  // successors of the layer directly below (placing a 2)
+    double gorge_seconds;
+    double filter_seconds;  // building the layer's LayerFilter, under Config::layer_filters
+    double count_seconds;
+    double profile_seconds;  // reading the memory profile below, which total_seconds leaves out
+    double total_seconds;
+    // Census of the maximum tile of the layer directly below, indexed by tile representation
+    std::array<uint64_t, 16> max_tile_census;
+
+    // Memory profile
+    size_t peak_rss;  // over this layer
+    MappingBacking h1_backing, h2_backing;  // source tables, read while generating
+    MappingBacking h3_backing;  // destination table when full, before gorge
+    HugePagePool hugepages_1gb;  // kernel pool after the layer
+    size_t arena_reused_bytes;  // of the next table, taken from retired tables rather than mapped fresh
+    size_t prefaulted_bytes;  // of this layer's table, faulted in the background before the inserts finished
+    size_t source_bytes;  // held by the two layers this one was generated from, as tables or succinct copies
+    bool rank_bitmap;  // generated into a RankBitmap rather than a table, under Config::rank_bitmaps
+    // Of the table while it was filled: 8, or less under packed_tables or quotient_tables; 16 for grouped slots;
+    // 0 for a RankBitmap
+    int slot_bytes;
+    double perm_occupancy;  // permutation bits set per slot, of 6
+    size_t grouped_slots;  // slots with four cells sorted into each key, under Config::grouped_tables
+    std::vector<NumaLayerStats> numa;  // one entry per node
+
+    double positions_per_second() const {
+        return positions / total_seconds;
+    }
+};
+
+// Runs the layer recurrence: layer s is built from the successors of layers s - 2 (placing a 2) and
+// s - 4 (placing a 4). h1, h2, h3 rotate as the tile sum advances.
+struct Enumeration {
+    struct Config {
+        // Stop after this layer has been produced
+        uint32_t max_tile_sum = UINT32_MAX;
+        // Capacity of a new table is at least growth times the number of slots in the previous layer, and enough
+        // that the projected size of the new layer fills at most max_load of it
+        double growth = 1.2;
+        double max_load = 0.9;
+        size_t min_capacity = 10000000;
+        // Print per-phase timings
+        bool verbose = true;
+        // Seconds between progress reports while a layer is being generated; 0 disables them
+        double progress_interval = 0;
+        // Sort each finished layer by stored key (gorge_sorted), so layers come out in a deterministic order
+        bool sort_layers = false;
+        // Build each new table out of the memory of retired ones (see TableArena)
+        bool reuse_tables = true;
+        // Background threads faulting in each new table until its layer's inserts are done; 0 disables
+        int prefault_threads = 2;
+        double prefault_bytes_per_second = 2e9;
+        // Placement of new tables over the NUMA nodes; ignored on single-node machines
+        NumaPolicy numa_policy = NumaPolicy::interleave;
+        // Pin OpenMP threads to nodes, grouped in thread order (see numa_node_of_thread)
+        bool numa_pin_threads = true;
+        // Place keys in each new table in (estimated) key order rather than by hash; see fit_successor_cdf.
+        // Makes sort_layers nearly free.
+        bool ordered_placement = false;
+        // Successor keys sampled to fit the placement
+        size_t placement_samples = 1 << 20;
+        // Once a layer has been passed to on_layer, keep only an Elias–Fano copy of it for generating the next
+        // two layers, and give its table back. Implies sort_layers.
+        bool succinct_sources = false;
+        // Build a LayerFilter over each layer right after gorge, for negative queries against it
+        bool layer_filters = false;
+        double filter_bits_per_key = 12;
+        // Generate a layer into a RankBitmap instead of a table when the bitmap is no bigger than the table
+        // would be. The layer is converted to a sorted table once generated.
+        bool rank_bitmaps = false;
+        // Fill each new table with slots packed as narrowly as its tile sum allows (see SlotCodec); gorge widens
+        // them again. Only layers below tile sum 1024 get narrower slots.
+        bool packed_tables = false;
+        // Keep only key remainders in each new table's slots (see SlotCodec::with_quotient), on top of
+        // packed_tables if set. Ignored under ordered_placement.
+        bool quotient_tables = false;
+        // Count how many slots each layer would take with four cells sorted into each key (see count_groups), and
+        // fill the next table with grouped slots if that projects to at most grouped_table_ratio of the memory.
+        // Grouped tables aren't packed. Ignored under ordered_placement.
+        bool grouped_tables = false;
+        double grouped_table_ratio = 1.0;
+        // Fill each new table with bucketed probing (see AdvancedHashSet::Config::bucketed). Ignored for tables
+        // that are packed, quotiented, grouped or placed.
+        bool bucketed_tables = false;
+    };
+
+    Config config;
+    std::vector<NumaNode> numa_nodes;
+    // Declared before the tables so it outlives them
+    TableArena arena;
+    AdvancedHashSet h1, h2, h3;
+    // Under succinct_sources, the copies that replace h1 and h2 once their tables are dropped
+    std::unique_ptr<EliasFanoLayer> s1, s2;
+    // Under rank_bitmaps, what the layer h3 stands for is generated into, if it is small enough
+    std::unique_ptr<RankBitmap> b3;
+    // Faulting in h3; declared after it so it stops first
+    std::unique_ptr<Prefaulter> prefault;
+    // Positions per occupied slot in the last finished layer, used to project the next table's load
+    double positions_per_slot = 1;
+    // Placement of h3 under ordered_placement
+    KeyCdf placement;
+    // Under layer_filters, the filter of the layer last passed to on_layer
+    LayerFilter filter;
+
+    explicit Enumeration(Config config);
+
+    // Build layers up to config.max_tile_sum, calling on_layer after each one is finished. The layer is
+    // passed gorged; on_layer may return false to stop early.
+    void run(const std::function<bool(const LayerStats&, const AdvancedHashSet&)>& on_layer);
+};
+
+// Random access to the slots of a layer, whether it is still a table or only a succinct copy
+struct LayerSlots {
+    int tile_sum;
+    size_t slots;
+    std::function<uint64_t(size_t)> slot;
+
+    LayerSlots(const AdvancedHashSet& table) : tile_sum(table.tile_sum), slots(table.capacity),
+        slot([&table] (size_t i) { return table.data[i]; }) {}
+    LayerSlots(const EliasFanoLayer& layer) : tile_sum(layer.tile_sum), slots(layer.slots),
+        slot([&layer] (size_t i) { return layer.slot(i); }) {}
+};
+
+// Model of the keys of the layer built from h1 (placing a 4) and h2 (placing a 2), fitted on the distinct
+// successors of randomly chosen slots, with a knot every 4 sampled keys.
+KeyCdf fit_successor_cdf(const LayerSlots& h1, const LayerSlots& h2, size_t samples);
+
+#endif //ENUMERATION_H
@@ -0,0 +1,155 @@
+#include "FrozenLayer.h"
+
+#include <immintrin.h>
+#include <omp.h>
+#include <stdexcept>
+
+constexpr uint64_t KEY_MASK = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+// Queries walked through the tree together by contains_batch
+constexpr size_t BATCH = 16;
+
+// Number of keys in the node starting at node that are <= key
+static int count_le(const uint64_t *node, uint64_t key) {
+    __m512i k = _mm512_set1_epi64(key);
+    int count = 0;
+#pragma GCC unroll 8
+    for (size_t i = 0; i < FrozenLayer::FANOUT; i += 8) {
+        count += __builtin_popcount(_mm512_cmple_epu64_mask(_mm512_loadu_si512(node + i), k));
+    }
+    return count;
+}
+
+FrozenLayer::FrozenLayer(const uint64_t *data, size_t size, int tile_sum) : data(data), size(size),
+    tile_sum(tile_sum) {
+    TraceScope scope("freeze layer");
+    bool sorted = true;
+#pragma omp parallel for reduction(&&:sorted)
+    for (size_t i = 1; i < size; ++i) {
+        sorted = sorted && (data[i - 1] & KEY_MASK) < (data[i] & KEY_MASK);
+    }
+    if (!sorted) {
+        throw std::runtime_error("FrozenLayer needs a layer sorted by key");
+    }
+
+    auto pad = [] (std::vector<uint64_t>& level) {
+        level.resize((level.size() + FANOUT - 1) / FANOUT * FANOUT, UINT64_MAX);
+    };
+    std::vector<uint64_t> fences((size + FANOUT - 1) / FANOUT);
+#pragma omp parallel for
+    for (size_t b = 0; b < fences.size(); ++b) {
+        fences[b] = data[b * FANOUT] & KEY_MASK;
+    }
+    pad(fences);
+    levels.push_back(std::move(fences));
+    while (levels.back().size() > FANOUT) {
+        const auto& below = levels.back();
+        std::vector<uint64_t> above(below.size() / FANOUT);
+        for (size_t i = 0; i < above.size(); ++i) {
+            above[i] = below[i * FANOUT];
+        }
+        pad(above);
+        levels.push_back(std::move(above));
+    }
+}
+
+bool FrozenLayer::descend(size_t level, size_t& node, uint64_t key) const {
+    int c = count_le(levels[level].data() + node * FANOUT, key);
+    node = node * FANOUT + c - 1;
+    return c > 0;  // else key is below the first key
+}
+
+size_t FrozenLayer::scan_block(size_t block, uint64_t key) const {
+    // The last block may be partial
+    size_t begin = block * FANOUT, end = std::min(size, begin + FANOUT);
+    __m512i k = _mm512_set1_epi64(key), mask = _mm512_set1_epi64(KEY_MASK);
+    for (size_t i = begin; i < end; i += 8) {
+        __mmask8 valid = end - i >= 8 ? 0xff : (1 << (end - i)) - 1;
+        __m512i slots = _mm512_and_si512(_mm512_maskz_loadu_epi64(valid, data + i), mask);
+        __mmask8 hit = _mm512_mask_cmpeq_epi64_mask(valid, slots, k);
+        if (hit) {
+            return i + __builtin_ctz(hit);
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t FrozenLayer::find(uint64_t key) const {
+    if (size == 0) {
+        return SIZE_MAX;
+    }
+    size_t node = 0;
+    for (size_t l = levels.size(); l-- > 0; ) {
+        if (!descend(l, node, key)) {
+            return SIZE_MAX;
+        }
+    }
+    return scan_block(node, key);
+}
+
+bool FrozenLayer::contains(Position position) const {
+    if (position.tile_sum() != tile_sum) {
+        return false;
+    }
+    auto [ index, sorted ] = sort_lower_3(position);
+    size_t slot = find(sorted.bits >> 4);
+    return slot != SIZE_MAX && (data[slot] >> (AdvancedHashSet::POSITION_BITS + index) & 1);
+}
+
+void FrozenLayer::find_group(const uint64_t *keys, size_t count, size_t *out) const {
+    size_t nodes[BATCH] = {};
+    bool live[BATCH];
+    for (size_t q = 0; q < count; ++q) {
+        live[q] = size > 0;
+    }
+    // Walk the queries down together, prefetching each one's next node while the others are searched
+    for (size_t l = levels.size(); l-- > 0; ) {
+        for (size_t q = 0; q < count; ++q) {
+            if (!live[q]) {
+                continue;
+            }
+            live[q] = descend(l, nodes[q], keys[q]);
+            const uint64_t *next = l ? levels[l - 1].data() + nodes[q] * FANOUT : data + nodes[q] * FANOUT;
+            _mm_prefetch((const char *)next, _MM_HINT_T0);
+        }
+    }
+    for (size_t q = 0; q < count; ++q) {
+        out[q] = live[q] ? scan_block(nodes[q], keys[q]) : SIZE_MAX;
+    }
+}
+
+void FrozenLayer::find_batch(const uint64_t *keys, size_t n, size_t *out) const {
+#pragma omp parallel for schedule(static)
+    for (size_t start = 0; start < n; start += BATCH) {
+        find_group(keys + start, std::min(BATCH, n - start), out + start);
+    }
+}
+
+void FrozenLayer::contains_batch(const uint64_t *positions, size_t n, bool *out) const {
+#pragma omp parallel for schedule(static)
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t count = std::min(BATCH, n - start);
+        uint64_t keys[BATCH];
+        int perms[BATCH];
+        size_t slots[BATCH];
+        for (size_t q = 0; q < count; ++q) {
+            Position position { positions[start + q] };
+            auto [ index, sorted ] = sort_lower_3(position);
+            // Positions of other tile sums get a key wider than any stored one
+            keys[q] = position.tile_sum() == tile_sum ? sorted.bits >> 4 : UINT64_MAX;
+            perms[q] = index;
+        }
+        find_group(keys, count, slots);
+        for (size_t q = 0; q < count; ++q) {
+            size_t slot = slots[q];
+            out[start + q] = slot != SIZE_MAX && (data[slot] >> (AdvancedHashSet::POSITION_BITS + perms[q]) & 1);
+        }
+    }
+}
+
+size_t FrozenLayer::index_bytes() const {
+    size_t bytes = 0;
+    for (auto& level : levels) {
+        bytes += level.size() * sizeof(uint64_t);
+    }
+    return bytes;
+}
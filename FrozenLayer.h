@@ -0,0 +1,55 @@
+//
+// Created by root on 6/28/25.
+//
+
+#ifndef FROZENLAYER_H
+#define FROZENLAYER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AdvancedHashSet.h"
+
+// Read-only membership index over a finished layer. Once gorged, AdvancedHashSet::contains no longer works (the
+// probe sequences are gone), so lookups go through a static 64-ary tree of fences instead: level 0 holds the
+// first key of every block of 64 slots, and each level above holds every 64th key of the one below. A node is
+// searched with eight AVX-512 compares. The index costs about one bit per slot on top of the layer.
+//
+// The layer must be sorted by key (gorge_sorted, or Enumeration::Config::sort_layers) and must outlive the index.
+struct FrozenLayer {
+    constexpr static size_t FANOUT = 64;
+
+    const uint64_t *data;
+    size_t size;  // slots
+    int tile_sum;
+    // levels[0] has a key per block of slots; levels.back() is a single node. Each level is padded to whole
+    // nodes with UINT64_MAX.
+    std::vector<std::vector<uint64_t>> levels;
+
+    // Throws std::runtime_error if the layer is not sorted
+    explicit FrozenLayer(const AdvancedHashSet& layer) : FrozenLayer(layer.data, layer.capacity, layer.tile_sum) {}
+    // Over slots stored elsewhere, e.g. a LayerFile
+    FrozenLayer(const uint64_t *data, size_t size, int tile_sum);
+
+    bool contains(Position position) const;
+    // out[i] = contains(positions[i]), in parallel with the tree walks of neighbouring queries interleaved
+    void contains_batch(const uint64_t *positions, size_t n, bool *out) const;
+
+    // Slot holding key (a sorted position >> 4), or SIZE_MAX
+    size_t find(uint64_t key) const;
+    // out[i] = find(keys[i]), batched like contains_batch
+    void find_batch(const uint64_t *keys, size_t n, size_t *out) const;
+
+    size_t index_bytes() const;
+
+private:
+    // Step from node on level to its child holding key; false if key is below the node's first key
+    bool descend(size_t level, size_t& node, uint64_t key) const;
+    // Slot of the block holding key, or SIZE_MAX
+    size_t scan_block(size_t block, uint64_t key) const;
+    // find for up to BATCH keys, walking them down the tree together
+    void find_group(const uint64_t *keys, size_t count, size_t *out) const;
+};
+
+#endif //FROZENLAYER_H
@@ -0,0 +1,30 @@
+#include "KeyCdf.h"
+
+#include <algorithm>
+
+KeyCdf KeyCdf::fit(std::vector<uint64_t>& sample, size_t segments) {
+    KeyCdf model;
+    if (sample.empty()) {
+        return model;
+    }
+    std::sort(sample.begin(), sample.end());
+    segments = std::max<size_t>(1, std::min(segments, sample.size()));
+    for (size_t i = 0; i <= segments; ++i) {
+        model.knots.push_back(sample[std::min(sample.size() - 1, sample.size() * i / segments)]);
+    }
+    return model;
+}
+
+double KeyCdf::cdf(uint64_t key) const {
+    if (knots.size() < 2 || key <= knots.front()) {
+        return 0;
+    }
+    if (key >= knots.back()) {
+        return 1;
+    }
+    // Segment [knots[j], knots[j + 1]) containing key; runs of equal knots collapse to their last
+    size_t j = std::upper_bound(knots.begin(), knots.end(), key) - knots.begin() - 1;
+    double width = knots[j + 1] - knots[j];
+    double within = width > 0 ? (key - knots[j]) / width : 0;
+    return (j + within) / (knots.size() - 1);
+}
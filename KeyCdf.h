@@ -0,0 +1,31 @@
+//
+// Created by root on 6/27/25.
+//
+
+#ifndef KEYCDF_H
+#define KEYCDF_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Piecewise-linear model of the distribution of stored keys, used as an order-preserving placement function
+// for AdvancedHashSet: slot() is monotone in the key, so with linear probing a gorged table comes out nearly
+// sorted. The knots are equally spaced quantiles of a sample of keys.
+struct KeyCdf {
+    // segments + 1 keys: knots[i] is the i / segments quantile of the sample
+    std::vector<uint64_t> knots;
+
+    // Fit from a sample of keys (sorted in place)
+    static KeyCdf fit(std::vector<uint64_t>& sample, size_t segments = 4096);
+
+    // Estimated fraction of keys below key, in [0, 1]
+    double cdf(uint64_t key) const;
+
+    size_t slot(uint64_t key, size_t capacity) const {
+        return std::min(capacity - 1, (size_t)(cdf(key) * capacity));
+    }
+};
+
+#endif //KEYCDF_H
@@ -0,0 +1,80 @@
+#include "LayerFile.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char LAYER_MAGIC[8] = { '2', '0', '4', '8', 'L', 'A', 'Y', 'R' };
+constexpr uint32_t LAYER_VERSION = 1;
+
+void save_layer(const AdvancedHashSet& layer, const std::string& filename) {
+    TraceScope scope("save layer");
+    LayerFileHeader header {};
+    memcpy(header.magic, LAYER_MAGIC, sizeof(LAYER_MAGIC));
+    header.version = LAYER_VERSION;
+    header.tile_sum = layer.tile_sum;
+    header.slots = layer.capacity;
+    header.positions = layer.parallel_count();
+    constexpr uint64_t key_mask = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+    bool sorted = true;
+#pragma omp parallel for reduction(&&:sorted)
+    for (size_t i = 1; i < layer.capacity; ++i) {
+        sorted = sorted && (layer.data[i - 1] & key_mask) < (layer.data[i] & key_mask);
+    }
+    header.sorted = sorted;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create " + filename);
+    }
+    auto write_all = [&] (const void *p, size_t bytes) {
+        for (const char *c = (const char *)p; bytes; ) {
+            ssize_t written = write(fd, c, bytes);
+            if (written <= 0) {
+                close(fd);
+                throw std::runtime_error("Error writing " + filename);
+            }
+            c += written;
+            bytes -= written;
+        }
+    };
+    write_all(&header, sizeof(header));
+    write_all(layer.data, layer.capacity * sizeof(uint64_t));
+    close(fd);
+}
+
+LayerFile::LayerFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LayerFileHeader)) {
+        close(fd);
+        throw std::runtime_error(filename + " is not a layer file");
+    }
+    map_bytes = st.st_size;
+    map = mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = nullptr;
+        throw std::runtime_error("Could not map " + filename);
+    }
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, LAYER_MAGIC, sizeof(LAYER_MAGIC)) || header.version != LAYER_VERSION
+        || sizeof(header) + header.slots * sizeof(uint64_t) != map_bytes) {
+        munmap(map, map_bytes);
+        map = nullptr;
+        throw std::runtime_error(filename + " is not a layer file");
+    }
+    data = (const uint64_t *)((const char *)map + sizeof(header));
+}
+
+LayerFile::~LayerFile() {
+    if (map) {
+        munmap(map, map_bytes);
+    }
+}
@@ -0,0 +1,51 @@
+//
+// Created by root on 6/30/25.
+//
+
+#ifndef LAYERFILE_H
+#define LAYERFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "AdvancedHashSet.h"
+
+// On-disk form of a finished layer: a 64-byte header followed by the slots as stored in the table. Saved layers
+// are read back by mapping the file, so opening one costs nothing until it is touched.
+struct LayerFileHeader {
+    char magic[8];  // "2048LAYR"
+    uint32_t version;
+    int32_t tile_sum;
+    uint64_t slots;
+    uint64_t positions;
+    uint32_t sorted;  // slots are in key order (gorge_sorted)
+    uint32_t reserved[7];
+};
+static_assert(sizeof(LayerFileHeader) == 64);
+
+// Throws std::runtime_error on I/O errors
+void save_layer(const AdvancedHashSet& layer, const std::string& filename);
+
+// Read-only mapping of a saved layer. Throws std::runtime_error if the file is missing or not a layer.
+struct LayerFile {
+    LayerFileHeader header;
+    const uint64_t *data = nullptr;  // slots
+    void *map = nullptr;
+    size_t map_bytes = 0;
+
+    explicit LayerFile(const std::string& filename);
+    ~LayerFile();
+    LayerFile(const LayerFile&) = delete;
+    LayerFile& operator=(const LayerFile&) = delete;
+
+    int tile_sum() const {
+        return header.tile_sum;
+    }
+
+    size_t slots() const {
+        return header.slots;
+    }
+};
+
+#endif //LAYERFILE_H
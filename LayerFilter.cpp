@@ -0,0 +1,140 @@
+#include "LayerFilter.h"
+
+#include <cstring>
+#include <fstream>
+#include <immintrin.h>
+#include <omp.h>
+#include <stdexcept>
+
+constexpr char FILTER_MAGIC[8] = { '2', '0', '4', '8', 'B', 'L', 'O', 'M' };
+constexpr uint32_t FILTER_VERSION = 1;
+// Queries per group in may_contain_batch
+constexpr size_t BATCH = 16;
+
+static uint64_t mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static size_t block_of(uint64_t hash, size_t blocks) {
+    return (unsigned __int128)hash * blocks >> 64;
+}
+
+// One bit per word, six hash bits each, from a second mix so they are independent of the block
+static __m512i bits_of(uint64_t hash) {
+    uint64_t h = mix(hash ^ 0x9e3779b97f4a7c15ULL);
+    __m512i shifts = _mm512_and_si512(
+        _mm512_srlv_epi64(_mm512_set1_epi64(h), _mm512_setr_epi64(0, 6, 12, 18, 24, 30, 36, 42)),
+        _mm512_set1_epi64(63));
+    return _mm512_sllv_epi64(_mm512_set1_epi64(1), shifts);
+}
+
+LayerFilter LayerFilter::build(const uint64_t *slots, size_t slot_count, int tile_sum, double bits_per_key) {
+    TraceScope scope("build filter");
+    LayerFilter filter;
+    filter.tile_sum = tile_sum;
+    size_t keys = 0;
+#pragma omp parallel for reduction(+:keys)
+    for (size_t i = 0; i < slot_count; ++i) {
+        keys += __builtin_popcountll(slots[i] >> AdvancedHashSet::POSITION_BITS);
+    }
+    filter.keys = keys;
+    filter.blocks.assign(std::max<size_t>(1, (size_t)(keys * bits_per_key / 512) + 1), {});
+
+    size_t blocks = filter.blocks.size();
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < slot_count; ++i) {
+        if (!slots[i]) {
+            continue;
+        }
+        AdvancedHashSet::unpack_slot(tile_sum, slots[i], [&] (Position p) {
+            uint64_t hash = mix(p.bits);
+            alignas(64) uint64_t bits[8];
+            _mm512_store_si512(bits, bits_of(hash));
+            uint64_t *words = filter.blocks[block_of(hash, blocks)].words;
+            for (int w = 0; w < 8; ++w) {
+                if (!(__atomic_load_n(&words[w], __ATOMIC_RELAXED) & bits[w])) {
+                    __atomic_fetch_or(&words[w], bits[w], __ATOMIC_RELAXED);
+                }
+            }
+        });
+    }
+    return filter;
+}
+
+bool LayerFilter::may_contain(Position position) const {
+    if (position.tile_sum() != tile_sum) {
+        return false;
+    }
+    uint64_t hash = mix(position.bits);
+    __m512i block = _mm512_load_si512(blocks[block_of(hash, blocks.size())].words);
+    __m512i bits = bits_of(hash);
+    // Rejected if some wanted bit is clear in the block
+    return !_mm512_test_epi64_mask(_mm512_andnot_si512(block, bits), bits);
+}
+
+void LayerFilter::may_contain_batch(const uint64_t *positions, size_t n, bool *out) const {
+#pragma omp parallel for schedule(static)
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t count = std::min(BATCH, n - start);
+        for (size_t q = 0; q < count; ++q) {
+            uint64_t hash = mix(positions[start + q]);
+            _mm_prefetch((const char *)blocks[block_of(hash, blocks.size())].words, _MM_HINT_T0);
+        }
+        for (size_t q = 0; q < count; ++q) {
+            out[start + q] = may_contain(Position { positions[start + q] });
+        }
+    }
+}
+
+// File: magic, version, tile sum, keys, block count, blocks
+void LayerFilter::save(const std::string& filename) const {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not create " + filename);
+    }
+    uint64_t block_count = blocks.size();
+    out.write(FILTER_MAGIC, sizeof(FILTER_MAGIC));
+    out.write((const char *)&FILTER_VERSION, sizeof(FILTER_VERSION));
+    out.write((const char *)&tile_sum, sizeof(tile_sum));
+    out.write((const char *)&keys, sizeof(keys));
+    out.write((const char *)&block_count, sizeof(block_count));
+    out.write((const char *)blocks.data(), block_count * sizeof(Block));
+    if (!out) {
+        throw std::runtime_error("Error writing " + filename);
+    }
+}
+
+LayerFilter LayerFilter::load(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    auto get = [&] (void *p, size_t bytes) {
+        if (!in.read((char *)p, bytes)) {
+            throw std::runtime_error(filename + " is truncated");
+        }
+    };
+    char magic[8];
+    uint32_t version;
+    get(magic, sizeof(magic));
+    get(&version, sizeof(version));
+    if (memcmp(magic, FILTER_MAGIC, sizeof(magic)) || version != FILTER_VERSION) {
+        throw std::runtime_error(filename + " is not a layer filter file");
+    }
+    LayerFilter filter;
+    uint64_t block_count;
+    get(&filter.tile_sum, sizeof(filter.tile_sum));
+    get(&filter.keys, sizeof(filter.keys));
+    get(&block_count, sizeof(block_count));
+    if (block_count == 0) {
+        throw std::runtime_error(filename + " is not a layer filter file");
+    }
+    filter.blocks.resize(block_count);
+    get(filter.blocks.data(), block_count * sizeof(Block));
+    return filter;
+}
@@ -0,0 +1,55 @@
+//
+// Created by root on 7/2/25.
+//
+
+#ifndef LAYERFILTER_H
+#define LAYERFILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "AdvancedHashSet.h"
+#include "LayerFile.h"
+
+// Blocked Bloom filter over the positions of a layer, to reject most positions that are not in it with one
+// cache line read, before going to FrozenLayer, LayerRank or the layer itself. A position hashes to one 512-bit
+// block and sets one bit in each of its eight words; queries check all eight with a few AVX-512 instructions.
+// With 12 bits per position, about 0.5% of negatives get through.
+struct LayerFilter {
+    struct alignas(64) Block {
+        uint64_t words[8];
+    };
+
+    int tile_sum = 0;
+    size_t keys = 0;
+    std::vector<Block> blocks;
+
+    // Build over the positions stored in slots (empty slots are skipped), in parallel
+    static LayerFilter build(const uint64_t *slots, size_t slot_count, int tile_sum, double bits_per_key = 12);
+    static LayerFilter build(const AdvancedHashSet& layer, double bits_per_key = 12) {
+        return build(layer.data, layer.capacity, layer.tile_sum, bits_per_key);
+    }
+    static LayerFilter build(const LayerFile& file, double bits_per_key = 12) {
+        return build(file.data, file.slots(), file.tile_sum(), bits_per_key);
+    }
+
+    // False only if position is certainly not in the layer
+    bool may_contain(Position position) const;
+    // out[i] = may_contain(positions[i]), in parallel with the block loads of neighbouring queries overlapped
+    void may_contain_batch(const uint64_t *positions, size_t n, bool *out) const;
+
+    size_t bytes() const {
+        return blocks.size() * sizeof(Block);
+    }
+
+    // Saved next to the layer file, as <layer file>.bloom. Both throw std::runtime_error.
+    static std::string path_for(const std::string& layer_filename) {
+        return layer_filename + ".bloom";
+    }
+    void save(const std::string& filename) const;
+    static LayerFilter load(const std::string& filename);
+};
+
+#endif //LAYERFILTER_H
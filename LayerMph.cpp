@@ -0,0 +1,224 @@
+#include "LayerMph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <omp.h>
+#include <stdexcept>
+
+constexpr char MPH_MAGIC[8] = { '2', '0', '4', '8', 'M', 'P', 'H', 'F' };
+constexpr uint32_t MPH_VERSION = 1;
+constexpr size_t WORDS_PER_BLOCK = LayerMph::BLOCK_BITS / 64;
+
+static uint64_t level_hash(uint64_t key, int level) {
+    key ^= (level + 1) * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// Bit of key within a level of size bits
+static uint64_t level_bit(uint64_t key, int level, uint64_t size) {
+    return (unsigned __int128)level_hash(key, level) * size >> 64;
+}
+
+static bool test_bit(const std::vector<uint64_t>& bits, uint64_t i) {
+    return bits[i / 64] >> (i % 64) & 1;
+}
+
+// Pack the levels into blocks and fill in the ranks
+static void pack_blocks(LayerMph& mph, const std::vector<std::vector<uint64_t>>& levels) {
+    uint64_t total_bits = mph.level_offsets.empty() ? 0 : mph.level_offsets.back() + mph.level_sizes.back();
+    mph.blocks.assign((total_bits + LayerMph::BLOCK_BITS - 1) / LayerMph::BLOCK_BITS, {});
+    for (size_t l = 0; l < levels.size(); ++l) {
+        uint64_t offset = mph.level_offsets[l];
+#pragma omp parallel for schedule(static)
+        for (uint64_t i = 0; i < mph.level_sizes[l]; i += 64) {
+            uint64_t word = levels[l][i / 64];
+            // Levels start on word boundaries, and blocks hold whole words
+            uint64_t bit = offset + i;
+            mph.blocks[bit / LayerMph::BLOCK_BITS].bits[bit % LayerMph::BLOCK_BITS / 64] = word;
+        }
+    }
+    uint64_t rank = 0;
+    for (auto& block : mph.blocks) {
+        block.rank = rank;
+        for (uint64_t word : block.bits) {
+            rank += __builtin_popcountll(word);
+        }
+    }
+}
+
+LayerMph LayerMph::build(const uint64_t *slots, size_t slot_count, int tile_sum, double gamma) {
+    TraceScope scope("build mph");
+    LayerMph mph;
+    mph.tile_sum = tile_sum;
+    mph.gamma = gamma;
+
+    // Keys for the next level, per thread. Level 0 reads the layer directly.
+    int threads = omp_get_max_threads();
+    std::vector<std::vector<uint64_t>> pending(threads);
+    std::vector<uint64_t> current;
+    size_t level_keys = 0;
+#pragma omp parallel for reduction(+:level_keys)
+    for (size_t i = 0; i < slot_count; ++i) {
+        level_keys += __builtin_popcountll(slots[i] >> AdvancedHashSet::POSITION_BITS);
+    }
+    mph.keys = level_keys;
+
+    // Call f on every key that reaches the level, in parallel
+    auto for_each_key = [&] (int level, auto&& f) {
+        if (level == 0) {
+#pragma omp parallel for schedule(static)
+            for (size_t i = 0; i < slot_count; ++i) {
+                if (slots[i]) {
+                    AdvancedHashSet::unpack_slot(tile_sum, slots[i], [&] (Position p) { f(p.bits); });
+                }
+            }
+        } else {
+#pragma omp parallel for schedule(static)
+            for (size_t i = 0; i < current.size(); ++i) {
+                f(current[i]);
+            }
+        }
+    };
+
+    std::vector<std::vector<uint64_t>> levels;
+    uint64_t offset = 0;
+    for (int level = 0; level < MAX_LEVELS && level_keys; ++level) {
+        uint64_t size = std::max<uint64_t>(64, (uint64_t)(level_keys * gamma + 63) / 64 * 64);
+        std::vector<uint64_t> seen(size / 64), collided(size / 64);
+        for_each_key(level, [&] (uint64_t key) {
+            uint64_t bit = level_bit(key, level, size);
+            uint64_t mask = 1ULL << (bit % 64);
+            if (__atomic_fetch_or(&seen[bit / 64], mask, __ATOMIC_RELAXED) & mask) {
+                __atomic_fetch_or(&collided[bit / 64], mask, __ATOMIC_RELAXED);
+            }
+        });
+        for_each_key(level, [&] (uint64_t key) {
+            if (test_bit(collided, level_bit(key, level, size))) {
+                pending[omp_get_thread_num()].push_back(key);
+            }
+        });
+#pragma omp parallel for schedule(static)
+        for (size_t w = 0; w < seen.size(); ++w) {
+            seen[w] &= ~collided[w];
+        }
+        levels.push_back(std::move(seen));
+        mph.level_offsets.push_back(offset);
+        mph.level_sizes.push_back(size);
+        offset += size;
+
+        current.clear();
+        for (auto& keys : pending) {
+            current.insert(current.end(), keys.begin(), keys.end());
+            keys.clear();
+        }
+        level_keys = current.size();
+    }
+    mph.leftovers = std::move(current);
+    std::sort(mph.leftovers.begin(), mph.leftovers.end());
+    pack_blocks(mph, levels);
+    return mph;
+}
+
+size_t LayerMph::index(Position position) const {
+    uint64_t key = position.bits;
+    for (size_t l = 0; l < level_sizes.size(); ++l) {
+        uint64_t bit = level_offsets[l] + level_bit(key, l, level_sizes[l]);
+        const Block& block = blocks[bit / BLOCK_BITS];
+        size_t word = bit % BLOCK_BITS / 64;
+        if (block.bits[word] >> (bit % 64) & 1) {
+            uint64_t rank = block.rank;
+            for (size_t w = 0; w < word; ++w) {
+                rank += __builtin_popcountll(block.bits[w]);
+            }
+            return rank + __builtin_popcountll(block.bits[word] & ((1ULL << (bit % 64)) - 1));
+        }
+    }
+    if (leftovers.empty()) {
+        return 0;  // not in the layer
+    }
+    size_t leftover = std::lower_bound(leftovers.begin(), leftovers.end(), key) - leftovers.begin();
+    return keys - leftovers.size() + std::min(leftover, leftovers.size() - 1);
+}
+
+// File: magic, version, tile sum, gamma, keys, level count, level sizes, leftover count, leftovers, then the
+// level bits word by word. Offsets and ranks are rebuilt on load.
+void LayerMph::save(const std::string& filename) const {
+    TraceScope scope("save mph");
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not create " + filename);
+    }
+    auto put = [&] (const void *p, size_t bytes) {
+        out.write((const char *)p, bytes);
+    };
+    uint64_t level_count = level_sizes.size(), leftover_count = leftovers.size();
+    put(MPH_MAGIC, sizeof(MPH_MAGIC));
+    put(&MPH_VERSION, sizeof(MPH_VERSION));
+    put(&tile_sum, sizeof(tile_sum));
+    put(&gamma, sizeof(gamma));
+    put(&keys, sizeof(keys));
+    put(&level_count, sizeof(level_count));
+    put(level_sizes.data(), level_count * sizeof(uint64_t));
+    put(&leftover_count, sizeof(leftover_count));
+    put(leftovers.data(), leftover_count * sizeof(uint64_t));
+    for (size_t l = 0; l < level_count; ++l) {
+        for (uint64_t i = 0; i < level_sizes[l]; i += 64) {
+            uint64_t bit = level_offsets[l] + i;
+            put(&blocks[bit / BLOCK_BITS].bits[bit % BLOCK_BITS / 64], sizeof(uint64_t));
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("Error writing " + filename);
+    }
+}
+
+LayerMph LayerMph::load(const std::string& filename) {
+    TraceScope scope("load mph");
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    auto get = [&] (void *p, size_t bytes) {
+        if (!in.read((char *)p, bytes)) {
+            throw std::runtime_error(filename + " is truncated");
+        }
+    };
+    char magic[8];
+    uint32_t version;
+    get(magic, sizeof(magic));
+    get(&version, sizeof(version));
+    if (memcmp(magic, MPH_MAGIC, sizeof(magic)) || version != MPH_VERSION) {
+        throw std::runtime_error(filename + " is not a perfect hash file");
+    }
+    LayerMph mph;
+    uint64_t level_count, leftover_count;
+    get(&mph.tile_sum, sizeof(mph.tile_sum));
+    get(&mph.gamma, sizeof(mph.gamma));
+    get(&mph.keys, sizeof(mph.keys));
+    get(&level_count, sizeof(level_count));
+    if (level_count > MAX_LEVELS) {
+        throw std::runtime_error(filename + " is not a perfect hash file");
+    }
+    mph.level_sizes.resize(level_count);
+    get(mph.level_sizes.data(), level_count * sizeof(uint64_t));
+    get(&leftover_count, sizeof(leftover_count));
+    mph.leftovers.resize(leftover_count);
+    get(mph.leftovers.data(), leftover_count * sizeof(uint64_t));
+
+    std::vector<std::vector<uint64_t>> levels(level_count);
+    uint64_t offset = 0;
+    for (size_t l = 0; l < level_count; ++l) {
+        mph.level_offsets.push_back(offset);
+        offset += mph.level_sizes[l];
+        levels[l].resize(mph.level_sizes[l] / 64);
+        get(levels[l].data(), levels[l].size() * sizeof(uint64_t));
+    }
+    pack_blocks(mph, levels);
+    return mph;
+}
@@ -0,0 +1,68 @@
+//
+// Created by root on 7/1/25.
+//
+
+#ifndef LAYERMPH_H
+#define LAYERMPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "AdvancedHashSet.h"
+#include "LayerFile.h"
+
+// Minimal perfect hash over the positions of a layer (BBHash): maps each of the layer's n positions to a
+// distinct index in [0, n), for value arrays aligned to the layer when no ordering is needed. The layer need
+// not be sorted.
+//
+// Level l is a bitvector of about gamma times the keys that reached it. A key hashes to one bit per level; keys
+// that land alone on their bit stay there, the rest go on to the next level. A key's index is the rank of its
+// bit among all set bits. The bits are stored 448 to a cache line next to the rank of the line, so each level
+// probed costs one miss; with gamma = 1, lookups probe about 1.6 levels on average. Keys still colliding after
+// MAX_LEVELS go to a small sorted list.
+//
+// Positions not in the layer get an arbitrary index.
+struct LayerMph {
+    constexpr static int MAX_LEVELS = 24;
+    constexpr static size_t BLOCK_BITS = 448;
+
+    struct alignas(64) Block {
+        uint64_t rank;  // set bits in earlier blocks
+        uint64_t bits[BLOCK_BITS / 64];
+    };
+
+    int tile_sum = 0;
+    size_t keys = 0;
+    double gamma = 1;
+    // First bit and size in bits of each level
+    std::vector<uint64_t> level_offsets, level_sizes;
+    std::vector<Block> blocks;
+    // Keys that never landed alone, sorted; they take the last indices
+    std::vector<uint64_t> leftovers;
+
+    // Build over the positions stored in slots (empty slots are skipped), in parallel
+    static LayerMph build(const uint64_t *slots, size_t slot_count, int tile_sum, double gamma = 1.0);
+    static LayerMph build(const AdvancedHashSet& layer, double gamma = 1.0) {
+        return build(layer.data, layer.capacity, layer.tile_sum, gamma);
+    }
+    static LayerMph build(const LayerFile& file, double gamma = 1.0) {
+        return build(file.data, file.slots(), file.tile_sum(), gamma);
+    }
+
+    size_t index(Position position) const;
+
+    size_t bytes() const {
+        return blocks.size() * sizeof(Block) + leftovers.size() * sizeof(uint64_t);
+    }
+
+    // Saved next to the layer file it was built from, as <layer file>.mph. Both throw std::runtime_error.
+    static std::string path_for(const std::string& layer_filename) {
+        return layer_filename + ".mph";
+    }
+    void save(const std::string& filename) const;
+    static LayerMph load(const std::string& filename);
+};
+
+#endif //LAYERMPH_H
@@ -0,0 +1,144 @@
+#include "LayerRank.h"
+
+#include <algorithm>
+#include <immintrin.h>
+#include <stdexcept>
+
+constexpr size_t FANOUT = FrozenLayer::FANOUT;
+constexpr int POSITION_BITS = AdvancedHashSet::POSITION_BITS;
+constexpr uint64_t KEY_MASK = (1ULL << POSITION_BITS) - 1;
+// Queries per group in the batched calls
+constexpr size_t BATCH = 16;
+
+LayerRank::LayerRank(const uint64_t *data, size_t slots, int tile_sum) : index(data, slots, tile_sum) {
+    TraceScope scope("rank index");
+    size_t blocks = (slots + FANOUT - 1) / FANOUT;
+    block_starts.resize(blocks + 1);
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < blocks; ++b) {
+        size_t count = 0;
+        for (size_t i = b * FANOUT; i < std::min(slots, (b + 1) * FANOUT); ++i) {
+            count += __builtin_popcountll(data[i] >> POSITION_BITS);
+        }
+        block_starts[b + 1] = count;
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+        block_starts[b + 1] += block_starts[b];
+    }
+    positions = block_starts[blocks];
+
+    unrank_blocks.resize((positions + UNRANK_SAMPLE - 1) / UNRANK_SAMPLE);
+#pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < blocks; ++b) {
+        for (size_t j = (block_starts[b] + UNRANK_SAMPLE - 1) / UNRANK_SAMPLE;
+             j * UNRANK_SAMPLE < block_starts[b + 1]; ++j) {
+            unrank_blocks[j] = b;
+        }
+    }
+}
+
+size_t LayerRank::rank_in_block(size_t slot, int perm) const {
+    size_t count = 0;
+    for (size_t i = slot / FANOUT * FANOUT; i < slot; ++i) {
+        count += __builtin_popcountll(index.data[i] >> POSITION_BITS);
+    }
+    return count + __builtin_popcountll(index.data[slot] >> POSITION_BITS & ((1ULL << perm) - 1));
+}
+
+size_t LayerRank::rank(Position position) const {
+    if (position.tile_sum() != index.tile_sum) {
+        return SIZE_MAX;
+    }
+    auto [ perm, sorted ] = sort_lower_3(position);
+    size_t slot = index.find(sorted.bits >> 4);
+    if (slot == SIZE_MAX || !(index.data[slot] >> (POSITION_BITS + perm) & 1)) {
+        return SIZE_MAX;
+    }
+    return block_starts[slot / FANOUT] + rank_in_block(slot, perm);
+}
+
+size_t LayerRank::block_of(size_t i) const {
+    // The sample's block starts at or before i, and few blocks later one ends after it
+    size_t first = unrank_blocks[i / UNRANK_SAMPLE];
+    size_t last = i / UNRANK_SAMPLE + 1 < unrank_blocks.size() ? unrank_blocks[i / UNRANK_SAMPLE + 1] + 1
+        : block_starts.size() - 1;
+    return std::upper_bound(block_starts.begin() + first, block_starts.begin() + last, i) - block_starts.begin() - 1;
+}
+
+Position LayerRank::decode(size_t block, size_t i) const {
+    size_t remaining = i - block_starts[block];
+    for (size_t slot = block * FANOUT; ; ++slot) {
+        uint64_t d = index.data[slot];
+        uint64_t perms = d >> POSITION_BITS;
+        size_t count = __builtin_popcountll(perms);
+        if (remaining < count) {
+            // Keep only the wanted permutation bit, so unpack_slot yields just that position
+            uint64_t bit = _pdep_u64(1ULL << remaining, perms);
+            Position result { 0 };
+            AdvancedHashSet::unpack_slot(index.tile_sum, (d & KEY_MASK) | bit << POSITION_BITS,
+                [&] (Position p) { result = p; });
+            return result;
+        }
+        remaining -= count;
+    }
+}
+
+Position LayerRank::unrank(size_t i) const {
+    if (i >= positions) {
+        throw std::runtime_error("Rank " + std::to_string(i) + " is past the end of the layer");
+    }
+    return decode(block_of(i), i);
+}
+
+void LayerRank::rank_batch(const uint64_t *queries, size_t n, size_t *out) const {
+    std::vector<uint64_t> keys(n);
+    std::vector<int> perms(n);
+#pragma omp parallel for schedule(static)
+    for (size_t q = 0; q < n; ++q) {
+        Position position { queries[q] };
+        auto [ perm, sorted ] = sort_lower_3(position);
+        // Positions of other tile sums get a key wider than any stored one
+        keys[q] = position.tile_sum() == index.tile_sum ? sorted.bits >> 4 : UINT64_MAX;
+        perms[q] = perm;
+    }
+    // Slots go straight into out, to be replaced by ranks
+    index.find_batch(keys.data(), n, out);
+#pragma omp parallel for schedule(static)
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t count = std::min(BATCH, n - start);
+        for (size_t q = start; q < start + count; ++q) {
+            if (out[q] != SIZE_MAX) {
+                _mm_prefetch((const char *)&block_starts[out[q] / FANOUT], _MM_HINT_T0);
+            }
+        }
+        for (size_t q = start; q < start + count; ++q) {
+            size_t slot = out[q];
+            out[q] = slot == SIZE_MAX || !(index.data[slot] >> (POSITION_BITS + perms[q]) & 1) ? SIZE_MAX
+                : block_starts[slot / FANOUT] + rank_in_block(slot, perms[q]);
+        }
+    }
+}
+
+void LayerRank::unrank_batch(const uint64_t *indices, size_t n, uint64_t *out) const {
+    for (size_t q = 0; q < n; ++q) {
+        if (indices[q] >= positions) {
+            throw std::runtime_error("Rank " + std::to_string(indices[q]) + " is past the end of the layer");
+        }
+    }
+#pragma omp parallel for schedule(static)
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t count = std::min(BATCH, n - start);
+        size_t blocks[BATCH];
+        for (size_t q = 0; q < count; ++q) {
+            blocks[q] = block_of(indices[start + q]);
+            _mm_prefetch((const char *)(index.data + blocks[q] * FANOUT), _MM_HINT_T0);
+        }
+        for (size_t q = 0; q < count; ++q) {
+            out[start + q] = decode(blocks[q], indices[start + q]).bits;
+        }
+    }
+}
+
+size_t LayerRank::index_bytes() const {
+    return index.index_bytes() + block_starts.size() * sizeof(uint64_t) + unrank_blocks.size() * sizeof(uint32_t);
+}
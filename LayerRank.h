@@ -0,0 +1,56 @@
+//
+// Created by root on 6/30/25.
+//
+
+#ifndef LAYERRANK_H
+#define LAYERRANK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrozenLayer.h"
+#include "LayerFile.h"
+
+// Dense numbering of the positions of a sorted layer, in slot order and then permutation order within a slot.
+// rank finds the slot through the FrozenLayer fence tree and adds the position count before its block of 64
+// slots to a popcount over the block; unrank jumps to a block through a sample every UNRANK_SAMPLE positions.
+// Both touch a couple of cache lines beyond the tree. With the tree, the index costs about 2 bits per slot.
+//
+// The slots must be sorted (gorge_sorted) and outlive the index.
+struct LayerRank {
+    constexpr static size_t UNRANK_SAMPLE = 4096;
+
+    FrozenLayer index;
+    size_t positions;
+    // Positions before each block of FANOUT slots, and the total at the end
+    std::vector<uint64_t> block_starts;
+    // Block holding position j * UNRANK_SAMPLE
+    std::vector<uint32_t> unrank_blocks;
+
+    // Throws std::runtime_error if the slots are not sorted
+    LayerRank(const uint64_t *data, size_t slots, int tile_sum);
+    explicit LayerRank(const AdvancedHashSet& layer) : LayerRank(layer.data, layer.capacity, layer.tile_sum) {}
+    explicit LayerRank(const LayerFile& file) : LayerRank(file.data, file.slots(), file.tile_sum()) {}
+
+    // Index of position in the layer, or SIZE_MAX if it is not in the layer
+    size_t rank(Position position) const;
+    // Inverse of rank; throws std::runtime_error if index >= positions
+    Position unrank(size_t index) const;
+
+    // The same over many queries in parallel, with neighbouring queries' cache misses overlapped
+    void rank_batch(const uint64_t *queries, size_t n, size_t *out) const;
+    void unrank_batch(const uint64_t *indices, size_t n, uint64_t *out) const;
+
+    size_t index_bytes() const;
+
+private:
+    // Block holding position number i
+    size_t block_of(size_t i) const;
+    // Position number i, which is in block
+    Position decode(size_t block, size_t i) const;
+    // Positions in the slots of slot's block before it, plus those in slot with a lower permutation bit
+    size_t rank_in_block(size_t slot, int perm) const;
+};
+
+#endif //LAYERRANK_H
@@ -0,0 +1,245 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+
+#include "MemoryProfile.h"
+
+std::atomic<int64_t> available_1gb_hugepages;
+std::atomic<int64_t> available_2mb_hugepages;
+
+constexpr size_t PAGE_4K = 4096, PAGE_2M = 2UL << 20, PAGE_1G = 1UL << 30;
+
+void initialize_hugepage_budget() {
+    available_1gb_hugepages = read_hugepage_pool(1024 * 1024).available();
+    available_2mb_hugepages = read_hugepage_pool(2048).available();
+}
+
+const char *to_string(PageBacking backing) {
+    switch (backing) {
+        case PageBacking::hugetlb_1gb: return "1GB pages";
+        case PageBacking::hugetlb_2mb: return "2MB pages";
+        case PageBacking::thp: return "transparent huge pages";
+        case PageBacking::small: return "4K pages";
+    }
+    return "?";
+}
+
+static std::atomic<int64_t>& pool_for(PageBacking backing) {
+    return backing == PageBacking::hugetlb_1gb ? available_1gb_hugepages : available_2mb_hugepages;
+}
+
+static bool reserve(std::atomic<int64_t>& pool, int64_t pages) {
+    int64_t available = pool.load();
+    do {
+        if (available < pages) {
+            return false;
+        }
+    } while (!pool.compare_exchange_weak(available, available - pages));
+    return true;
+}
+
+static bool thp_available() {
+    std::string mode;
+    std::getline(std::ifstream("/sys/kernel/mm/transparent_hugepage/enabled"), mode);
+    return mode.find("[never]") == std::string::npos;
+}
+
+// A huge page tier is worth it if rounding up wastes at most a quarter of the request
+static bool worth_rounding(size_t bytes, size_t page) {
+    size_t rounded = (bytes + page - 1) / page * page;
+    return rounded - bytes <= bytes / 4;
+}
+
+static size_t page_size_of(PageBacking backing) {
+    return backing == PageBacking::hugetlb_1gb ? PAGE_1G : backing == PageBacking::hugetlb_2mb ? PAGE_2M : PAGE_4K;
+}
+
+HugePageMapping::HugePageMapping(size_t bytes, bool allow_huge, void *at) : bytes(std::max(bytes, 1UL)) {
+    int fixed = at ? MAP_FIXED : 0;
+    for (PageBacking tier : { PageBacking::hugetlb_1gb, PageBacking::hugetlb_2mb }) {
+        size_t page = page_size_of(tier);
+        if (!allow_huge || !worth_rounding(this->bytes, page) || (uintptr_t)at % page) {
+            continue;
+        }
+        size_t pages = (this->bytes + page - 1) / page;
+        if (!reserve(pool_for(tier), pages)) {
+            continue;
+        }
+        int flag = tier == PageBacking::hugetlb_1gb ? (30 << MAP_HUGE_SHIFT) : (21 << MAP_HUGE_SHIFT);
+        void *ptr = mmap(at, pages * page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flag | fixed, -1, 0);
+        if (ptr != MAP_FAILED) {
+            data = (char*)ptr;
+            nr_pages = pages;
+            backing = tier;
+            return;
+        }
+        // The kernel disagrees with our accounting (someone else took pages); resync and fall through
+        pool_for(tier) = read_hugepage_pool(page / 1024).available();
+    }
+
+    bool thp = allow_huge && this->bytes >= PAGE_2M && thp_available();
+    size_t map_bytes = (this->bytes + PAGE_4K - 1) / PAGE_4K * PAGE_4K;
+    // Over-allocate so that the start can be aligned to 2MB, which THP needs
+    size_t slack = thp && !at ? PAGE_2M : 0;
+    void *ptr = mmap(at, map_bytes + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | fixed, -1, 0);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "Failed to map " << this->bytes << " bytes\n";
+        throw std::bad_alloc();
+    }
+    if (slack) {
+        uintptr_t start = (uintptr_t)ptr, aligned = (start + PAGE_2M - 1) & ~(PAGE_2M - 1);
+        if (aligned > start) {
+            munmap(ptr, aligned - start);
+        }
+        if (start + slack > aligned) {
+            munmap((char*)aligned + map_bytes, start + slack - aligned);
+        }
+        ptr = (void*)aligned;
+    }
+    if (thp) {
+        thp = madvise(ptr, map_bytes, MADV_HUGEPAGE) == 0;
+    }
+    data = (char*)ptr;
+    backing = thp ? PageBacking::thp : PageBacking::small;
+
+    if (allow_huge && !at && this->bytes >= PAGE_1G) {
+        // Only complain once if no pools are configured at all
+        static std::atomic<bool> warned_no_pool;
+        bool have_pool = read_hugepage_pool(1024 * 1024).total || read_hugepage_pool(2048).total;
+        if (have_pool || !warned_no_pool.exchange(true)) {
+            std::cerr << "Warning: no hugetlb pages for a " << (this->bytes >> 20) << " MB mapping, using "
+                << to_string(backing) << '\n';
+        }
+    }
+}
+
+HugePageMapping::HugePageMapping(HugePageMapping&& rhs) noexcept {
+    *this = std::move(rhs);
+}
+
+HugePageMapping& HugePageMapping::operator=(HugePageMapping&& rhs) noexcept {
+    if (this != &rhs) {
+        release();
+        data = rhs.data;
+        bytes = rhs.bytes;
+        nr_pages = rhs.nr_pages;
+        backing = rhs.backing;
+        pieces = std::move(rhs.pieces);
+        rhs.data = nullptr;
+        rhs.bytes = rhs.nr_pages = 0;
+        rhs.pieces.clear();
+    }
+    return *this;
+}
+
+size_t HugePageMapping::page_size() const {
+    return page_size_of(backing);
+}
+
+size_t HugePageMapping::mapped_bytes() const {
+    if (!pieces.empty()) {
+        size_t total = 0;
+        for (auto& piece : pieces) {
+            total += piece.mapped_bytes();
+        }
+        return total;
+    }
+    return (bytes + page_size() - 1) / page_size() * page_size();
+}
+
+std::vector<HugePageMapping> HugePageMapping::split_tail(size_t new_bytes) {
+    new_bytes = std::max(new_bytes, 1UL);
+    std::vector<HugePageMapping> tail;
+    if (!data || new_bytes >= bytes) {
+        return tail;
+    }
+
+    if (!pieces.empty()) {
+        size_t offset = 0;
+        std::vector<HugePageMapping> kept;
+        for (auto& piece : pieces) {
+            if (offset >= new_bytes) {
+                tail.push_back(std::move(piece));
+                continue;
+            }
+            size_t piece_bytes = piece.mapped_bytes();
+            if (offset + piece_bytes > new_bytes) {
+                for (auto& t : piece.split_tail(new_bytes - offset)) {
+                    tail.push_back(std::move(t));
+                }
+            }
+            offset += piece_bytes;
+            kept.push_back(std::move(piece));
+        }
+        pieces = std::move(kept);
+        bytes = new_bytes;
+        return tail;
+    }
+
+    size_t old_mapped = mapped_bytes();
+    bytes = new_bytes;
+    size_t new_mapped = mapped_bytes();
+    if (new_mapped < old_mapped) {
+        HugePageMapping t;
+        t.data = data + new_mapped;
+        t.bytes = old_mapped - new_mapped;
+        t.backing = backing;
+        if (nr_pages) {
+            t.nr_pages = t.bytes / page_size();
+            nr_pages -= t.nr_pages;
+        }
+        tail.push_back(std::move(t));
+    }
+    return tail;
+}
+
+void HugePageMapping::shrink(size_t new_bytes) {
+    // Dropping the split-off pieces unmaps them
+    split_tail(new_bytes);
+}
+
+bool HugePageMapping::move_to(char *at) {
+    if (!data || at == data) {
+        return true;
+    }
+    if (!pieces.empty()) {
+        // Pieces are contiguous, so they move by the same offset. If one can't move, those already moved go back
+        // to where their pages just were.
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            if (!pieces[i].move_to(at + (pieces[i].data - data))) {
+                while (i-- > 0) {
+                    pieces[i].move_to(data + (pieces[i].data - at));
+                }
+                return false;
+            }
+        }
+        data = at;
+        return true;
+    }
+    size_t len = mapped_bytes();
+    void *ptr = mremap(data, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, at);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    data = (char*)ptr;
+    return true;
+}
+
+void HugePageMapping::release() {
+    if (!pieces.empty()) {
+        pieces.clear();
+    } else if (data) {
+        munmap(data, mapped_bytes());
+        if (nr_pages) {
+            pool_for(backing) += nr_pages;
+        }
+    }
+    data = nullptr;
+    bytes = nr_pages = 0;
+}
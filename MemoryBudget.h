@@ -6,21 +6,68 @@
 #define MEMORYBUDGET_H
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 // Use this to predict the result of a HUGE_TLB mmap call. We get substantial perf improvements by keeping
-// large hash sets in 1GB pages, so these are quite valuable. We assume that all 1gb pages are used by this
-// program only.
-static std::atomic<int> available_1gb_hugepages;
+// large hash sets in 1GB pages, so these are quite valuable. We assume that all hugepages are used by this
+// program only. Both counters are read from sysfs at startup and debited when a mapping reserves pages, so
+// concurrently allocated tables don't race for the same pool.
+extern std::atomic<int64_t> available_1gb_hugepages;
+extern std::atomic<int64_t> available_2mb_hugepages;
 
+__attribute__((constructor))
+void initialize_hugepage_budget();
+
+// What a mapping ended up backed by, from best to worst.
+enum class PageBacking {
+    hugetlb_1gb,
+    hugetlb_2mb,
+    thp,  // regular pages with MADV_HUGEPAGE; the kernel may or may not collapse them
+    small
+};
+
+const char *to_string(PageBacking backing);
+
+// An anonymous, zero-filled mapping placed in the best page size available: 1GB hugetlb pages, then 2MB
+// hugetlb pages, then transparent huge pages, then 4K pages.
+//
+// A mapping can also be a composite of contiguous pieces with different page sizes (see TableArena), in
+// which case backing is the worst of them and the pieces own the memory.
 struct HugePageMapping {
-    char *data;
-    size_t nr_pages;
+    char *data = nullptr;
+    size_t bytes = 0;  // usable size; the mapping itself is rounded up to the page size
+    size_t nr_pages = 0;  // hugetlb pages reserved from the budget
+    PageBacking backing = PageBacking::small;
+    std::vector<HugePageMapping> pieces;
 
-    ~HugePageMapping() {
+    HugePageMapping() = default;
+    // Throws std::bad_alloc if even 4K pages can't be mapped. With allow_huge false, go straight to 4K. If at
+    // is given, the mapping replaces whatever is mapped there (MAP_FIXED), and only page sizes that at is
+    // aligned to are tried.
+    explicit HugePageMapping(size_t bytes, bool allow_huge = true, void *at = nullptr);
+
+    HugePageMapping(const HugePageMapping&) = delete;
+    HugePageMapping& operator=(const HugePageMapping&) = delete;
+    HugePageMapping(HugePageMapping&& rhs) noexcept;
+    HugePageMapping& operator=(HugePageMapping&& rhs) noexcept;
 
+    ~HugePageMapping() {
+        release();
     }
-};
 
+    // Give back memory beyond new_bytes, returning whole hugepages to the budget. The data pointer is unchanged.
+    void shrink(size_t new_bytes);
+    // Like shrink, but hand the whole pages past new_bytes to the caller instead of unmapping them.
+    std::vector<HugePageMapping> split_tail(size_t new_bytes);
+    // Move the pages to a new address without copying (mremap). The new range must not overlap the old one.
+    // Returns false, leaving the mapping (every piece of it) where it was, if the kernel refuses.
+    bool move_to(char *at);
+    void release();
 
+    size_t page_size() const;
+    size_t mapped_bytes() const;
+};
 
 #endif //MEMORYBUDGET_H
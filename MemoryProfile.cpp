@@ -0,0 +1,112 @@
+#include "MemoryProfile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+double MappingBacking::huge_fraction() const {
+    return resident_bytes ? (hugetlb_1gb_bytes + hugetlb_2mb_bytes + thp_bytes) / (double)resident_bytes : 0;
+}
+
+MappingBacking read_mapping_backing(const void *addr, size_t bytes) {
+    MappingBacking result;
+    if (!addr || !bytes) {
+        return result;
+    }
+    uintptr_t lo = (uintptr_t)addr, hi = lo + bytes;
+
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return result;
+    }
+
+    char line[512];
+    bool in_range = false;
+    size_t kernel_page_kb = 4, rss_kb = 0, hugetlb_kb = 0;
+    auto finish_vma = [&] {
+        if (!in_range) {
+            return;
+        }
+        if (hugetlb_kb) {
+            (kernel_page_kb >= 1024 * 1024 ? result.hugetlb_1gb_bytes : result.hugetlb_2mb_bytes) += hugetlb_kb * 1024;
+            result.resident_bytes += hugetlb_kb * 1024;
+        } else {
+            result.resident_bytes += rss_kb * 1024;
+            result.small_page_bytes += rss_kb * 1024;
+        }
+        rss_kb = hugetlb_kb = 0;
+        kernel_page_kb = 4;
+    };
+
+    while (fgets(line, sizeof(line), f)) {
+        uintptr_t start, end;
+        size_t kb;
+        // VMA header lines look like "7f12c0000000-7f1300000000 rw-p 00000000 00:00 0"
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            finish_vma();
+            in_range = start < hi && end > lo;
+            if (in_range) {
+                result.mapped_bytes += std::min(end, hi) - std::max(start, lo);
+            }
+        } else if (!in_range) {
+            continue;
+        } else if (sscanf(line, "Rss: %zu kB", &kb) == 1) {
+            rss_kb = kb;
+        } else if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            // THP is included in Rss
+            result.thp_bytes += kb * 1024;
+            rss_kb -= std::min(rss_kb, kb);
+        } else if (sscanf(line, "KernelPageSize: %zu kB", &kb) == 1) {
+            kernel_page_kb = kb;
+        } else if (sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1 || sscanf(line, "Shared_Hugetlb: %zu kB", &kb) == 1) {
+            hugetlb_kb += kb;
+        }
+    }
+    finish_vma();
+    fclose(f);
+
+    result.resident_bytes += result.thp_bytes;
+    return result;
+}
+
+static size_t read_status_kb(const char *field) {
+    std::ifstream file("/proc/self/status");
+    std::string line;
+    size_t len = strlen(field);
+    while (std::getline(file, line)) {
+        if (!line.compare(0, len, field)) {
+            return std::stoull(line.substr(len + 1)) * 1024;
+        }
+    }
+    return 0;
+}
+
+size_t read_peak_rss() {
+    return read_status_kb("VmHWM");
+}
+
+size_t read_current_rss() {
+    return read_status_kb("VmRSS");
+}
+
+void reset_peak_rss() {
+    std::ofstream file("/proc/self/clear_refs");
+    file << "5";
+}
+
+HugePagePool read_hugepage_pool(size_t page_kb) {
+    HugePagePool pool;
+    std::string base = "/sys/kernel/mm/hugepages/hugepages-" + std::to_string(page_kb) + "kB/";
+    std::ifstream(base + "nr_hugepages") >> pool.total;
+    std::ifstream(base + "free_hugepages") >> pool.free;
+    std::ifstream(base + "resv_hugepages") >> pool.reserved;
+    return pool;
+}
+
+void print_backing(std::ostream& out, const std::string& label, const MappingBacking& b) {
+    constexpr double MB = 1024 * 1024;
+    out << label << ": " << b.mapped_bytes / MB << " MB mapped, " << b.resident_bytes / MB << " MB resident ("
+        << b.hugetlb_1gb_bytes / MB << " MB 1G, " << b.hugetlb_2mb_bytes / MB << " MB 2M, "
+        << b.thp_bytes / MB << " MB THP, " << b.small_page_bytes / MB << " MB 4K)\n";
+}
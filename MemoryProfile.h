@@ -0,0 +1,49 @@
+//
+// Created by root on 6/24/25.
+//
+
+#ifndef MEMORYPROFILE_H
+#define MEMORYPROFILE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+// How the pages of a mapping are actually backed, from /proc/self/smaps.
+struct MappingBacking {
+    size_t mapped_bytes = 0;
+    size_t resident_bytes = 0;  // including hugetlb pages
+    size_t hugetlb_1gb_bytes = 0;
+    size_t hugetlb_2mb_bytes = 0;
+    size_t thp_bytes = 0;  // transparent huge pages (AnonHugePages)
+    size_t small_page_bytes = 0;  // resident in 4K pages
+
+    // Fraction of the resident bytes that are in some kind of huge page
+    double huge_fraction() const;
+};
+
+// Read the backing of all mappings overlapping [addr, addr + bytes).
+MappingBacking read_mapping_backing(const void *addr, size_t bytes);
+
+// Peak and current resident set size, from /proc/self/status.
+size_t read_peak_rss();
+size_t read_current_rss();
+// Reset the peak RSS to the current RSS, so the next read_peak_rss covers only what follows. Best effort.
+void reset_peak_rss();
+
+// Free/total pages of the given size (in kB) in the kernel's hugepage pool.
+struct HugePagePool {
+    size_t total = 0;
+    size_t free = 0;
+    size_t reserved = 0;  // promised to existing mappings but not yet faulted in
+
+    size_t available() const {
+        return free - std::min(free, reserved);
+    }
+};
+HugePagePool read_hugepage_pool(size_t page_kb);
+
+void print_backing(std::ostream& out, const std::string& label, const MappingBacking& backing);
+
+#endif //MEMORYPROFILE_H
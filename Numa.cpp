@@ -0,0 +1,157 @@
+#include "Numa.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <omp.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Topology.h"
+
+std::vector<NumaNode> read_numa_nodes() {
+    std::vector<NumaNode> nodes;
+    std::string online;
+    if (std::getline(std::ifstream("/sys/devices/system/node/online"), online)) {
+        for (int node : parse_cpu_list(online)) {
+            std::string cpulist;
+            std::getline(std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"), cpulist);
+            auto cpus = parse_cpu_list(cpulist);
+            if (!cpus.empty()) {
+                nodes.push_back({ node, cpus });
+            }
+        }
+    }
+    if (nodes.empty()) {
+        NumaNode all { 0, {} };
+        for (auto& cpu : read_cpu_topology()) {
+            all.cpus.push_back(cpu.cpu);
+        }
+        nodes.push_back(all);
+    }
+    return nodes;
+}
+
+const char *to_string(NumaPolicy policy) {
+    switch (policy) {
+        case NumaPolicy::none: return "first touch";
+        case NumaPolicy::interleave: return "interleave";
+        case NumaPolicy::partition: return "partition";
+    }
+    return "?";
+}
+
+constexpr int MASK_WORDS = 16;  // up to 1024 nodes
+
+static long mbind_nodes(void *addr, size_t len, int mode, const std::vector<int>& node_ids) {
+    unsigned long mask[MASK_WORDS] = {};
+    for (int node : node_ids) {
+        mask[node / 64] |= 1UL << (node % 64);
+    }
+    // maxnode counts one past the last bit, as in libnuma
+    return syscall(SYS_mbind, addr, len, mode, mask, MASK_WORDS * 64 + 1, MPOL_MF_MOVE);
+}
+
+static bool place_piece(const HugePageMapping& piece, size_t piece_offset, size_t total, NumaPolicy policy,
+        const std::vector<NumaNode>& nodes) {
+    std::vector<int> all;
+    for (auto& n : nodes) {
+        all.push_back(n.node);
+    }
+    size_t len = piece.mapped_bytes();
+    if (policy == NumaPolicy::interleave) {
+        return mbind_nodes(piece.data, len, MPOL_INTERLEAVE, all) == 0;
+    }
+
+    // Bind the part of the piece that overlaps each node's slice, with the slice boundaries rounded to the
+    // piece's page size
+    size_t page = piece.page_size();
+    auto boundary = [&] (size_t i) -> size_t {
+        size_t at = total * i / nodes.size();
+        if (at <= piece_offset) {
+            return 0;
+        }
+        size_t offset = std::min(at - piece_offset, len);
+        return std::min(len, (offset + page / 2) / page * page);
+    };
+    bool ok = true;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        size_t lo = boundary(i), hi = boundary(i + 1);
+        if (lo < hi) {
+            ok &= mbind_nodes(piece.data + lo, hi - lo, MPOL_BIND, { nodes[i].node }) == 0;
+        }
+    }
+    return ok;
+}
+
+bool numa_place(const HugePageMapping& mapping, NumaPolicy policy, const std::vector<NumaNode>& nodes) {
+    if (policy == NumaPolicy::none || nodes.size() < 2 || !mapping.data) {
+        return false;
+    }
+    size_t total = mapping.mapped_bytes();
+    if (mapping.pieces.empty()) {
+        return place_piece(mapping, 0, total, policy, nodes);
+    }
+    bool ok = true;
+    for (auto& piece : mapping.pieces) {
+        ok &= place_piece(piece, piece.data - mapping.data, total, policy, nodes);
+    }
+    return ok;
+}
+
+int numa_node_of_thread(int t, int n, const std::vector<NumaNode>& nodes) {
+    return (int)((size_t)t * nodes.size() / std::max(n, 1));
+}
+
+int numa_node_of_cpu(int cpu, const std::vector<NumaNode>& nodes) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (std::find(nodes[i].cpus.begin(), nodes[i].cpus.end(), cpu) != nodes[i].cpus.end()) {
+            return (int)i;
+        }
+    }
+    return 0;
+}
+
+void numa_pin_omp_threads(const std::vector<NumaNode>& nodes) {
+#pragma omp parallel
+    {
+        int node = numa_node_of_thread(omp_get_thread_num(), omp_get_num_threads(), nodes);
+        pin_current_thread(nodes[node].cpus);
+    }
+}
+
+std::vector<size_t> numa_resident_bytes(const void *addr, size_t bytes, const std::vector<NumaNode>& nodes) {
+    constexpr size_t SAMPLES = 4096, PAGE = 4096;
+    std::vector<size_t> result(nodes.size());
+    size_t pages = bytes / PAGE;
+    if (!pages) {
+        return result;
+    }
+    size_t samples = std::min(SAMPLES, pages);
+    std::vector<void*> sample_pages(samples);
+    std::vector<int> status(samples);
+    for (size_t i = 0; i < samples; ++i) {
+        sample_pages[i] = (char*)addr + pages * i / samples * PAGE;
+    }
+    if (syscall(SYS_move_pages, 0, samples, sample_pages.data(), nullptr, status.data(), 0) != 0) {
+        return result;
+    }
+    for (int s : status) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].node == s) {
+                result[i] += bytes / samples;
+            }
+        }
+    }
+    return result;
+}
+
+void print_numa_stats(std::ostream& out, const std::vector<NumaLayerStats>& stats) {
+    for (auto& s : stats) {
+        out << "Node " << s.node << ": " << (s.table_bytes >> 20) << " MB of h3, " << s.slots_scanned
+            << " slots scanned at " << s.scan_gb_per_second << " GB/s, "
+            << s.remote_probe_fraction * 100 << "% of probes remote\n";
+    }
+}
@@ -0,0 +1,65 @@
+//
+// Created by root on 6/26/25.
+//
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "MemoryBudget.h"
+
+// One NUMA node with CPUs, as described by /sys/devices/system/node.
+struct NumaNode {
+    int node;
+    std::vector<int> cpus;
+};
+
+// Nodes that have CPUs, sorted by node number. Falls back to a single node holding every online CPU if
+// sysfs has no node directory. Memory-only nodes, such as CXL memory, are left out: every policy places a table
+// next to the threads that use it, and a table interleaved onto far memory would slow down all of them.
+std::vector<NumaNode> read_numa_nodes();
+
+// How a layer table's pages are spread over the nodes.
+enum class NumaPolicy {
+    none,  // first touch
+    interleave,  // page by page round robin over all nodes
+    partition  // node i gets the i-th contiguous slice of the table, i.e. the i-th hash range
+};
+
+const char *to_string(NumaPolicy policy);
+
+// Apply policy to every piece of mapping with mbind. Pages that are already faulted in are migrated on a
+// best-effort basis. Returns false if the kernel refused (no NUMA support, or a single node).
+bool numa_place(const HugePageMapping& mapping, NumaPolicy policy, const std::vector<NumaNode>& nodes);
+
+// Node that OpenMP thread t of n should run on: threads are grouped by node in order, so that with
+// schedule(static) thread t's block of a table lines up with the t-th slice of a partitioned table.
+int numa_node_of_thread(int t, int n, const std::vector<NumaNode>& nodes);
+
+// Index into nodes of the node that has cpu, or 0 if none has it.
+int numa_node_of_cpu(int cpu, const std::vector<NumaNode>& nodes);
+
+// Pin each OpenMP thread to the CPUs of its node (numa_node_of_thread).
+void numa_pin_omp_threads(const std::vector<NumaNode>& nodes);
+
+// Bytes of [addr, addr + bytes) resident on each node, estimated by asking the kernel where a sample of the
+// pages live (move_pages). Indexed like nodes.
+std::vector<size_t> numa_resident_bytes(const void *addr, size_t bytes, const std::vector<NumaNode>& nodes);
+
+// Per-node statistics for one layer.
+struct NumaLayerStats {
+    int node;
+    size_t table_bytes;  // of the destination table resident on this node
+    size_t slots_scanned;  // by threads on this node
+    double scan_gb_per_second;  // source bytes scanned by threads on this node per second of the insert phases
+    // Fraction of random probes into the destination table from this node's threads that hit another node,
+    // assuming probes are spread evenly over the table
+    double remote_probe_fraction;
+};
+
+void print_numa_stats(std::ostream& out, const std::vector<NumaLayerStats>& stats);
+
+#endif //NUMA_H
@@ -3,6 +3,7 @@
 #include "MoveLUT.h"
 #include <iostream>
 #include <cstring>
+#include <memory>
 
 void split_nibble_shuffle(__m256i shuf, __m256i* hi, __m256i* lo) {
 	const __m256i lo_nibble_msk = _mm256_set1_epi8(0xf);
@@ -105,10 +106,8 @@ std::string Position::to_string() const {
 }
 
 __attribute__((always_inline))
-void canonicalize_positions(uint64_t positions[8]) {
+__m512i canonicalize_positions(__m512i p) {
 	// Compute the lexicographic minimum of every rotation/reflection
-	__m512i p = _mm512_loadu_si512(&positions[0]);
-
 	__m512i a1 = _mm512_min_epu64(
 		p,
 		shuffle_nibbles_same(p, constants::rotate_90)
@@ -129,8 +128,11 @@ void canonicalize_positions(uint64_t positions[8]) {
 	__m512i b1 = _mm512_min_epu64(a1, a2);
 	__m512i b2 = _mm512_min_epu64(a3, a4);
 
-	__m512i c = _mm512_min_epu64(b1, b2);
-	_mm512_storeu_si512(&positions[0], c);
+	return _mm512_min_epu64(b1, b2);
+}
+
+void canonicalize_positions(uint64_t positions[8]) {
+	_mm512_storeu_si512(&positions[0], canonicalize_positions(_mm512_loadu_si512(&positions[0])));
 }
 
 uint64_t canonicalize_position(uint64_t position) {
@@ -270,4 +272,129 @@ void list_successors(std::vector<uint64_t> &vec, uint64_t tiles, int tile) {
 
 Position Position::canonical_form() const {
 	return Position { canonicalize_position(bits) };
-}
\ No newline at end of file
+}
+// Board halves of the largest tile sum with tiles at most 1024
+constexpr int SMALL_POSITION_MAX_HALF = 16 << (SMALL_POSITION_MAX_TILE - 1);
+
+// Tile values halved, by representation
+static uint32_t half_value(int repr) {
+	return repr ? 1 << (repr - 1) : 0;
+}
+
+// below[h][k][repr]: number of ways to fill a cell and the k cells after it, summing to 2h, with a tile smaller
+// than repr in that cell. below[h][k][SMALL_POSITION_MAX_TILE + 1] counts all of them. Only the rows for h up to
+// half a layer's tile sum are touched when ranking it, so those stay in cache.
+using SmallPositionCounts = uint64_t[16][SMALL_POSITION_MAX_TILE + 2];
+
+static const SmallPositionCounts *small_position_below() {
+	static const auto below = [] {
+		// ways[k][h]: number of ways to fill k cells summing to 2h
+		std::vector<std::vector<uint64_t>> ways(16, std::vector<uint64_t>(SMALL_POSITION_MAX_HALF + 1));
+		ways[0][0] = 1;
+		auto below = std::make_unique<SmallPositionCounts[]>(SMALL_POSITION_MAX_HALF + 1);
+		for (int k = 0; k < 16; ++k) {
+			for (int h = 0; h <= SMALL_POSITION_MAX_HALF; ++h) {
+				uint64_t sum = 0;
+				for (int repr = 0; repr <= SMALL_POSITION_MAX_TILE; ++repr) {
+					below[h][k][repr] = sum;
+					if (half_value(repr) <= h) {
+						sum += ways[k][h - half_value(repr)];
+					}
+				}
+				below[h][k][SMALL_POSITION_MAX_TILE + 1] = sum;
+				if (k + 1 < 16) {
+					ways[k + 1][h] = sum;
+				}
+			}
+		}
+		return below;
+	}();
+	return below.get();
+}
+
+uint64_t small_position_space(int tile_sum) {
+	if (tile_sum < 0 || tile_sum % 2 || tile_sum / 2 > SMALL_POSITION_MAX_HALF) {
+		return 0;
+	}
+	return small_position_below()[tile_sum / 2][15][SMALL_POSITION_MAX_TILE + 1];
+}
+
+// Lexicographic rank with cell 15 most significant, so ranks sort like the positions' bits. What is left of
+// the tile sum at each cell is a suffix sum of the tiles after it, so all 16 lookups can be gathered at once.
+uint64_t compress_small_position(uint64_t pos, int tile_sum) {
+	const uint64_t *below = (const uint64_t *)small_position_below();
+	constexpr int CELL_STRIDE = SMALL_POSITION_MAX_TILE + 2, HALF_STRIDE = 16 * CELL_STRIDE;
+
+	// Cell i in dword i
+	__m128i lo = _mm_cvtsi64_si128(pos & 0x0f0f0f0f0f0f0f0f), hi = _mm_cvtsi64_si128((pos >> 4) & 0x0f0f0f0f0f0f0f0f);
+	__m512i tiles = _mm512_cvtepu8_epi32(_mm_unpacklo_epi8(lo, hi));
+	__m512i halves = _mm512_maskz_sllv_epi32(_mm512_test_epi32_mask(tiles, tiles), _mm512_set1_epi32(1),
+		_mm512_sub_epi32(tiles, _mm512_set1_epi32(1)));
+	// Sum of the cells from i up, in dword i
+	__m512i suffix = halves;
+	suffix = _mm512_add_epi32(suffix, _mm512_alignr_epi32(_mm512_setzero_si512(), suffix, 1));
+	suffix = _mm512_add_epi32(suffix, _mm512_alignr_epi32(_mm512_setzero_si512(), suffix, 2));
+	suffix = _mm512_add_epi32(suffix, _mm512_alignr_epi32(_mm512_setzero_si512(), suffix, 4));
+	suffix = _mm512_add_epi32(suffix, _mm512_alignr_epi32(_mm512_setzero_si512(), suffix, 8));
+	assert(_mm_cvtsi128_si32(_mm512_castsi512_si128(suffix)) == tile_sum / 2);
+	__m512i h = _mm512_add_epi32(_mm512_sub_epi32(_mm512_set1_epi32(tile_sum / 2), suffix), halves);
+
+	__m512i index = _mm512_add_epi32(_mm512_mullo_epi32(h, _mm512_set1_epi32(HALF_STRIDE)),
+		_mm512_add_epi32(_mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+			_mm512_set1_epi32(CELL_STRIDE)), tiles));
+	__m512i counts = _mm512_add_epi64(_mm512_i32gather_epi64(_mm512_castsi512_si256(index), below, 8),
+		_mm512_i32gather_epi64(_mm512_extracti64x4_epi64(index, 1), below, 8));
+	return _mm512_reduce_add_epi64(counts);
+}
+
+uint64_t decompress_small_position(uint64_t rank, int tile_sum) {
+	auto below = small_position_below();
+	uint64_t pos = 0;
+	int h = tile_sum / 2;
+	for (int cell = 15; cell >= 0; --cell) {
+		// The largest tile with at most rank boards below it; counts stop growing past the tiles that fit
+		const uint64_t *counts = below[h][cell];
+		int repr = 0;
+		while (repr < SMALL_POSITION_MAX_TILE && counts[repr + 1] <= rank) {
+			++repr;
+		}
+		rank -= counts[repr];
+		pos |= (uint64_t)repr << (4 * cell);
+		h -= half_value(repr);
+	}
+	return pos;
+}
+
+// Neighbouring ranks mostly agree on their upper cells, so each rank only redoes the cells below the smallest
+// subtree of the previous one that still contains it
+void decompress_small_positions(uint64_t *ranks, size_t n, int tile_sum) {
+	auto below = small_position_below();
+	// Before deciding cell c: what is left of the tile sum, and the first rank of the boards that agree with pos
+	// on the cells above c
+	int h[16];
+	uint64_t base[16];
+	h[15] = tile_sum / 2;
+	base[15] = 0;
+	uint64_t pos = 0;
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t rank = ranks[i];
+		int redo = i == 0 ? 15 : 0;
+		while (rank - base[redo] >= below[h[redo]][redo][SMALL_POSITION_MAX_TILE + 1]) {
+			++redo;
+		}
+		for (int cell = redo; cell >= 0; --cell) {
+			const uint64_t *counts = below[h[cell]][cell];
+			uint64_t r = rank - base[cell];
+			int repr = 0;
+			while (repr < SMALL_POSITION_MAX_TILE && counts[repr + 1] <= r) {
+				++repr;
+			}
+			pos = (pos & ~(0xfULL << (4 * cell))) | (uint64_t)repr << (4 * cell);
+			if (cell > 0) {
+				h[cell - 1] = h[cell] - half_value(repr);
+				base[cell - 1] = base[cell] + counts[repr];
+			}
+		}
+		ranks[i] = pos;
+	}
+}
@@ -88,6 +88,8 @@ struct Position {
 using Packed6Perm = uint64_t;
 
 void canonicalize_positions(uint64_t positions[8]);
+// The same on eight positions in a register
+__m512i canonicalize_positions(__m512i positions);
 uint64_t set_tile(uint64_t tiles, uint8_t tile, int idx);
 uint8_t get_tile(uint64_t tiles, int idx);
 uint32_t repr_to_tile(uint8_t repr);
@@ -98,8 +100,17 @@ void get_rotations(uint64_t tiles, uint64_t arr[4]);
 int count_symmetries(uint64_t position);
 // Get the (representation of) the maximum tile in the position.
 uint8_t max_tile(uint64_t tile);
-// Compress position containing at most the tile 1024 (2^11) using the encoding t1*
+// Largest tile representation (1024) that compress_small_position handles
+constexpr int SMALL_POSITION_MAX_TILE = 10;
+// Number of boards with tiles at most 1024 and the given tile sum: the range of compress_small_position
+uint64_t small_position_space(int tile_sum);
+// Rank of a position with tiles at most 1024 among all such boards with its tile sum, canonical or not. Ranks
+// are dense and in the same order as the positions themselves.
 uint64_t compress_small_position(uint64_t pos, int tile_sum);
+// Inverse of compress_small_position
+uint64_t decompress_small_position(uint64_t rank, int tile_sum);
+// Inverse of compress_small_position over n sorted ranks, in place
+void decompress_small_positions(uint64_t *ranks, size_t n, int tile_sum);
 
 void list_successors(std::vector<uint64_t>& vec, uint64_t tiles, int tile);
 
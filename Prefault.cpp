@@ -0,0 +1,90 @@
+#include "Prefault.h"
+
+#include <algorithm>
+#include <chrono>
+#include <omp.h>
+#include <sys/mman.h>
+
+#include "Numa.h"
+#include "Topology.h"
+#include "Trace.h"
+
+constexpr size_t PAGE_4K = 4096;
+
+void populate_range(char *data, size_t bytes) {
+    // madvise wants a page-aligned start
+    char *start = (char*)((uintptr_t)data & ~(PAGE_4K - 1));
+    size_t len = bytes + (data - start);
+    if (madvise(start, len, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+    for (size_t i = 0; i < len; i += PAGE_4K) {
+        __atomic_fetch_or((uint64_t*)(start + i), 0, __ATOMIC_RELAXED);
+    }
+}
+
+void populate_parallel(char *data, size_t bytes) {
+    constexpr size_t CHUNK = 8 << 20;
+#pragma omp parallel for schedule(static)
+    for (size_t offset = 0; offset < bytes; offset += CHUNK) {
+        populate_range(data + offset, std::min(CHUNK, bytes - offset));
+    }
+}
+
+Prefaulter::Prefaulter(char *data, size_t bytes, Config config) : data(data), bytes(bytes), config(config) {
+    this->config.threads = std::max(config.threads, 1);
+
+    auto nodes = read_numa_nodes();
+
+    running = this->config.threads;
+    for (int t = 0; t < this->config.threads; ++t) {
+        auto cpus = nodes.size() > 1 ? nodes[t % nodes.size()].cpus : std::vector<int> {};
+        workers.emplace_back([this, t, cpus] { work(t, cpus); });
+    }
+}
+
+Prefaulter::~Prefaulter() {
+    stop();
+}
+
+void Prefaulter::work(int index, std::vector<int> cpus) {
+    if (!cpus.empty()) {
+        pin_current_thread(cpus);
+    }
+    TraceScope scope("prefault", index);
+    double rate = config.bytes_per_second / config.threads;
+    auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+
+    size_t stride = config.chunk_bytes * config.threads;
+    for (size_t offset = index * config.chunk_bytes; offset < bytes && !stopping; offset += stride) {
+        size_t len = std::min(config.chunk_bytes, bytes - offset);
+        populate_range(data + offset, len);
+        done += len;
+        faulted.fetch_add(len, std::memory_order_relaxed);
+
+        if (rate > 0) {
+            // Sleep off any time we are ahead of the cap
+            auto due = start + std::chrono::duration<double>(done / rate);
+            std::this_thread::sleep_until(std::chrono::time_point_cast<std::chrono::steady_clock::duration>(due));
+        }
+    }
+    running--;
+}
+
+void Prefaulter::stop() {
+    stopping = true;
+    wait();
+}
+
+void Prefaulter::wait() {
+    for (auto& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+bool Prefaulter::done() const {
+    return running == 0;
+}
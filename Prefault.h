@@ -0,0 +1,61 @@
+//
+// Created by root on 6/25/25.
+//
+
+#ifndef PREFAULT_H
+#define PREFAULT_H
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Fault in every page of [data, data + bytes) for writing without changing its contents, so it is safe
+// to run while other threads are inserting. Uses MADV_POPULATE_WRITE, falling back to an atomic or of
+// zero into each page on kernels without it.
+void populate_range(char *data, size_t bytes);
+
+// populate_range on all OpenMP threads.
+void populate_parallel(char *data, size_t bytes);
+
+// Faults in a freshly allocated table on a few background threads while the main workers are busy with
+// something else, so the first inserts don't pay for page faults and kernel zeroing. Thread t is allowed
+// to run on the CPUs of NUMA node t % nodes and populates every threads-th chunk, so without a memory
+// policy the pages end up spread over all nodes by first touch. The total rate is capped to leave memory bandwidth for the
+// workers.
+struct Prefaulter {
+    struct Config {
+        int threads = 2;
+        double bytes_per_second = 2e9;  // 0 for no cap
+        size_t chunk_bytes = 64 << 20;
+    };
+
+    Prefaulter(char *data, size_t bytes, Config config);
+    ~Prefaulter();
+
+    Prefaulter(const Prefaulter&) = delete;
+    Prefaulter& operator=(const Prefaulter&) = delete;
+
+    // Stop after the current chunks and join the threads
+    void stop();
+    // Wait until everything has been faulted in
+    void wait();
+    bool done() const;
+
+    size_t faulted_bytes() const {
+        return faulted.load(std::memory_order_relaxed);
+    }
+
+private:
+    char *data;
+    size_t bytes;
+    Config config;
+    std::atomic<bool> stopping = false;
+    std::atomic<size_t> faulted = 0;
+    std::atomic<int> running = 0;
+    std::vector<std::thread> workers;
+
+    void work(int index, std::vector<int> cpus);
+};
+
+#endif //PREFAULT_H
@@ -0,0 +1,101 @@
+#include "Progress.h"
+
+#include <chrono>
+#include <iostream>
+#include <sched.h>
+#include <vector>
+
+ProgressCounters progress_counters[MAX_PROGRESS_THREADS];
+
+static std::mutex progress_mutex;
+static int progress_registered = 0;
+static std::vector<int> progress_free;
+
+// Gives the thread's counters back when it exits
+struct ProgressRegistration {
+    int index = -1;
+
+    ~ProgressRegistration() {
+        if (index >= 0) {
+            std::lock_guard lg(progress_mutex);
+            progress_free.push_back(index);
+        }
+    }
+};
+
+static thread_local ProgressRegistration registration;
+
+int register_progress_thread() {
+    std::lock_guard lg(progress_mutex);
+    int index;
+    if (!progress_free.empty()) {
+        index = progress_free.back();
+        progress_free.pop_back();
+    } else {
+        index = progress_registered++ % MAX_PROGRESS_THREADS;
+    }
+    progress_counters[index].cpu = sched_getcpu();
+    registration.index = index;
+    return index;
+}
+
+static void sum_counters(uint64_t& scanned, uint64_t& inserted) {
+    scanned = inserted = 0;
+    for (auto& c : progress_counters) {
+        scanned += c.slots_scanned.load(std::memory_order_relaxed);
+        inserted += c.positions_inserted.load(std::memory_order_relaxed);
+    }
+}
+
+ProgressReporter::ProgressReporter(Config config) : config(std::move(config)) {
+    thread = std::thread([this] { run(); });
+}
+
+ProgressReporter::~ProgressReporter() {
+    {
+        std::lock_guard lg(mtx);
+        done = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void ProgressReporter::run() {
+    // Counters are never reset; measure relative to their values at construction
+    uint64_t base_scanned, base_inserted;
+    sum_counters(base_scanned, base_inserted);
+
+    auto start = std::chrono::steady_clock::now();
+    auto last_time = start;
+    uint64_t last_inserted = 0;
+
+    std::unique_lock lock(mtx);
+    while (!cv.wait_for(lock, std::chrono::duration<double>(config.interval_seconds), [&] { return done; })) {
+        uint64_t scanned, inserted;
+        sum_counters(scanned, inserted);
+        scanned -= base_scanned;
+        inserted -= base_inserted;
+
+        auto now = std::chrono::steady_clock::now();
+        ProgressSample sample {};
+        sample.elapsed_seconds = std::chrono::duration<double>(now - start).count();
+        sample.fraction_done = config.total_slots ? std::min(1.0, scanned / (double)config.total_slots) : 0;
+        sample.positions_inserted = inserted;
+        sample.positions_per_second = (inserted - last_inserted) / std::chrono::duration<double>(now - last_time).count();
+        if (sample.fraction_done > 0) {
+            double projected_positions = inserted / sample.fraction_done;
+            sample.projected_load = projected_positions / config.positions_per_slot / std::max<uint64_t>(config.destination_capacity, 1);
+            sample.eta_seconds = sample.elapsed_seconds * (1 - sample.fraction_done) / sample.fraction_done;
+        }
+        last_time = now;
+        last_inserted = inserted;
+
+        if (config.callback) {
+            config.callback(sample);
+        } else {
+            std::cerr << config.label << ": " << sample.fraction_done * 100 << "% done, "
+                << sample.positions_per_second / 1e6 << "M positions/sec, projected load "
+                << sample.projected_load << ", ETA " << sample.eta_seconds << " s" << std::endl;
+        }
+    }
+}
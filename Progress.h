@@ -0,0 +1,79 @@
+//
+// Created by root on 6/24/25.
+//
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Progress counters for long layers. Each thread that reports progress registers one cache line of counters on
+// first use, and bumps them with relaxed load + store (no locked instructions); a ProgressReporter thread
+// samples the sums. OpenMP thread numbers aren't used as the index since they repeat across nested regions and
+// threads outside OpenMP.
+
+constexpr int MAX_PROGRESS_THREADS = 1024;
+
+struct alignas(64) ProgressCounters {
+    std::atomic<uint64_t> slots_scanned;  // source slots visited by for_each_position_parallel
+    std::atomic<uint64_t> positions_inserted;  // successors that were new to the destination table
+    int cpu;  // that the owning thread was running on when it registered
+};
+
+extern ProgressCounters progress_counters[MAX_PROGRESS_THREADS];
+
+// Only the owning thread writes a counter, so a plain add is enough
+inline void progress_add(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Index of a free set of counters for the calling thread. Counters of threads that have exited are handed out
+// again, keeping their values; past MAX_PROGRESS_THREADS live threads, counters are shared and may lose counts.
+int register_progress_thread();
+
+inline ProgressCounters& thread_progress() {
+    thread_local int index = register_progress_thread();
+    return progress_counters[index];
+}
+
+struct ProgressSample {
+    double elapsed_seconds;
+    double fraction_done;  // slots scanned / total slots
+    double positions_per_second;  // new positions inserted, over the last interval
+    uint64_t positions_inserted;
+    double projected_load;  // projected final occupancy of the destination table
+    double eta_seconds;
+};
+
+struct ProgressReporter {
+    struct Config {
+        std::string label;
+        uint64_t total_slots;  // slots that will be scanned in the source tables
+        uint64_t destination_capacity;  // slots in the table being filled
+        double positions_per_slot;  // expected positions per occupied destination slot
+        double interval_seconds = 5.0;
+        // Called with every sample; by default the sample is printed to stderr
+        std::function<void(const ProgressSample&)> callback;
+    };
+
+    Config config;
+
+    explicit ProgressReporter(Config config);
+    ~ProgressReporter();
+
+private:
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+
+    void run();
+};
+
+#endif //PROGRESS_H
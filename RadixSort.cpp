@@ -0,0 +1,257 @@
+#include "RadixSort.h"
+
+#include <algorithm>
+#include <array>
+#include <immintrin.h>
+#include <omp.h>
+#include <vector>
+
+#include "Trace.h"
+
+constexpr int RADIX_BITS = 8;
+constexpr size_t RADIX = 1 << RADIX_BITS;
+// Below this, std::sort
+constexpr size_t SMALL_SORT = 256;
+// Below this, a single thread sorts the range
+constexpr size_t PARALLEL_SORT = 1 << 20;
+// Words ahead of a bucket's write head to prefetch
+constexpr size_t PREFETCH_DISTANCE = 16;
+
+using Counts = std::array<size_t, RADIX>;
+
+static inline size_t digit(uint64_t word, uint64_t key_mask, int shift) {
+    return ((word & key_mask) >> shift) & (RADIX - 1);
+}
+
+// Shift of the next digit. The last digit may overlap bits of the previous one, which are equal within a
+// bucket anyway.
+static inline int next_shift(int shift) {
+    return std::max(0, shift - RADIX_BITS);
+}
+
+// American flag sort
+static void radix_sort_serial(uint64_t *data, size_t n, uint64_t key_mask, int shift) {
+    if (n <= SMALL_SORT) {
+        std::sort(data, data + n, [key_mask] (uint64_t a, uint64_t b) {
+            return (a & key_mask) < (b & key_mask);
+        });
+        return;
+    }
+
+    Counts count {};
+    for (size_t i = 0; i < n; ++i) {
+        count[digit(data[i], key_mask, shift)]++;
+    }
+    Counts head, tail;
+    size_t sum = 0;
+    for (size_t b = 0; b < RADIX; ++b) {
+        head[b] = sum;
+        sum += count[b];
+        tail[b] = sum;
+    }
+
+    // Follow each cycle of misplaced words until it comes back to the bucket it started in
+    for (size_t b = 0; b < RADIX; ++b) {
+        while (head[b] < tail[b]) {
+            uint64_t v = data[head[b]];
+            size_t k = digit(v, key_mask, shift);
+            while (k != b) {
+                // Each bucket's head moves forward one word at a time, but there are too many of them for the
+                // hardware prefetcher to follow, and each swap depends on the previous one
+                _mm_prefetch((const char*)&data[head[k] + PREFETCH_DISTANCE], _MM_HINT_T0);
+                std::swap(v, data[head[k]++]);
+                k = digit(v, key_mask, shift);
+            }
+            data[head[b]++] = v;
+        }
+    }
+
+    if (shift == 0) {
+        return;
+    }
+    size_t start = 0;
+    for (size_t b = 0; b < RADIX; ++b) {
+        radix_sort_serial(data + start, count[b], key_mask, next_shift(shift));
+        start += count[b];
+    }
+}
+
+// Distribute data[0, n) into buckets by the digit at shift using `stripes` stripes per bucket in parallel.
+// Returns the bucket sizes.
+static Counts partition_parallel(uint64_t *data, size_t n, uint64_t key_mask, int shift, int stripes) {
+    std::vector<Counts> local(stripes);
+#pragma omp parallel for num_threads(stripes) schedule(static)
+    for (int t = 0; t < stripes; ++t) {
+        Counts c {};
+        for (size_t i = n * t / stripes; i < n * (t + 1) / stripes; ++i) {
+            c[digit(data[i], key_mask, shift)]++;
+        }
+        local[t] = c;
+    }
+    Counts count {}, gh, gt;
+    for (auto& c : local) {
+        for (size_t b = 0; b < RADIX; ++b) {
+            count[b] += c[b];
+        }
+    }
+    size_t sum = 0;
+    for (size_t b = 0; b < RADIX; ++b) {
+        gh[b] = sum;
+        sum += count[b];
+        gt[b] = sum;
+    }
+
+    // Each round, the unsettled part [gh[b], gt[b]) of every bucket is split into one stripe per thread.
+    // Threads permute within their own stripes, leaving words they couldn't place at the end of each stripe
+    // ([ph, pt)); the repair pass then moves those to the end of the bucket, where the next round picks
+    // them up.
+    std::vector<Counts> ph(stripes), pt(stripes);
+    size_t remaining = n;
+    while (remaining) {
+        for (int t = 0; t < stripes; ++t) {
+            for (size_t b = 0; b < RADIX; ++b) {
+                ph[t][b] = gh[b] + (gt[b] - gh[b]) * t / stripes;
+                pt[t][b] = gh[b] + (gt[b] - gh[b]) * (t + 1) / stripes;
+            }
+        }
+
+#pragma omp parallel for num_threads(stripes) schedule(static)
+        for (int t = 0; t < stripes; ++t) {
+            auto& h = ph[t];
+            auto& e = pt[t];
+            for (size_t b = 0; b < RADIX; ++b) {
+                size_t head = h[b];
+                while (head < e[b]) {
+                    uint64_t v = data[head];
+                    size_t k = digit(v, key_mask, shift);
+                    while (k != b && h[k] < e[k]) {
+                        _mm_prefetch((const char*)&data[h[k] + PREFETCH_DISTANCE], _MM_HINT_T0);
+                        std::swap(v, data[h[k]++]);
+                        k = digit(v, key_mask, shift);
+                    }
+                    if (k == b) {
+                        data[head++] = data[h[b]];
+                        data[h[b]++] = v;
+                    } else {
+                        data[head++] = v;
+                    }
+                }
+            }
+        }
+
+        // Within bucket b, each stripe is now settled in [start, ph) and misplaced in [ph, pt)
+#pragma omp parallel for num_threads(stripes) schedule(dynamic)
+        for (size_t b = 0; b < RADIX; ++b) {
+            size_t left = gh[b], right = gt[b];
+            int t = 0;
+            while (true) {
+                // Move left to the next misplaced word, skipping settled prefixes
+                for (; t < stripes; ++t) {
+                    left = std::max(left, ph[t][b]);
+                    if (left < pt[t][b]) {
+                        break;
+                    }
+                }
+                if (t == stripes) {
+                    left = gt[b];
+                }
+                while (right > left && digit(data[right - 1], key_mask, shift) != b) {
+                    --right;
+                }
+                if (right <= left) {
+                    break;
+                }
+                std::swap(data[left++], data[--right]);
+            }
+            gh[b] = right;
+        }
+
+        size_t now_remaining = 0;
+        for (size_t b = 0; b < RADIX; ++b) {
+            now_remaining += gt[b] - gh[b];
+        }
+        // A single stripe always finishes, so fall back to that if the rounds stop making progress
+        if (now_remaining >= remaining || now_remaining < PARALLEL_SORT / 16) {
+            stripes = 1;
+        }
+        remaining = now_remaining;
+    }
+    return count;
+}
+
+static void radix_sort_parallel(uint64_t *data, size_t n, uint64_t key_mask, int shift, int threads) {
+    if (threads <= 1 || n < PARALLEL_SORT) {
+        radix_sort_serial(data, n, key_mask, shift);
+        return;
+    }
+    TraceScope scope("radix partition", shift);
+    Counts count = partition_parallel(data, n, key_mask, shift, threads);
+    if (shift == 0) {
+        return;
+    }
+
+    Counts start;
+    size_t sum = 0;
+    for (size_t b = 0; b < RADIX; ++b) {
+        start[b] = sum;
+        sum += count[b];
+    }
+    // Buckets too big for one thread to finish in its share of the time get all the threads; the rest are
+    // sorted one per thread
+    size_t big = n / threads;
+    for (size_t b = 0; b < RADIX; ++b) {
+        if (count[b] > big) {
+            radix_sort_parallel(data + start[b], count[b], key_mask, next_shift(shift), threads);
+        }
+    }
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t b = 0; b < RADIX; ++b) {
+        if (count[b] <= big) {
+            radix_sort_serial(data + start[b], count[b], key_mask, next_shift(shift));
+        }
+    }
+}
+
+void radix_sort(uint64_t *data, size_t n, uint64_t key_mask) {
+    // Start at the highest key bit actually in use
+    uint64_t any = 0;
+#pragma omp parallel for reduction(|:any)
+    for (size_t i = 0; i < n; ++i) {
+        any |= data[i] & key_mask;
+    }
+    if (!any) {
+        return;
+    }
+    int top = 63 - __builtin_clzll(any);
+    radix_sort_parallel(data, n, key_mask, std::max(0, top + 1 - RADIX_BITS), omp_get_max_threads());
+}
+
+static void insertion_sort(uint64_t *data, size_t n, uint64_t key_mask) {
+    for (size_t i = 1; i < n; ++i) {
+        uint64_t v = data[i];
+        size_t j = i;
+        for (; j > 0 && (data[j - 1] & key_mask) > (v & key_mask); --j) {
+            data[j] = data[j - 1];
+        }
+        data[j] = v;
+    }
+}
+
+bool sort_nearly_sorted(uint64_t *data, size_t n, uint64_t key_mask, size_t window) {
+    TraceScope scope("sort nearly sorted");
+    size_t blocks = (n + window - 1) / window;
+    // Insertion sort costs one step per inversion, which is little when everything is close to its place
+    for (size_t offset : { 0UL, window / 2 }) {
+#pragma omp parallel for schedule(static)
+        for (size_t b = 0; b < blocks; ++b) {
+            size_t begin = std::min(n, offset + b * window), end = std::min(n, begin + window);
+            insertion_sort(data + begin, end - begin, key_mask);
+        }
+    }
+    bool sorted = true;
+#pragma omp parallel for reduction(&&:sorted)
+    for (size_t i = 1; i < n; ++i) {
+        sorted = sorted && (data[i - 1] & key_mask) <= (data[i] & key_mask);
+    }
+    return sorted;
+}
@@ -0,0 +1,22 @@
+//
+// Created by root on 6/27/25.
+//
+
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Sort data[0, n) in place by (word & key_mask), using a parallel MSD radix sort on 8-bit digits (PARADIS:
+// speculative parallel permutation, then a repair pass, repeated until every bucket is settled) and serial
+// American flag sort below the top levels. Extra memory is O(threads * 256) counters. Bits outside key_mask
+// ride along. If the keys are unique the result is the same for any number of threads.
+void radix_sort(uint64_t *data, size_t n, uint64_t key_mask);
+
+// Finish sorting data[0, n) by (word & key_mask), assuming no word is more than window / 2 places from where
+// it belongs: sort blocks of window words in parallel, then the blocks straddling their boundaries. Returns
+// false, leaving the data partly sorted, if the assumption turned out to be wrong.
+bool sort_nearly_sorted(uint64_t *data, size_t n, uint64_t key_mask, size_t window = 1 << 12);
+
+#endif //RADIXSORT_H
@@ -0,0 +1,60 @@
+#include "RankBitmap.h"
+
+#include <algorithm>
+#include <omp.h>
+
+#include "Trace.h"
+
+RankBitmap::RankBitmap(int tile_sum, TableArena *arena) : tile_sum(tile_sum), space(small_position_space(tile_sum)),
+    arena(arena) {
+    size_t bytes = std::max(bytes_for(tile_sum), 4096UL);
+    mapping = arena ? arena->acquire(bytes) : HugePageMapping(bytes);
+    words = (uint64_t *)mapping.data;
+}
+
+RankBitmap::~RankBitmap() {
+    if (arena) {
+        arena->release(std::move(mapping));
+    }
+}
+
+size_t RankBitmap::parallel_count() const {
+    size_t n = (space + 63) / 64, count = 0;
+#pragma omp parallel for reduction(+:count)
+    for (size_t i = 0; i < n; ++i) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+std::vector<uint64_t> RankBitmap::positions() const {
+    TraceScope scope("bitmap positions");
+    size_t n = (space + 63) / 64;
+    int chunks = omp_get_max_threads() * 4;
+    size_t chunk_words = (n + chunks - 1) / chunks;
+    std::vector<size_t> offsets(chunks + 1);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < chunks; ++c) {
+        size_t count = 0;
+        for (size_t i = c * chunk_words; i < std::min(n, (c + 1) * chunk_words); ++i) {
+            count += __builtin_popcountll(words[i]);
+        }
+        offsets[c + 1] = count;
+    }
+    for (int c = 0; c < chunks; ++c) {
+        offsets[c + 1] += offsets[c];
+    }
+
+    std::vector<uint64_t> out(offsets[chunks]);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < chunks; ++c) {
+        uint64_t *dst = out.data() + offsets[c];
+        for (size_t i = c * chunk_words; i < std::min(n, (c + 1) * chunk_words); ++i) {
+            for (uint64_t w = words[i]; w; w &= w - 1) {
+                *dst++ = i * 64 + __builtin_ctzll(w);
+            }
+        }
+        decompress_small_positions(out.data() + offsets[c], offsets[c + 1] - offsets[c], tile_sum);
+    }
+    return out;
+}
@@ -0,0 +1,63 @@
+//
+// Created by root on 7/4/25.
+//
+
+#ifndef RANKBITMAP_H
+#define RANKBITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "MemoryBudget.h"
+#include "Position.h"
+#include "TableArena.h"
+
+// A layer of small positions as a bitmap over compress_small_position ranks: inserting is one atomic OR, with
+// no hashing or probing. Only worth it while the ranked space is not much bigger than a table would be, i.e.
+// for early and mid layers.
+struct RankBitmap {
+    int tile_sum;
+    size_t space;  // ranks, i.e. bits
+    uint64_t *words;
+
+    // Whether every position with this tile sum can be ranked
+    static bool fits(int tile_sum) {
+        return tile_sum < (2 << SMALL_POSITION_MAX_TILE) && small_position_space(tile_sum);
+    }
+    static size_t bytes_for(int tile_sum) {
+        return (small_position_space(tile_sum) + 63) / 64 * sizeof(uint64_t);
+    }
+
+    // Zeroed, from the arena if given
+    explicit RankBitmap(int tile_sum, TableArena *arena = nullptr);
+    ~RankBitmap();
+    RankBitmap(const RankBitmap&) = delete;
+    RankBitmap& operator=(const RankBitmap&) = delete;
+
+    // Returns whether the position was new
+    bool insert(Position position) {
+        uint64_t rank = compress_small_position(position.bits, tile_sum);
+        uint64_t bit = 1ULL << (rank % 64);
+        return !(__atomic_fetch_or(&words[rank / 64], bit, __ATOMIC_RELAXED) & bit);
+    }
+
+    bool contains(Position position) const {
+        uint64_t rank = compress_small_position(position.bits, tile_sum);
+        return words[rank / 64] >> (rank % 64) & 1;
+    }
+
+    size_t parallel_count() const;
+    // All positions, sorted
+    std::vector<uint64_t> positions() const;
+
+    size_t bytes() const {
+        return mapping.bytes;
+    }
+
+private:
+    TableArena *arena;
+    HugePageMapping mapping;
+};
+
+#endif //RANKBITMAP_H
@@ -0,0 +1,251 @@
+// End-to-end enumeration regression check. Runs the layer loop up to a tile sum, compares each layer's
+// position count against the reference table below and each layer's generation rate against a baseline
+// JSON written by a previous run.
+//
+// Usage: regress [--max-tile-sum N] [--baseline old.json] [--out new.json] [--threshold 0.1] [--min-seconds 0.05]
+//                [--trace trace.json] [--numa none|interleave|partition] [--succinct-sources]
+//                [--rank-bitmaps] [--packed-tables] [--quotient-tables] [--grouped-tables]
+//                [--bucketed-tables]
+//
+// Exit status: 0 if everything matches, 1 on a count mismatch, 2 if some layer slowed down beyond the threshold.
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Enumeration.h"
+
+// Number of positions per tile sum, from a known-good run.
+static const std::map<uint32_t, size_t> reference_counts = {
+    { 4, 21 },
+    { 6, 35 },
+    { 8, 41 },
+    { 10, 54 },
+    { 12, 115 },
+    { 14, 217 },
+    { 16, 406 },
+    { 18, 723 },
+    { 20, 1271 },
+    { 22, 2147 },
+    { 24, 3557 },
+    { 26, 5751 },
+    { 28, 9089 },
+    { 30, 14020 },
+    { 32, 21406 },
+    { 34, 31975 },
+    { 36, 47055 },
+    { 38, 68185 },
+    { 40, 97353 },
+    { 42, 136953 },
+    { 44, 190398 },
+    { 46, 260624 },
+    { 48, 353690 },
+    { 50, 473686 },
+    { 52, 626890 },
+    { 54, 821695 },
+    { 56, 1067228 },
+    { 58, 1368092 },
+    { 60, 1741312 },
+    { 62, 2196806 },
+    { 64, 2743874 },
+    { 66, 3399824 },
+    { 68, 4185279 },
+    { 70, 5105002 },
+    { 72, 6185049 },
+    { 74, 7443716 }
+};
+
+struct RegressionOptions {
+    uint32_t max_tile_sum = 64;
+    std::string baseline;
+    std::string out;
+    double threshold = 0.1;  // flag layers more than 10% slower than the baseline
+    double min_seconds = 0.05;  // layers faster than this are too noisy to compare
+    std::string trace;  // Chrome trace output, if set
+    NumaPolicy numa_policy = NumaPolicy::interleave;
+    bool succinct_sources = false;
+    bool rank_bitmaps = false;
+    bool packed_tables = false;
+    bool quotient_tables = false;
+    bool grouped_tables = false;
+    bool bucketed_tables = false;
+};
+
+// Pull a numeric field out of a flat JSON object. Only handles the format written by write_json below.
+static bool json_number(const std::string& object, const std::string& key, double& value) {
+    auto at = object.find("\"" + key + "\"");
+    if (at == std::string::npos) {
+        return false;
+    }
+    at = object.find(':', at);
+    if (at == std::string::npos) {
+        return false;
+    }
+    value = std::strtod(object.c_str() + at + 1, nullptr);
+    return true;
+}
+
+// tile sum -> positions/sec
+static std::map<uint32_t, double> read_baseline(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open baseline " + filename);
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string text = ss.str();
+
+    std::map<uint32_t, double> rates;
+    size_t at = text.find("\"layers\"");
+    while (at != std::string::npos && (at = text.find('{', at)) != std::string::npos) {
+        size_t end = text.find('}', at);
+        std::string object = text.substr(at, end - at);
+        double tile_sum, rate;
+        if (json_number(object, "tile_sum", tile_sum) && json_number(object, "positions_per_second", rate)) {
+            rates[(uint32_t)tile_sum] = rate;
+        }
+        at = end;
+    }
+    return rates;
+}
+
+static void write_json(std::ostream& out, const std::vector<LayerStats>& layers) {
+    out << "{\n  \"max_threads\": " << omp_get_max_threads() << ",\n  \"layers\": [\n";
+    for (size_t i = 0; i < layers.size(); ++i) {
+        auto& l = layers[i];
+        out << "    { \"tile_sum\": " << l.tile_sum << ", \"positions\": " << l.positions
+            << ", \"slots\": " << l.slots << ", \"seconds\": " << l.total_seconds
+            << ", \"insert_h1_seconds\": " << l.insert_h1_seconds << ", \"insert_h2_seconds\": " << l.insert_h2_seconds
+            << ", \"gorge_seconds\": " << l.gorge_seconds << ", \"count_seconds\": " << l.count_seconds
+            << ", \"profile_seconds\": " << l.profile_seconds
+            << ", \"peak_rss\": " << l.peak_rss << ", \"h3_mapped_bytes\": " << l.h3_backing.mapped_bytes
+            << ", \"h3_huge_fraction\": " << l.h3_backing.huge_fraction()
+            << ", \"arena_reused_bytes\": " << l.arena_reused_bytes << ", \"prefaulted_bytes\": " << l.prefaulted_bytes
+            << ", \"source_bytes\": " << l.source_bytes << ", \"rank_bitmap\": " << l.rank_bitmap
+            << ", \"slot_bytes\": " << l.slot_bytes << ", \"perm_occupancy\": " << l.perm_occupancy
+            << ", \"grouped_slots\": " << l.grouped_slots
+            << ", \"positions_per_second\": " << (l.total_seconds > 0 ? l.positions_per_second() : 0) << " }"
+            << (i + 1 < layers.size() ? "," : "") << '\n';
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    RegressionOptions options;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = [&] {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << argv[i] << '\n';
+                exit(1);
+            }
+            return std::string(argv[++i]);
+        };
+        if (!strcmp(argv[i], "--max-tile-sum")) {
+            options.max_tile_sum = std::stoul(arg());
+        } else if (!strcmp(argv[i], "--baseline")) {
+            options.baseline = arg();
+        } else if (!strcmp(argv[i], "--out")) {
+            options.out = arg();
+        } else if (!strcmp(argv[i], "--threshold")) {
+            options.threshold = std::stod(arg());
+        } else if (!strcmp(argv[i], "--min-seconds")) {
+            options.min_seconds = std::stod(arg());
+        } else if (!strcmp(argv[i], "--trace")) {
+            options.trace = arg();
+        } else if (!strcmp(argv[i], "--numa")) {
+            std::string policy = arg();
+            if (policy == "none") {
+                options.numa_policy = NumaPolicy::none;
+            } else if (policy == "interleave") {
+                options.numa_policy = NumaPolicy::interleave;
+            } else if (policy == "partition") {
+                options.numa_policy = NumaPolicy::partition;
+            } else {
+                std::cerr << "Unknown NUMA policy " << policy << '\n';
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--succinct-sources")) {
+            options.succinct_sources = true;
+        } else if (!strcmp(argv[i], "--rank-bitmaps")) {
+            options.rank_bitmaps = true;
+        } else if (!strcmp(argv[i], "--packed-tables")) {
+            options.packed_tables = true;
+        } else if (!strcmp(argv[i], "--quotient-tables")) {
+            options.quotient_tables = true;
+        } else if (!strcmp(argv[i], "--grouped-tables")) {
+            options.grouped_tables = true;
+        } else if (!strcmp(argv[i], "--bucketed-tables")) {
+            options.bucketed_tables = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--max-tile-sum N] [--baseline old.json] [--out new.json]"
+                " [--threshold 0.1] [--min-seconds 0.05] [--trace trace.json]"
+                " [--numa none|interleave|partition] [--succinct-sources]"
+                " [--rank-bitmaps] [--packed-tables] [--quotient-tables] [--grouped-tables]"
+                " [--bucketed-tables]\n";
+            return 1;
+        }
+    }
+
+    std::map<uint32_t, double> baseline;
+    if (!options.baseline.empty()) {
+        baseline = read_baseline(options.baseline);
+    }
+
+    if (!options.trace.empty()) {
+        trace_enable();
+    }
+
+    std::vector<LayerStats> layers;
+    int count_mismatches = 0, slowdowns = 0;
+
+    Enumeration enumeration({ .max_tile_sum = options.max_tile_sum, .verbose = false,
+        .numa_policy = options.numa_policy, .succinct_sources = options.succinct_sources,
+        .rank_bitmaps = options.rank_bitmaps, .packed_tables = options.packed_tables,
+        .quotient_tables = options.quotient_tables, .grouped_tables = options.grouped_tables,
+        .bucketed_tables = options.bucketed_tables });
+    enumeration.run([&] (const LayerStats& stats, const AdvancedHashSet&) {
+        layers.push_back(stats);
+        std::cout << "Tile sum " << stats.tile_sum << ": " << stats.positions << " positions";
+        if (stats.total_seconds > 0) {
+            std::cout << ", " << stats.positions_per_second() / 1e6 << "M positions/sec";
+        }
+
+        auto ref = reference_counts.find(stats.tile_sum);
+        if (ref == reference_counts.end()) {
+            std::cout << " [no reference]";
+        } else if (ref->second != stats.positions) {
+            std::cout << " [COUNT MISMATCH: expected " << ref->second << "]";
+            count_mismatches++;
+        }
+
+        auto base = baseline.find(stats.tile_sum);
+        if (base != baseline.end() && stats.total_seconds >= options.min_seconds && base->second > 0) {
+            double ratio = stats.positions_per_second() / base->second;
+            std::cout << " [" << ratio << "x baseline]";
+            if (ratio < 1 - options.threshold) {
+                std::cout << " [SLOWDOWN]";
+                slowdowns++;
+            }
+        }
+        std::cout << std::endl;
+        if (stats.numa.size() > 1) {
+            print_numa_stats(std::cout, stats.numa);
+        }
+        return true;
+    });
+
+    if (!options.out.empty()) {
+        std::ofstream file(options.out);
+        write_json(file, layers);
+    }
+    if (!options.trace.empty()) {
+        trace_dump(options.trace);
+    }
+
+    std::cout << count_mismatches << " count mismatches, " << slowdowns << " slowdowns\n";
+    return count_mismatches ? 1 : slowdowns ? 2 : 0;
+}
@@ -11,6 +11,10 @@
 #include <sys/mman.h>
 #include <atomic>
 
+#include "BulkMemory.h"
+#include "MemoryBudget.h"
+#include "Prefault.h"
+
 inline uint64_t get_hash_index(uint64_t a) {
     uint8_t key_bytes[16] = {
         0x42, 0x7a, 0x13, 0x9d, 0xfe, 0x5c, 0x88, 0x21,
@@ -49,28 +53,15 @@ constexpr int MIN_CAP_LG2 = 12; /* 4096 */
 struct StupidHashMap {
     uint64_t *data;
     uint32_t cap_lg2;
+    HugePageMapping mapping;
 
     std::atomic<int> count;  // lazily updated by threads
 
-    StupidHashMap(uint64_t needed_capacity) : cap_lg2(std::max(64 - __builtin_clzll(needed_capacity - 1), MIN_CAP_LG2)) {
-        auto huge = 0; //cap_lg2 > 20 ? (MAP_HUGETLB | (30 << MAP_HUGE_SHIFT)) : 0;
-        try_again:
-        data = (uint64_t*)mmap(NULL, std::max(capacity() * sizeof(uint64_t), 4096UL), PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS | huge, -1, 0);
-        if (data == MAP_FAILED) {
-            std::cerr << "Failed to allocate " << capacity() << " words (huge TLB working?)\n";
-            if (huge) {
-                huge = 0;
-                goto try_again;
-            }
-            throw std::bad_alloc();
-        }
-        madvise(data, capacity(), MADV_WILLNEED);
-
-#pragma omp parallel for
-        for (size_t i = 0; i < capacity(); ++i) {
-            data[i] = 0;  // force the memory to be allocated
-        }
+    StupidHashMap(uint64_t needed_capacity) : cap_lg2(std::max(64 - __builtin_clzll(needed_capacity - 1), MIN_CAP_LG2)),
+        mapping(capacity() * sizeof(uint64_t), cap_lg2 > 20) {
+        data = (uint64_t*)mapping.data;
+        // Fresh mappings are already zero; just force the memory to be allocated
+        populate_parallel(mapping.data, capacity() * sizeof(uint64_t));
     }
 
     StupidHashMap(const std::vector<uint64_t>& v) : StupidHashMap(v.size()) {
@@ -80,18 +71,11 @@ struct StupidHashMap {
     }
 
     void parallel_clear() {
-#pragma omp parallel for
-        for (size_t i = 0; i < capacity(); i += 8) {
-            __m512i zero = _mm512_setzero_si512();
-            _mm512_storeu_si512(data + i, zero);
-        }
+        bulk_clear(data, capacity() * sizeof(uint64_t));
     }
 
     StupidHashMap& operator=(StupidHashMap&& rhs) noexcept {
-        if (data) {
-            munmap(data, capacity() * sizeof(uint64_t));
-        }
-
+        mapping = std::move(rhs.mapping);
         data = rhs.data;
         rhs.data = nullptr;
         cap_lg2 = rhs.cap_lg2;
@@ -158,81 +142,15 @@ struct StupidHashMap {
         return true;
     }
 
-    ~StupidHashMap() {
-        if (data) {
-            munmap(data, capacity() * sizeof(uint64_t));
-        }
-        data = nullptr;
-    }
-
     // Get the number of set elements
     size_t parallel_count() const {
         return count_nonzero(data, data + capacity());
     }
 
+    // Move all elements into six, leaving the map empty
     void parallel_copy_into(std::vector<uint64_t>& six) {
-        if (capacity() < 100000) {
-            six.resize(0);
-            serial_for_each([&] (uint64_t a) {
-                six.push_back(a);
-            });
-            return;
-        }
-        int num_threads = omp_get_max_threads();
-        size_t chunk_size = capacity() / num_threads;
-        chunk_size -= chunk_size % 8;  // for alignment purposes
-
-        std::vector<uint64_t> ranges;
-        for (size_t i = 0; i < num_threads; ++i) {
-            ranges.push_back(i * chunk_size);
-        }
-        ranges.push_back(capacity());
-        std::vector<uint64_t> count(num_threads);
-
-#pragma omp parallel
-        {
-            int tid = omp_get_thread_num();
-            count[tid] = count_nonzero(data + ranges[tid], data + ranges[tid + 1]);
-        }
-
-
-        // Now prefix sum so that each thread knows where to start writing
-        uint64_t S = 0;
-        for (int i = 0; i < count.size(); ++i) {
-            auto tmp = count[i];
-            count[i] = S;
-            S += tmp;
-        }
-
-        six.clear();
-        six.reserve(S);  // TODO skip zero-fill
-
-        auto p = six.data();
-
-#pragma omp parallel
-        {
-            int tid = omp_get_thread_num();
-            size_t write_i = count[tid];
-            size_t offs = ranges[tid];
-
-            for (; offs + 8 <= ranges[tid + 1]; offs += 8) {
-                __m512i d = _mm512_loadu_si512(&data[offs]);
-                _mm512_storeu_si512(&data[offs], _mm512_setzero_si512());
-                __mmask8 nonzero = _mm512_test_epi64_mask(d, d);
-                __m512i compressed = _mm512_maskz_compress_epi64(nonzero, d); // avoid zen4 microcoded vpcompressq [mem]
-                _mm512_mask_storeu_epi64(&six[write_i], _pext_u32((uint32_t)-1, nonzero), compressed);
-                write_i += __builtin_popcount(nonzero);
-            }
-
-            for (; offs < ranges[tid + 1]; ++offs) {  // handle tail
-                if (data[offs]) {
-                    six[write_i++] = data[offs];
-                    data[offs] = 0;
-                }
-            }
-        }
-
-        six.insert(six.end(), p, p + S); // silly hack to avoid writing twice
+        six.resize(parallel_count());
+        bulk_compact(six.data(), data, capacity(), true);
     }
 };
 
@@ -0,0 +1,206 @@
+#include "TableArena.h"
+
+#include <algorithm>
+#include <iterator>
+#include <immintrin.h>
+#include <new>
+#include <omp.h>
+#include <sys/mman.h>
+
+#include "Trace.h"
+
+constexpr size_t PAGE_4K = 4096, PAGE_1G = 1UL << 30;
+
+// Zero [data, data + bytes) with streaming stores, so the clear doesn't evict everything from cache.
+// data and bytes are multiples of 4K.
+static void parallel_clear_nt(char *data, size_t bytes) {
+    constexpr size_t BLOCK = 1 << 21;
+#pragma omp parallel for schedule(static)
+    for (size_t block = 0; block < bytes; block += BLOCK) {
+        char *end = data + std::min(bytes, block + BLOCK);
+        for (char *p = data + block; p < end; p += 64) {
+            _mm512_stream_si512((__m512i*)p, _mm512_setzero_si512());
+        }
+        _mm_sfence();
+    }
+}
+
+// Split a mapping into its non-composite pieces, leaving it empty
+static void flatten(HugePageMapping&& mapping, std::vector<HugePageMapping>& out) {
+    if (!mapping.data) {
+        return;
+    }
+    if (mapping.pieces.empty()) {
+        out.push_back(std::move(mapping));
+        return;
+    }
+    for (auto& piece : mapping.pieces) {
+        flatten(std::move(piece), out);
+    }
+    // The pieces owned the memory, so there is nothing left to unmap
+    mapping.pieces.clear();
+    mapping.data = nullptr;
+    mapping.bytes = 0;
+}
+
+void TableArena::release(HugePageMapping&& mapping) {
+    std::lock_guard lock(mutex);
+    flatten(std::move(mapping), free_list);
+}
+
+void TableArena::release(std::vector<HugePageMapping>&& pieces) {
+    std::lock_guard lock(mutex);
+    for (auto& piece : pieces) {
+        flatten(std::move(piece), free_list);
+    }
+    pieces.clear();
+}
+
+// Largest pages first keeps every piece aligned to its page size, and keeps the pieces that are hardest to get
+// back
+static void sort_pieces(std::vector<HugePageMapping>& pieces) {
+    std::sort(pieces.begin(), pieces.end(), [] (const HugePageMapping& a, const HugePageMapping& b) {
+        return a.page_size() != b.page_size() ? a.page_size() > b.page_size() : a.bytes > b.bytes;
+    });
+}
+
+// PROT_NONE address space that acquire assembles a table in. Pieces are moved or mapped to [base, base + used);
+// whatever is left around them is unmapped on destruction, so nothing leaks if acquire throws part way.
+struct Reservation {
+    char *begin = nullptr, *end = nullptr, *base = nullptr;
+    size_t used = 0;
+
+    ~Reservation() {
+        if (!begin) {
+            return;
+        }
+        if (base > begin) {
+            munmap(begin, base - begin);
+        }
+        if (base + used < end) {
+            munmap(base + used, end - (base + used));
+        }
+    }
+};
+
+HugePageMapping TableArena::acquire(size_t bytes, bool allow_huge) {
+    TraceScope scope("arena acquire");
+    size_t total = (std::max(bytes, 1UL) + PAGE_4K - 1) / PAGE_4K * PAGE_4K;
+
+    // Declared before result, so that on a throw result unmaps its pieces first and the reservation the rest
+    Reservation reservation;
+    HugePageMapping result;
+    std::vector<HugePageMapping> failed;
+    std::vector<std::pair<char*, size_t>> to_clear;
+    char *&base = reservation.base;
+    size_t &offset = reservation.used;
+    {
+        // Only picking and moving pieces happens under the lock; clearing them takes far longer and doesn't need it
+        std::lock_guard lock(mutex);
+        if (!free_list.empty()) {
+            // Aligned to 1GB, with room for the last piece to overrun by up to a page
+            size_t reservation_bytes = total + 2 * PAGE_1G;
+            char *begin = (char*)mmap(nullptr, reservation_bytes, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (begin == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            reservation.begin = begin;
+            reservation.end = begin + reservation_bytes;
+            base = (char*)(((uintptr_t)begin + PAGE_1G - 1) & ~(PAGE_1G - 1));
+            sort_pieces(free_list);
+
+            std::vector<HugePageMapping> kept;
+            for (auto& piece : free_list) {
+                if (offset >= total || ((uintptr_t)base + offset) % piece.page_size()) {
+                    kept.push_back(std::move(piece));
+                    continue;
+                }
+                size_t page = piece.page_size();
+                size_t needed = (total - offset + page - 1) / page * page;
+                if (piece.mapped_bytes() >= needed && needed - (total - offset) > (total - offset) / 4
+                    && page > PAGE_4K) {
+                    // Too much of the last page would be wasted past the end; leave it for a bigger table
+                    kept.push_back(std::move(piece));
+                    continue;
+                }
+                if (piece.mapped_bytes() > needed) {
+                    for (auto& tail : piece.split_tail(needed)) {
+                        kept.push_back(std::move(tail));
+                    }
+                }
+                if (!piece.move_to(base + offset)) {
+                    // e.g. hugetlb mremap unsupported by this kernel; give the pages back so they can be mapped fresh
+                    failed.push_back(std::move(piece));
+                    continue;
+                }
+                to_clear.emplace_back(piece.data, piece.mapped_bytes());
+                offset += piece.mapped_bytes();
+                reused += piece.mapped_bytes();
+                result.pieces.push_back(std::move(piece));
+            }
+            free_list = std::move(kept);
+        }
+    }
+    failed.clear();
+    if (!reservation.begin) {
+        HugePageMapping fresh(bytes, allow_huge);
+        if (place) {
+            place(fresh);
+        }
+        return fresh;
+    }
+
+    for (auto [data, len] : to_clear) {
+        // Dropped pages come back zeroed on the next touch. hugetlb pages can't be dropped before Linux 5.18.
+        if (!place || madvise(data, len, MADV_DONTNEED) != 0) {
+            parallel_clear_nt(data, len);
+        }
+    }
+    if (offset < total) {
+        // Fresh pages are already zero
+        result.pieces.emplace_back(total - offset, allow_huge, base + offset);
+        offset += result.pieces.back().mapped_bytes();
+    }
+
+    result.data = base;
+    result.bytes = bytes;
+    // Report the worst backing of any piece
+    result.backing = PageBacking::hugetlb_1gb;
+    for (auto& piece : result.pieces) {
+        result.backing = std::max(result.backing, piece.backing);
+    }
+    if (place) {
+        place(result);
+    }
+    return result;
+}
+
+void TableArena::trim(size_t keep) {
+    std::vector<HugePageMapping> dropped;
+    {
+        std::lock_guard lock(mutex);
+        sort_pieces(free_list);
+        size_t kept = 0, i = 0;
+        for (; i < free_list.size() && kept < keep; ++i) {
+            kept += free_list[i].mapped_bytes();
+        }
+        std::move(free_list.begin() + i, free_list.end(), std::back_inserter(dropped));
+        free_list.erase(free_list.begin() + i, free_list.end());
+    }
+    // Unmapped here, outside the lock
+}
+
+size_t TableArena::free_bytes() {
+    std::lock_guard lock(mutex);
+    size_t total = 0;
+    for (auto& piece : free_list) {
+        total += piece.mapped_bytes();
+    }
+    return total;
+}
+
+size_t TableArena::reused_bytes() {
+    std::lock_guard lock(mutex);
+    return reused;
+}
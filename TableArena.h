@@ -0,0 +1,48 @@
+//
+// Created by root on 6/25/25.
+//
+
+#ifndef TABLEARENA_H
+#define TABLEARENA_H
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "MemoryBudget.h"
+
+// Keeps the memory of retired layer tables around so the next table can borrow it instead of unmapping
+// and faulting in (and having the kernel zero) hundreds of GB again. Returned mappings are split into
+// their page-size pieces; acquire moves pieces into one contiguous range with mremap, clears them with
+// non-temporal stores and maps whatever is still missing fresh.
+struct TableArena {
+    TableArena() = default;
+    TableArena(const TableArena&) = delete;
+    TableArena& operator=(const TableArena&) = delete;
+
+    // If set, applied to every mapping acquire hands out before any of its pages are touched, e.g. a NUMA
+    // placement (numa_place). Reused pieces then have their pages dropped instead of cleared, so they are faulted
+    // in again under the placement rather than staying, or being migrated, with their old contents.
+    std::function<void(const HugePageMapping&)> place;
+
+    // A zeroed mapping of at least bytes, built from free pieces where possible
+    HugePageMapping acquire(size_t bytes, bool allow_huge = true);
+    void release(HugePageMapping&& mapping);
+    void release(std::vector<HugePageMapping>&& pieces);
+
+    // Unmap free pieces until at most keep bytes of them are left (or just past it, as pieces aren't split),
+    // keeping the largest pages
+    void trim(size_t keep = 0);
+
+    size_t free_bytes();
+    // Bytes handed out from free pieces, rather than mapped fresh, since construction
+    size_t reused_bytes();
+
+private:
+    std::mutex mutex;
+    std::vector<HugePageMapping> free_list;
+    size_t reused = 0;
+};
+
+#endif //TABLEARENA_H
@@ -1,7 +1,36 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "AdvancedHashSet.h"
+#include "BulkLoad.h"
+#include "BulkMemory.h"
 #include "doctest.h"
+#include "EliasFanoLayer.h"
+#include "Enumeration.h"
+#include "FrozenLayer.h"
+#include "LayerFile.h"
+#include "LayerFilter.h"
+#include "LayerMph.h"
+#include "LayerRank.h"
+#include "MemoryBudget.h"
+#include "MemoryProfile.h"
 #include "Position.h"
+#include "Prefault.h"
+#include "RadixSort.h"
+#include "RankBitmap.h"
+#include "TableArena.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
 
 uint64_t positions[] = {
     0x002,
@@ -11,40 +40,905 @@ uint64_t positions[] = {
 };
 
 TEST_CASE("AdvancedHashSet") {
-    AdvancedHashSet set({ .tile_sum = 98, .initial_size = (uint64_t)100000000, .load_factor = 1.0 });
+    PositionsFile file("/home/mitchell/compression/350");
+    auto set = bulk_load(file, { .tile_sum = 98, .load_factor = 1.0, .sorted_fast_path = false });
 
-    // Open the file in binary mode and position the file pointer at the end.
-    std::ifstream file("/home/mitchell/compression/350", std::ios::binary | std::ios::ate);
+    std::vector<uint64_t> v;
+    set->for_each_position_parallel([&] (Position f) {
+        v.push_back(f.bits);
+    }, /*threads=*/1);
+    std::sort(v.begin(), v.end());
 
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file");
+    for (int i = 0; i < v.size() ; ++i) {
+        CHECK(v[i] == file.data[i]);
     }
+}
+TEST_CASE("radix_sort") {
+    const uint64_t key_mask = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+    int max_threads = omp_get_max_threads();
+    std::mt19937_64 rng(2048);
+    for (int threads : { 1, 4 }) {
+        omp_set_num_threads(threads);
+        // The largest size takes the parallel path
+        for (size_t n : { 0UL, 100UL, 100000UL, 3000000UL }) {
+            std::vector<uint64_t> v(n);
+            for (auto& x : v) {
+                x = rng();
+            }
+            std::vector<uint64_t> expected(v);
+            std::sort(expected.begin(), expected.end(), [&] (uint64_t a, uint64_t b) {
+                return (a & key_mask) < (b & key_mask);
+            });
+            radix_sort(v.data(), v.size(), key_mask);
+            CHECK(v == expected);
+        }
+    }
+    omp_set_num_threads(max_threads);
+}
 
-    // Get the size of the file.
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    std::vector<uint64_t> data(size / sizeof(uint64_t));
+TEST_CASE("bulk_copy, bulk_move and bulk_clear match memcpy, memmove and memset") {
+    int max_threads = omp_get_max_threads();
+    std::mt19937_64 rng(36);
+    // Room for the largest move, with odd offsets so neither end is aligned
+    const size_t bytes = (8 << 20) + 13, room = bytes + (2 << 20) + 64;
+    std::vector<char> buffer(room), expected(room);
+    for (auto& c : buffer) {
+        c = (char)rng();
+    }
+    for (int threads : { 1, 3, 4 }) {
+        omp_set_num_threads(threads);
+        // Below, just past and well past the parallel threshold, and past the non-temporal one
+        for (size_t n : { 1000UL, (1UL << 20) + 5, bytes, (40UL << 20) + 3 }) {
+            std::vector<char> src(n + 64), dst(n + 64);
+            for (auto& c : src) {
+                c = (char)rng();
+            }
+            bulk_copy(dst.data() + 3, src.data() + 1, n);
+            CHECK(memcmp(dst.data() + 3, src.data() + 1, n) == 0);
+            bulk_clear(src.data() + 5, n - 7);
+            CHECK(std::count(src.begin() + 5, src.begin() + n - 2, 0) == (long)n - 7);
+            CHECK(src[4] == dst[3 + 3]);
+            CHECK(src[n - 2] == dst[n - 2 + 2]);
+        }
 
-    // Read the entire file into the vector.
-    if (!file.read(reinterpret_cast<char*>(data.data()), size)) {
-        throw std::runtime_error("Error reading file");
+        // Overlapping by a few bytes up to more than the parallel threshold, either way, and not overlapping
+        for (size_t distance : { 8UL, 67UL, 4096UL, 300001UL, (1UL << 20) + 9, (2UL << 20) + 17 }) {
+            for (bool down : { true, false }) {
+                size_t from = down ? 7 + distance : 7, to = down ? 7 : 7 + distance;
+                size_t n = std::min(bytes, room - 7 - distance);
+                expected = buffer;
+                memmove(expected.data() + to, expected.data() + from, n);
+                bulk_move(buffer.data() + to, buffer.data() + from, n);
+                CHECK(buffer == expected);
+            }
+        }
+        bulk_move(buffer.data() + 1, buffer.data() + bytes + 1000, (1 << 20) + 3);
+        CHECK(memcmp(buffer.data() + 1, buffer.data() + bytes + 1000, (1 << 20) + 3) == 0);
     }
+    omp_set_num_threads(max_threads);
+}
 
-    #pragma omp parallel for
-    for (auto goose : data) {
-        set.insert(Position { goose });
+TEST_CASE("bulk_compact matches a serial compaction") {
+    int max_threads = omp_get_max_threads();
+    std::mt19937_64 rng(37);
+    for (int threads : { 1, 3, 4 }) {
+        omp_set_num_threads(threads);
+        // Small enough for one thread, and spanning many in-place chunks with a partial last one. Chunks land on
+        // the input of earlier ones when dense, or of chunks far behind when sparse.
+        for (size_t n : { 1001UL, (1UL << 20) + 5 }) {
+            for (double density : { 0.0, 0.01, 0.5, 0.97, 1.0 }) {
+                std::vector<uint64_t> words(n);
+                for (auto& w : words) {
+                    w = (rng() >> 11) / (double)(1ULL << 53) < density ? rng() | 1 : 0;
+                }
+                std::vector<uint64_t> expected;
+                std::copy_if(words.begin(), words.end(), std::back_inserter(expected), [] (uint64_t w) {
+                    return w != 0;
+                });
+
+                for (bool clear_source : { false, true }) {
+                    std::vector<uint64_t> src(words), dst(n, ~0ULL);
+                    size_t count = bulk_compact(dst.data(), src.data(), n, clear_source);
+                    REQUIRE(count == expected.size());
+                    CHECK(std::equal(expected.begin(), expected.end(), dst.begin()));
+                    CHECK(src == (clear_source ? std::vector<uint64_t>(n) : words));
+
+                    std::vector<uint64_t> in_place(words);
+                    count = bulk_compact(in_place.data(), in_place.data(), n, clear_source);
+                    REQUIRE(count == expected.size());
+                    CHECK(std::equal(expected.begin(), expected.end(), in_place.begin()));
+                    if (clear_source) {
+                        CHECK(std::all_of(in_place.begin() + count, in_place.end(), [] (uint64_t w) {
+                            return w == 0;
+                        }));
+                    }
+                }
+            }
+        }
     }
+    omp_set_num_threads(max_threads);
+}
 
-    size_t count = set.parallel_count();
-    set.gorge();
+TEST_CASE("HugePageMapping falls back without hugetlb pages, and splits and moves in place") {
+    int64_t saved_1gb = available_1gb_hugepages, saved_2mb = available_2mb_hugepages;
+    // Claim 2MB pages only if the kernel has none, so the mmap fails and the mapping falls through
+    bool pool_empty = read_hugepage_pool(2048).total == 0;
+    available_1gb_hugepages = 0;
+    available_2mb_hugepages = pool_empty ? 1000 : 0;
 
-    std::vector<uint64_t> v;
-    set.for_each_position_parallel([&] (Position f) {
-        v.push_back(f.bits);
-    }, /*threads=*/1);
-    std::sort(v.begin(), v.end());
+    std::string mode;
+    std::getline(std::ifstream("/sys/kernel/mm/transparent_hugepage/enabled"), mode);
+    bool thp = !mode.empty() && mode.find("[never]") == std::string::npos;
+    {
+        HugePageMapping large(5 << 20), small(100000), no_huge(5 << 20, false);
+        CHECK(large.nr_pages == 0);
+        CHECK(large.backing == (thp ? PageBacking::thp : PageBacking::small));
+        if (thp) {
+            CHECK((uintptr_t)large.data % (2 << 20) == 0);
+        }
+        CHECK(small.backing == PageBacking::small);
+        CHECK(no_huge.backing == PageBacking::small);
+        CHECK(available_1gb_hugepages == 0);
+        // A failed hugetlb mmap resyncs the budget with the kernel
+        CHECK(available_2mb_hugepages == 0);
+        for (auto *m : { &large, &small, &no_huge }) {
+            CHECK(std::all_of(m->data, m->data + m->bytes, [] (char c) { return c == 0; }));
+            memset(m->data, 0xab, m->bytes);
+        }
+    }
+    available_1gb_hugepages = saved_1gb;
+    available_2mb_hugepages = saved_2mb;
 
-    for (int i = 0; i < v.size() ; ++i) {
-        CHECK(v[i] == data[i]);
+    constexpr size_t PAGE = 4096;
+    auto pattern = [] (const char *data, size_t offset, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            if (data[i] != (char)((offset + i) * 7)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    HugePageMapping mapping(10 * PAGE + 100, false);
+    for (size_t i = 0; i < mapping.bytes; ++i) {
+        mapping.data[i] = (char)(i * 7);
+    }
+    auto tail = mapping.split_tail(3 * PAGE + 1);
+    REQUIRE(tail.size() == 1);
+    CHECK(mapping.mapped_bytes() == 4 * PAGE);
+    CHECK(tail[0].data == mapping.data + 4 * PAGE);
+    CHECK(tail[0].mapped_bytes() == 7 * PAGE);
+    CHECK(pattern(tail[0].data, 4 * PAGE, 6 * PAGE + 100));
+
+    char *region = (char*)mmap(nullptr, 16 * PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(region != MAP_FAILED);
+    REQUIRE(mapping.move_to(region));
+    CHECK(mapping.data == region);
+    CHECK(pattern(mapping.data, 0, 4 * PAGE));
+
+    // A composite whose second piece can't move (its pages are gone) stays where it was as a whole
+    HugePageMapping composite;
+    composite.data = mapping.data;
+    composite.bytes = 8 * PAGE;
+    auto second = tail[0].split_tail(4 * PAGE);
+    REQUIRE(tail[0].move_to(region + 4 * PAGE));
+    composite.pieces.push_back(std::move(mapping));
+    composite.pieces.push_back(std::move(tail[0]));
+    munmap(composite.pieces[1].data, composite.pieces[1].mapped_bytes());
+    CHECK(!composite.move_to(region + 8 * PAGE));
+    CHECK(composite.data == region);
+    CHECK(composite.pieces[0].data == region);
+    CHECK(pattern(composite.pieces[0].data, 0, 4 * PAGE));
+    composite.pieces[1].data = nullptr;
+    munmap(region + 8 * PAGE, 8 * PAGE);
+}
+
+TEST_CASE("TableArena hands out zeroed memory assembled from free pieces") {
+    constexpr size_t PAGE = 4096, PAGE_2M = 2 << 20;
+    auto all_zero = [] (const HugePageMapping& m) {
+        return std::all_of(m.data, m.data + m.bytes, [] (char c) { return c == 0; });
+    };
+    // Stands in for 2MB hugetlb pages, which the test machine may not have; the arena only goes by page size
+    auto fake_2mb = [] (size_t pages) {
+        HugePageMapping piece(pages * PAGE_2M, false);
+        piece.backing = PageBacking::hugetlb_2mb;
+        memset(piece.data, 0xab, piece.bytes);
+        return piece;
+    };
+
+    for (bool placed : { false, true }) {
+        TableArena arena;
+        std::vector<char*> placed_at;
+        if (placed) {
+            arena.place = [&] (const HugePageMapping& m) { placed_at.push_back(m.data); };
+        }
+        HugePageMapping dirty(100 * PAGE, false);
+        memset(dirty.data, 0xab, dirty.bytes);
+        arena.release(std::move(dirty));
+        auto table = arena.acquire(60 * PAGE + 5, false);
+        CHECK(table.bytes == 60 * PAGE + 5);
+        CHECK(arena.reused_bytes() == 61 * PAGE);
+        CHECK(arena.free_bytes() == 39 * PAGE);
+        CHECK(all_zero(table));
+        if (placed) {
+            CHECK(placed_at == std::vector<char*> { table.data });
+        }
+    }
+
+    {
+        // Two 2MB pieces, then 4K pages, then a fresh tail. The 2MB piece is used whole even though rounding the
+        // rest of the table up to 2MB would waste too much.
+        TableArena arena;
+        arena.release(fake_2mb(1));
+        arena.release(HugePageMapping(128 * PAGE, false));
+        arena.release(fake_2mb(2));
+        size_t bytes = 3 * PAGE_2M + 175 * PAGE;
+        auto table = arena.acquire(bytes, false);
+        CHECK(table.bytes == bytes);
+        CHECK((uintptr_t)table.data % (1 << 30) == 0);
+        REQUIRE(table.pieces.size() == 4);
+        CHECK(table.pieces[0].backing == PageBacking::hugetlb_2mb);
+        CHECK(table.pieces[1].backing == PageBacking::hugetlb_2mb);
+        CHECK(table.pieces[2].backing == PageBacking::small);
+        CHECK(table.backing == PageBacking::small);
+        char *expected = table.data;
+        for (auto& piece : table.pieces) {
+            CHECK(piece.data == expected);
+            CHECK((uintptr_t)piece.data % piece.page_size() == 0);
+            expected += piece.mapped_bytes();
+        }
+        CHECK(table.mapped_bytes() == bytes);
+        CHECK(arena.reused_bytes() == 3 * PAGE_2M + 128 * PAGE);
+        CHECK(arena.free_bytes() == 0);
+        CHECK(all_zero(table));
+        memset(table.data, 0xcd, table.bytes);
+    }
+
+    {
+        // Pieces with larger pages are kept first, then larger pieces
+        TableArena arena;
+        arena.release(fake_2mb(1));
+        arena.release(HugePageMapping(3 * PAGE_2M / 2, false));
+        arena.release(fake_2mb(2));
+        arena.trim(5 << 20);
+        CHECK(arena.free_bytes() == 3 * PAGE_2M);
+        auto table = arena.acquire(3 * PAGE_2M);
+        CHECK(table.backing == PageBacking::hugetlb_2mb);
+        CHECK(arena.free_bytes() == 0);
+        arena.release(std::move(table));
+        arena.trim();
+        CHECK(arena.free_bytes() == 0);
+    }
+}
+
+TEST_CASE("populate_range and Prefaulter fault in every page") {
+    constexpr size_t PAGE = 4096;
+    auto resident_pages = [] (char *data, size_t pages) {
+        std::vector<unsigned char> resident(pages);
+        REQUIRE(mincore(data, pages * PAGE, resident.data()) == 0);
+        return (size_t)std::count_if(resident.begin(), resident.end(), [] (unsigned char r) { return r & 1; });
+    };
+
+    {
+        // Unaligned at both ends: the first and last pages are only partly covered
+        HugePageMapping mapping(16 * PAGE, false);
+        populate_range(mapping.data + 100, 5 * PAGE);
+        CHECK(resident_pages(mapping.data, 6) == 6);
+        CHECK(resident_pages(mapping.data + 6 * PAGE, 10) == 0);
+    }
+
+    {
+        size_t bytes = (64 << 20) + 12345;
+        HugePageMapping mapping(bytes, false);
+        Prefaulter prefaulter(mapping.data, bytes, { .threads = 3, .bytes_per_second = 0, .chunk_bytes = 4 << 20 });
+        prefaulter.wait();
+        CHECK(prefaulter.done());
+        CHECK(prefaulter.faulted_bytes() == bytes);
+        size_t pages = (bytes + PAGE - 1) / PAGE;
+        CHECK(resident_pages(mapping.data, pages) == pages);
+    }
+
+    {
+        // At this rate, 1GB would take 16 seconds
+        size_t bytes = 1UL << 30;
+        HugePageMapping mapping(bytes, false);
+        auto start = std::chrono::steady_clock::now();
+        Prefaulter prefaulter(mapping.data, bytes,
+            { .threads = 2, .bytes_per_second = 64 << 20, .chunk_bytes = 1 << 20 });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        prefaulter.stop();
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+        CHECK(prefaulter.done());
+        CHECK(prefaulter.faulted_bytes() > 0);
+        CHECK(prefaulter.faulted_bytes() < bytes / 4);
+    }
+}
+
+// A sorted enumeration up to tile sum 40, run once for all the tests that need a real layer: the slots of every
+// layer, and the table of the last one
+struct ReferenceLayers {
+    Enumeration enumeration;
+    std::map<uint32_t, std::vector<uint64_t>> slots;
+
+    ReferenceLayers() : enumeration({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false,
+            .sort_layers = true }) {
+        enumeration.run([&] (const LayerStats& stats, const AdvancedHashSet& layer) {
+            slots[stats.tile_sum].assign(layer.data, layer.data + layer.capacity);
+            return true;
+        });
+    }
+
+    // Tile sum 40, left in h2 when the run ends
+    const AdvancedHashSet& layer() const {
+        return enumeration.h2;
+    }
+};
+
+static const ReferenceLayers& reference() {
+    static ReferenceLayers layers;
+    return layers;
+}
+
+// The slots of the tile sum 40 layer, and its positions shuffled into an order to insert them in
+struct TestLayer {
+    const std::vector<uint64_t>& slots;
+    std::vector<uint64_t> positions;
+};
+
+static TestLayer test_layer(uint64_t seed) {
+    TestLayer layer { reference().slots.at(40), {} };
+    for (uint64_t d : layer.slots) {
+        AdvancedHashSet::unpack_slot(40, d, [&] (Position p) {
+            layer.positions.push_back(p.bits);
+        });
+    }
+    std::shuffle(layer.positions.begin(), layer.positions.end(), std::mt19937_64(seed));
+    return layer;
+}
+
+// Insert the layer into table on all threads, check that the table then holds exactly the layer, and that it sorts
+// back into the same slots. filled runs checks that are specific to the table's layout while it is full.
+static void check_holds_layer(AdvancedHashSet& table, const TestLayer& layer,
+        const std::function<void()>& filled = {}) {
+    const std::vector<uint64_t>& positions = layer.positions;
+    size_t added = 0;
+#pragma omp parallel for reduction(+:added)
+    for (size_t i = 0; i < positions.size(); ++i) {
+        added += table.insert(Position { positions[i] });
+    }
+    CHECK(added == positions.size());
+    CHECK(!table.insert(Position { positions[0] }));
+    CHECK(table.parallel_count() == positions.size());
+
+    std::vector<uint64_t> sorted(positions), visited;
+    std::sort(sorted.begin(), sorted.end());
+    table.for_each_position_parallel([&] (Position p) {
+        visited.push_back(p.bits);
+    }, 1);
+    std::sort(visited.begin(), visited.end());
+    CHECK(visited == sorted);
+
+    // Members, and positions of the same tile sum that aren't, made by swapping two cells of members. Tables only
+    // hold canonical positions, so lookups are canonical too.
+    size_t found = 0, false_hits = 0, tried = 0;
+    for (size_t i = 0; i < positions.size(); ++i) {
+        found += table.contains(Position { positions[i] });
+        Position p { positions[i] };
+        Position q = p.set_tile(15, p[3]).set_tile(3, p[15]).canonical_form();
+        if (i % 7 == 0 && !std::binary_search(sorted.begin(), sorted.end(), q.bits)) {
+            false_hits += table.contains(q);
+            tried++;
+        }
+    }
+    CHECK(found == positions.size());
+    CHECK(tried > 0);
+    CHECK(false_hits == 0);
+
+    if (filled) {
+        filled();
+    }
+    table.gorge_sorted();
+    CHECK(std::vector<uint64_t>(table.data, table.data + table.capacity) == layer.slots);
+}
+
+// Run the recurrence to tile sum 40 with config and check that every layer has the same slots as the reference.
+// Returns how many of the layers counted says went the way under test.
+static size_t check_same_layers(const Enumeration::Config& config,
+        const std::function<bool(const LayerStats&)>& counted) {
+    size_t compared = 0;
+    Enumeration enumeration(config);
+    enumeration.run([&] (const LayerStats& stats, const AdvancedHashSet& layer) {
+        CHECK(reference().slots.at(stats.tile_sum) == std::vector<uint64_t>(layer.data, layer.data + layer.capacity));
+        compared += counted(stats);
+        return true;
+    });
+    return compared;
+}
+
+TEST_CASE("gorge_sorted does not depend on the thread count or placement") {
+    int max_threads = omp_get_max_threads();
+    for (bool ordered : { false, true }) {
+        for (int threads : { 1, 4 }) {
+            omp_set_num_threads(threads);
+            check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+                .ordered_placement = ordered }, [] (const LayerStats&) { return true; });
+        }
+    }
+    omp_set_num_threads(max_threads);
+
+    const std::vector<uint64_t>& slots = reference().slots.at(40);
+    const uint64_t key_mask = (1ULL << AdvancedHashSet::POSITION_BITS) - 1;
+    CHECK(std::is_sorted(slots.begin(), slots.end(), [&] (uint64_t a, uint64_t b) {
+        return (a & key_mask) < (b & key_mask);
+    }));
+}
+
+TEST_CASE("FrozenLayer agrees with a sorted list of the layer") {
+    const AdvancedHashSet& layer = reference().layer();
+    std::vector<uint64_t> members, queries;
+    std::mt19937_64 rng(40);
+    layer.for_each_position_parallel([&] (Position p) {
+        members.push_back(p.bits);
+    }, 1);
+    REQUIRE(!members.empty());
+    std::sort(members.begin(), members.end());
+
+    // Members, and members with two cells swapped: same tile sum, but mostly not in the layer
+    for (size_t i = 0; i < members.size(); i += 3) {
+        Position p { members[i] };
+        queries.push_back(p.bits);
+        int a = rng() % 16, b = rng() % 16;
+        queries.push_back(p.set_tile(a, p[b]).set_tile(b, p[a]).canonical_form().bits);
+    }
+
+    FrozenLayer frozen(layer);
+    CHECK(frozen.index_bytes() * 8 < members.size() * 2);
+    std::unique_ptr<bool[]> batch(new bool[queries.size()]);
+    frozen.contains_batch(queries.data(), queries.size(), batch.get());
+    size_t mismatches = 0, hits = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        bool expected = std::binary_search(members.begin(), members.end(), queries[i]);
+        hits += expected;
+        mismatches += frozen.contains(Position { queries[i] }) != expected;
+        mismatches += batch[i] != expected;
+    }
+    CHECK(mismatches == 0);
+    CHECK(hits < queries.size());
+    // Other tile sums are never in the layer
+    Position first { members[0] };
+    CHECK(!frozen.contains(first.set_tile(15, first[15] + 1)));
+}
+
+TEST_CASE("EliasFanoLayer matches the table it was built from") {
+    const AdvancedHashSet& layer = reference().layer();
+    std::mt19937_64 rng(41);
+    EliasFanoLayer succinct(layer);
+    CHECK(succinct.slots == layer.capacity);
+    CHECK(succinct.bytes() < layer.capacity * sizeof(uint64_t));
+    CHECK(succinct.parallel_count() == layer.parallel_count());
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < layer.capacity; i += 7) {
+        mismatches += succinct.slot(i) != layer.data[i];
+    }
+    CHECK(mismatches == 0);
+
+    std::vector<uint64_t> members, decoded;
+    layer.for_each_position_parallel([&] (Position p) {
+        members.push_back(p.bits);
+    }, 1);
+    succinct.for_each_position_parallel([&] (Position p) {
+        decoded.push_back(p.bits);
+    }, 1);
+    CHECK(decoded == members);
+
+    std::sort(members.begin(), members.end());
+    FrozenLayer frozen(layer);
+    for (size_t i = 0; i < members.size(); i += 3) {
+        Position p { members[i] };
+        int a = rng() % 16, b = rng() % 16;
+        for (Position q : { p, p.set_tile(a, p[b]).set_tile(b, p[a]).canonical_form() }) {
+            mismatches += succinct.contains(q) != frozen.contains(q);
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("succinct sources give the same layers") {
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false,
+        .succinct_sources = true }, [] (const LayerStats&) { return true; }) > 10);
+}
+
+TEST_CASE("rank and unrank over a saved layer") {
+    std::string filename = (std::filesystem::temp_directory_path() / "solve_2048_test_layer_40").string();
+    const AdvancedHashSet& layer = reference().layer();
+    std::vector<uint64_t> members;
+    // In slot order, which is rank order
+    layer.for_each_position_parallel([&] (Position p) {
+        members.push_back(p.bits);
+    }, 1);
+    REQUIRE(!members.empty());
+    save_layer(layer, filename);
+
+    LayerFile file(filename);
+    CHECK(file.tile_sum() == 40);
+    CHECK(file.header.positions == members.size());
+    CHECK(file.header.sorted);
+    LayerRank ranks(file);
+    REQUIRE(ranks.positions == members.size());
+    CHECK(ranks.index_bytes() * 8 < file.slots() * 3);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < members.size(); ++i) {
+        mismatches += ranks.rank(Position { members[i] }) != i;
+        mismatches += ranks.unrank(i).bits != members[i];
+    }
+    CHECK(mismatches == 0);
+
+    std::vector<uint64_t> indices(members.size()), unranked(members.size());
+    std::vector<size_t> ranked(members.size());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        indices[i] = (i * 7919) % indices.size();
+    }
+    ranks.unrank_batch(indices.data(), indices.size(), unranked.data());
+    ranks.rank_batch(unranked.data(), unranked.size(), ranked.data());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        mismatches += unranked[i] != members[indices[i]];
+        mismatches += ranked[i] != indices[i];
+    }
+    CHECK(mismatches == 0);
+
+    Position first { members[0] };
+    CHECK(ranks.rank(first.set_tile(15, first[15] + 1)) == SIZE_MAX);
+    CHECK_THROWS(ranks.unrank(members.size()));
+    std::filesystem::remove(filename);
+    CHECK_THROWS(LayerFile(filename));
+}
+
+TEST_CASE("LayerMph is a minimal perfect hash of the layer") {
+    std::string filename = (std::filesystem::temp_directory_path() / "solve_2048_test_layer_40").string();
+    // Unsorted, as gorge leaves a layer
+    TestLayer layer = test_layer(42);
+    AdvancedHashSet table({ .tile_sum = 40, .initial_size = 2 * layer.slots.size() });
+#pragma omp parallel for
+    for (size_t i = 0; i < layer.positions.size(); ++i) {
+        table.insert(Position { layer.positions[i] });
+    }
+    table.gorge();
+    std::vector<uint64_t> members;
+    table.for_each_position_parallel([&] (Position p) {
+        members.push_back(p.bits);
+    }, 1);
+    REQUIRE(!members.empty());
+    save_layer(table, filename);
+
+    LayerFile file(filename);
+    LayerMph mph = LayerMph::build(file);
+    CHECK(mph.keys == members.size());
+    CHECK(mph.bytes() * 8 < members.size() * 4);
+    std::vector<uint8_t> hit(members.size());
+    size_t out_of_range = 0;
+    for (uint64_t p : members) {
+        size_t i = mph.index(Position { p });
+        if (i < hit.size()) {
+            hit[i]++;
+        } else {
+            out_of_range++;
+        }
+    }
+    CHECK(out_of_range == 0);
+    CHECK(std::all_of(hit.begin(), hit.end(), [] (uint8_t h) { return h == 1; }));
+
+    mph.save(LayerMph::path_for(filename));
+    LayerMph loaded = LayerMph::load(LayerMph::path_for(filename));
+    size_t mismatches = 0;
+    for (uint64_t p : members) {
+        mismatches += loaded.index(Position { p }) != mph.index(Position { p });
+    }
+    CHECK(mismatches == 0);
+    std::filesystem::remove(LayerMph::path_for(filename));
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("LayerFilter has no false negatives and few false positives") {
+    std::string filename = (std::filesystem::temp_directory_path() / "solve_2048_test_layer_40.bloom").string();
+    std::mt19937_64 rng(44);
+    const AdvancedHashSet& layer = reference().layer();
+    LayerFilter filter = LayerFilter::build(layer);
+    std::vector<uint64_t> members;
+    layer.for_each_position_parallel([&] (Position p) {
+        members.push_back(p.bits);
+    }, 1);
+    CHECK(filter.keys == members.size());
+    size_t false_negatives = 0;
+    for (uint64_t p : members) {
+        false_negatives += !filter.may_contain(Position { p });
+    }
+    CHECK(false_negatives == 0);
+
+    // Members with two cells swapped, minus those that are members too
+    FrozenLayer frozen(layer);
+    std::vector<uint64_t> negatives;
+    for (uint64_t m : members) {
+        Position p { m };
+        int a = rng() % 16, b = rng() % 16;
+        Position q = p.set_tile(a, p[b]).set_tile(b, p[a]).canonical_form();
+        if (!frozen.contains(q)) {
+            negatives.push_back(q.bits);
+        }
+    }
+    std::unique_ptr<bool[]> passed(new bool[negatives.size()]);
+    filter.may_contain_batch(negatives.data(), negatives.size(), passed.get());
+    size_t false_positives = 0, mismatches = 0;
+    for (size_t i = 0; i < negatives.size(); ++i) {
+        false_positives += passed[i];
+        mismatches += passed[i] != filter.may_contain(Position { negatives[i] });
+    }
+    CHECK(mismatches == 0);
+    CHECK(false_positives < negatives.size() / 20);
+    Position first { members[0] };
+    CHECK(!filter.may_contain(first.set_tile(15, first[15] + 1)));
+
+    filter.save(filename);
+    LayerFilter loaded = LayerFilter::load(filename);
+    CHECK(loaded.blocks.size() == filter.blocks.size());
+    CHECK(memcmp(loaded.blocks.data(), filter.blocks.data(), filter.bytes()) == 0);
+    std::filesystem::remove(filename);
+
+    // Built along with every layer
+    Enumeration enumeration({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .layer_filters = true });
+    enumeration.run([&] (const LayerStats& stats, const AdvancedHashSet&) {
+        CHECK(enumeration.filter.keys == stats.positions);
+        return true;
+    });
+    CHECK(memcmp(enumeration.filter.blocks.data(), filter.blocks.data(), filter.bytes()) == 0);
+}
+
+TEST_CASE("bulk_load from a positions file matches gorge_sorted") {
+    std::string filename = (std::filesystem::temp_directory_path() / "solve_2048_test_positions_40").string();
+    std::mt19937_64 rng(45);
+    const AdvancedHashSet& layer = reference().layer();
+    std::vector<uint64_t> positions;
+    layer.for_each_position_parallel([&] (Position p) {
+        positions.push_back(p.bits);
+    }, 1);
+    std::sort(positions.begin(), positions.end());
+    {
+        std::ofstream out(filename, std::ios::binary);
+        out.write((const char *)positions.data(), positions.size() * sizeof(uint64_t));
+    }
+
+    auto same_slots = [&] (const AdvancedHashSet& loaded) {
+        REQUIRE(loaded.capacity == layer.capacity);
+        CHECK(memcmp(loaded.data, layer.data, layer.capacity * sizeof(uint64_t)) == 0);
+    };
+    PositionsFile file(filename);
+    CHECK(!file.compressed);
+    CHECK(file.count == positions.size());
+    BulkLoadStats bulk_stats;
+    same_slots(*bulk_load(file, {}, &bulk_stats));
+    CHECK(bulk_stats.sorted_path);
+    CHECK(bulk_stats.canonicalized == 0);
+    same_slots(*bulk_load(file, { .sort = true, .sorted_fast_path = false }, &bulk_stats));
+    CHECK(!bulk_stats.sorted_path);
+
+    // Shuffled, with duplicates and some positions in a non-canonical orientation
+    std::vector<uint64_t> shuffled = positions;
+    shuffled.insert(shuffled.end(), positions.begin(), positions.begin() + 1000);
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    for (size_t i = 0; i < shuffled.size(); i += 7) {
+        Position p { shuffled[i] };
+        shuffled[i] = p.set_tile(0, p[3]).set_tile(3, p[0]).set_tile(1, p[2]).set_tile(2, p[1])
+            .set_tile(4, p[7]).set_tile(7, p[4]).set_tile(5, p[6]).set_tile(6, p[5])
+            .set_tile(8, p[11]).set_tile(11, p[8]).set_tile(9, p[10]).set_tile(10, p[9])
+            .set_tile(12, p[15]).set_tile(15, p[12]).set_tile(13, p[14]).set_tile(14, p[13]).bits;
+    }
+    same_slots(*bulk_load(shuffled.data(), shuffled.size(), { .sort = true }, &bulk_stats));
+    CHECK(!bulk_stats.sorted_path);
+    CHECK(bulk_stats.canonicalized > 0);
+    CHECK(bulk_stats.positions == shuffled.size());
+
+    // A position from another layer
+    shuffled[shuffled.size() / 2] = Position { positions[0] }.set_tile(15, Position { positions[0] }[15] + 1).bits;
+    CHECK_THROWS_AS(bulk_load(shuffled.data(), shuffled.size(), { .tile_sum = 40 }), std::runtime_error);
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("compress_small_position ranks densely and in position order") {
+    // A single 4, or two 2s
+    CHECK(small_position_space(4) == 16 + 120);
+    CHECK(small_position_space(5) == 0);
+    std::mt19937_64 rng(46);
+    for (int sum : { 4, 12, 40, 200, 2046 }) {
+        uint64_t space = small_position_space(sum);
+        uint64_t previous = 0;
+        std::vector<uint64_t> ranks, positions;
+        for (uint64_t rank = 0; rank < space; rank += 1 + rng() % (space / 500 + 1)) {
+            ranks.push_back(rank);
+            uint64_t pos = decompress_small_position(rank, sum);
+            positions.push_back(pos);
+            CHECK(tile_sum(pos) == (uint32_t)sum);
+            CHECK(max_tile(pos) <= SMALL_POSITION_MAX_TILE);
+            CHECK(compress_small_position(pos, sum) == rank);
+            if (rank > 0) {
+                CHECK(pos > decompress_small_position(previous, sum));
+            }
+            previous = rank;
+        }
+        CHECK(compress_small_position(decompress_small_position(space - 1, sum), sum) == space - 1);
+        decompress_small_positions(ranks.data(), ranks.size(), sum);
+        CHECK(ranks == positions);
+    }
+}
+
+TEST_CASE("rank bitmaps give the same layers") {
+    // Big enough tables that the layers up to 30 go through bitmaps
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 500000, .verbose = false, .sort_layers = true,
+        .rank_bitmaps = true }, [] (const LayerStats& stats) { return stats.rank_bitmap; }) > 5);
+}
+
+TEST_CASE("packed tables hold the same layer") {
+    CHECK(SlotCodec::for_tile_sum(40).bytes == 6);
+    CHECK(SlotCodec::for_tile_sum(500).bytes == 7);
+    CHECK(!SlotCodec::for_tile_sum(1500).packed());
+
+    TestLayer layer = test_layer(47);
+    const std::vector<uint64_t>& slots = layer.slots;
+
+    // Packing is order preserving, and eight at a time agrees with one at a time
+    for (int tile_sum : { 40, 500 }) {
+        SlotCodec codec = SlotCodec::for_tile_sum(tile_sum);
+        std::vector<uint8_t> packed(slots.size() * codec.bytes + 64);
+        for (size_t i = 0; i < slots.size(); ++i) {
+            uint64_t p = codec.narrow(slots[i]);
+            CHECK(codec.widen(p) == slots[i]);
+            if (i > 0) {
+                CHECK((p & ((1ULL << codec.key_bits) - 1)) > (codec.narrow(slots[i - 1]) & ((1ULL << codec.key_bits) - 1)));
+            }
+            memcpy(&packed[i * codec.bytes], &p, codec.bytes);
+        }
+        size_t mismatches = 0;
+        for (size_t i = 0; i < slots.size(); i += 8) {
+            alignas(64) uint64_t lanes[8];
+            int n = std::min<size_t>(8, slots.size() - i);
+            _mm512_store_si512(lanes, codec.widen(codec.load(&packed[i * codec.bytes], n)));
+            for (int k = 0; k < 8; ++k) {
+                mismatches += lanes[k] != (k < n ? slots[i + k] : 0);
+            }
+        }
+        CHECK(mismatches == 0);
+    }
+
+    // Roomy enough to widen in place, and too full to. Compaction runs in chunks of 4096 lines, and with several
+    // threads a chunk's output lands on the input of earlier chunks still being read: the one before when full,
+    // several before when sparse.
+    int max_threads = omp_get_max_threads();
+    for (auto [ threads, initial_size ] : { std::pair { 1, 8 * slots.size() }, std::pair { 1, slots.size() + 100 },
+                                            std::pair { 4, 8 * slots.size() }, std::pair { 4, slots.size() + 100 } }) {
+        omp_set_num_threads(threads);
+        AdvancedHashSet table({ .tile_sum = 40, .initial_size = initial_size, .load_factor = 1.0, .packed = true });
+        CHECK(table.capacity / table.codec.per_line > 1 << 12);
+        CHECK(table.codec.bytes == 6);
+        CHECK(table.table_bytes() < initial_size * 7);
+        check_holds_layer(table, layer);
+        CHECK(!table.codec.packed());
+    }
+    omp_set_num_threads(max_threads);
+
+    // The whole recurrence
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .packed_tables = true }, [] (const LayerStats& stats) { return stats.slot_bytes == 6; }) > 10);
+}
+
+TEST_CASE("quotient tables hold the same layer") {
+    // The mix is invertible, and a key is its home and remainder
+    CHECK(SlotCodec().with_quotient(1ULL << 36).bytes == 5);
+    std::mt19937_64 rng(48);
+    for (auto [ codec, homes ] : { std::pair { SlotCodec().with_quotient(1ULL << 36), 1ULL << 36 },
+                                   std::pair { SlotCodec::for_tile_sum(40).with_quotient(100000), 100000ULL } }) {
+        for (int i = 0; i < 10000; ++i) {
+            uint64_t key = rng() & ((1ULL << codec.mix_bits) - 1);
+            CHECK(codec.unmix(codec.mix(key)) == key);
+            auto [ home, remainder ] = codec.split(key);
+            CHECK(home < homes);
+            CHECK(remainder < (1ULL << codec.remainder_bits));
+            CHECK(home * codec.bucket_keys + remainder == codec.mix(key));
+        }
     }
-}
\ No newline at end of file
+
+    TestLayer layer = test_layer(49);
+    const std::vector<uint64_t>& slots = layer.slots;
+
+    // Roomy, and so full that some keys overflow. Unpacked, this layer is too small for remainders to save a byte
+    // unless the table is roomy. Slots are found again from where compaction moved them, so this also runs with
+    // several threads compacting.
+    int max_threads = omp_get_max_threads();
+    for (int threads : { 1, 4 }) {
+        for (auto [ packed, initial_size ] : { std::pair { false, 2 * slots.size() },
+                                               std::pair { true, 2 * slots.size() },
+                                               std::pair { true, slots.size() + 1 } }) {
+            omp_set_num_threads(threads);
+            AdvancedHashSet table({ .tile_sum = 40, .initial_size = initial_size, .load_factor = 1.0,
+                .packed = packed, .quotient = true });
+            CHECK(table.codec.quotient);
+            CHECK(table.codec.bytes == (packed ? 5 : 7));
+            check_holds_layer(table, layer, [&] {
+                CHECK(table.overflow.empty() == (initial_size > slots.size() + 1));
+            });
+            CHECK(!table.codec.packed());
+        }
+    }
+    omp_set_num_threads(max_threads);
+
+    // The whole recurrence
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .packed_tables = true, .quotient_tables = true }, [] (const LayerStats& stats) {
+        return stats.slot_bytes < 6;
+    }) > 10);
+}
+
+TEST_CASE("grouped slots hold the same layer") {
+    // Every row sorts and comes back
+    for (uint32_t row = 0; row < 1 << 16; ++row) {
+        auto [ index, sorted ] = sort_lower_4(Position { 0x1230000ULL | row });
+        alignas(64) uint64_t positions[32];
+        int n = AdvancedHashSet::unpack_group(Position { 0x1230000ULL | row }.tile_sum(), sorted.bits >> 4, 1 << index,
+                                              positions);
+        CHECK(n == 1);
+        CHECK(positions[0] == (0x1230000ULL | row));
+    }
+
+    TestLayer layer = test_layer(50);
+    size_t groups = reference().layer().count_groups();
+    // Grouping never pays for these layers at the default ratio
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .grouped_tables = true }, [&] (const LayerStats& stats) {
+        if (stats.tile_sum == 40) {
+            CHECK(stats.grouped_slots == groups);
+        }
+        return stats.slot_bytes == 16;
+    }) == 0);
+
+    AdvancedHashSet table({ .tile_sum = 40, .initial_size = 2 * groups, .load_factor = 1.0, .group_cells = 4 });
+    check_holds_layer(table, layer, [&] {
+        size_t occupied = 0;
+        for (size_t i = 0; i < table.capacity; ++i) {
+            occupied += table.data[2 * i] != 0;
+        }
+        CHECK(occupied == groups);
+    });
+    CHECK(table.group_cells == 3);
+
+    // Counted from a sorted copy, then in one pass once the slots themselves are sorted
+    AdvancedHashSet plain({ .tile_sum = 40, .initial_size = 2 * layer.slots.size() });
+#pragma omp parallel for
+    for (size_t i = 0; i < layer.positions.size(); ++i) {
+        plain.insert(Position { layer.positions[i] });
+    }
+    plain.gorge();
+    CHECK(plain.count_groups() == groups);
+    plain.gorge_sorted();
+    CHECK(plain.count_groups() == groups);
+
+    // The whole recurrence, with grouping forced
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .grouped_tables = true, .grouped_table_ratio = 2 }, [] (const LayerStats& stats) {
+        return stats.slot_bytes == 16;
+    }) > 10);
+}
+
+TEST_CASE("bucketed tables hold the same layer") {
+    TestLayer layer = test_layer(51);
+
+    // Roomy, and full up to the last bucket
+    for (size_t initial_size : { 2 * layer.slots.size(), layer.slots.size() }) {
+        AdvancedHashSet table({ .tile_sum = 40, .initial_size = initial_size, .load_factor = 1.0, .bucketed = true });
+        CHECK(table.capacity == table.buckets * 8);
+        check_holds_layer(table, layer);
+        CHECK(table.buckets == 0);
+    }
+
+    // The whole recurrence
+    CHECK(check_same_layers({ .max_tile_sum = 40, .min_capacity = 100000, .verbose = false, .sort_layers = true,
+        .bucketed_tables = true }, [] (const LayerStats&) { return true; }) > 10);
+}
@@ -0,0 +1,33 @@
+//
+// Created by root on 6/21/25.
+//
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "Trace.h"
+
+#define SHOW_TIMINGS 1
+
+// Run f, print how long it took (if show is set), and return the elapsed time in seconds. The run also
+// appears on the trace timeline under the label.
+template <typename Func>
+double timed_run(const std::string& label, Func&& f, bool show = true) {
+    TraceScope scope(trace_active.load(std::memory_order_relaxed) ? trace_intern(label) : "");
+    auto start = std::chrono::high_resolution_clock::now();
+    f();  // call the function
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double> elapsed = end - start;
+#if SHOW_TIMINGS
+    if (show)
+        std::cout << label << " took " << elapsed.count() << " seconds.\n";
+#endif
+    return elapsed.count();
+}
+
+#endif //TIMING_H
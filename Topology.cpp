@@ -0,0 +1,98 @@
+#include "Topology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sched.h>
+#include <string>
+#include <thread>
+
+static bool read_int(const std::string& path, int& value) {
+    std::ifstream file(path);
+    return (bool)(file >> value);
+}
+
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    size_t i = 0;
+    while (i < list.size()) {
+        size_t end = list.find(',', i);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string range = list.substr(i, end - i);
+        auto dash = range.find('-');
+        if (!range.empty() && range[0] != '\n') {
+            int lo = std::stoi(range.substr(0, dash));
+            int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+            for (int c = lo; c <= hi; ++c) {
+                cpus.push_back(c);
+            }
+        }
+        i = end + 1;
+    }
+    return cpus;
+}
+
+std::vector<CpuInfo> read_cpu_topology() {
+    std::vector<CpuInfo> result;
+
+    std::string online;
+    std::ifstream file("/sys/devices/system/cpu/online");
+    if (!std::getline(file, online)) {
+        for (int i = 0; i < (int)std::thread::hardware_concurrency(); ++i) {
+            result.push_back({ i, i, 0, 0 });
+        }
+        return result;
+    }
+
+    std::map<std::pair<int, int>, int> threads_per_core;  // (package, core_id) -> hardware threads seen
+    std::map<std::pair<int, int>, int> core_numbers;
+    for (int cpu : parse_cpu_list(online)) {
+        std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int core_id = cpu, package = 0;
+        read_int(base + "core_id", core_id);
+        read_int(base + "physical_package_id", package);
+
+        auto key = std::make_pair(package, core_id);
+        if (!core_numbers.count(key)) {
+            int next = core_numbers.size();
+            core_numbers[key] = next;
+        }
+        result.push_back({ cpu, core_numbers[key], package, threads_per_core[key]++ });
+    }
+    return result;
+}
+
+std::vector<int> pick_cpus(const std::vector<CpuInfo>& topology, int n, bool smt) {
+    std::vector<CpuInfo> order;
+    for (auto& c : topology) {
+        if (smt || c.smt_index == 0) {
+            order.push_back(c);
+        }
+    }
+    // Cores in order; with smt, siblings of a core are adjacent
+    std::stable_sort(order.begin(), order.end(), [] (const CpuInfo& a, const CpuInfo& b) {
+        return a.core != b.core ? a.core < b.core : a.smt_index < b.smt_index;
+    });
+    std::vector<int> cpus;
+    for (int i = 0; i < n && i < (int)order.size(); ++i) {
+        cpus.push_back(order[i].cpu);
+    }
+    return cpus;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpus.empty()) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            CPU_SET(c, &set);
+        }
+    } else {
+        for (int c : cpus) {
+            CPU_SET(c, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
@@ -0,0 +1,33 @@
+//
+// Created by root on 6/22/25.
+//
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// One logical CPU as described by /sys/devices/system/cpu.
+struct CpuInfo {
+    int cpu;
+    int core;  // physical core id, unique across packages
+    int package;
+    int smt_index;  // 0 for the first hardware thread of a core, 1 for its sibling, ...
+};
+
+// Parse a sysfs CPU (or node) list such as "0-3,8,10-11".
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// List the online logical CPUs, sorted by CPU number. Falls back to one entry per hardware thread with
+// no SMT if sysfs is unavailable.
+std::vector<CpuInfo> read_cpu_topology();
+
+// CPUs to use for n threads. With smt, fill both hardware threads of a core before moving to the next
+// core; without, use one hardware thread per core. Returns fewer than n CPUs if there aren't enough.
+std::vector<int> pick_cpus(const std::vector<CpuInfo>& topology, int n, bool smt);
+
+// Pin the calling thread to the given CPUs. An empty list unpins it.
+bool pin_current_thread(const std::vector<int>& cpus);
+
+#endif //TOPOLOGY_H
@@ -0,0 +1,146 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+std::atomic<bool> trace_active;
+
+struct TraceBuffer {
+    int tid;
+    std::vector<TraceEvent> events;
+    size_t head = 0;  // total events ever recorded; the ring holds the last events.size()
+    std::atomic<bool> writing = false;  // while the owning thread records an event
+};
+
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+// Buffers of threads that have exited, handed to the next new threads
+static std::vector<TraceBuffer *> trace_free_buffers;
+static std::atomic<bool> trace_dumping;
+static size_t trace_events_per_thread;
+static std::set<std::string> trace_names;
+
+// Reference points for converting TSC ticks to microseconds
+static uint64_t trace_start_tsc;
+static std::chrono::steady_clock::time_point trace_start_time;
+
+// Gives the thread's buffer back when the thread exits, so short-lived threads (e.g. the prefaulter's, a few per
+// layer) don't each keep one
+struct ThreadBuffer {
+    TraceBuffer *buffer = nullptr;
+
+    ~ThreadBuffer() {
+        if (buffer) {
+            std::lock_guard lg(trace_mutex);
+            trace_free_buffers.push_back(buffer);
+        }
+    }
+};
+
+static thread_local ThreadBuffer thread_buffer;
+
+void trace_enable(size_t events_per_thread) {
+    std::lock_guard lg(trace_mutex);
+    trace_events_per_thread = std::max<size_t>(events_per_thread, 1);
+    trace_start_time = std::chrono::steady_clock::now();
+    trace_start_tsc = __rdtsc();
+    trace_active.store(true, std::memory_order_relaxed);
+}
+
+std::string trace_enable_from_env() {
+    const char *path = getenv("SOLVE_2048_TRACE");
+    if (!path || !*path) {
+        return "";
+    }
+    const char *events = getenv("SOLVE_2048_TRACE_EVENTS");
+    trace_enable(events ? std::strtoull(events, nullptr, 10) : 1 << 18);
+    return path;
+}
+
+const char *trace_intern(const std::string& name) {
+    std::lock_guard lg(trace_mutex);
+    return trace_names.insert(name).first->c_str();
+}
+
+void trace_record(const char *name, uint64_t begin, uint64_t end, int64_t arg) {
+    TraceBuffer *buffer = thread_buffer.buffer;
+    if (!buffer) {
+        std::lock_guard lg(trace_mutex);
+        if (!trace_free_buffers.empty()) {
+            buffer = trace_free_buffers.back();
+            trace_free_buffers.pop_back();
+        } else {
+            trace_buffers.push_back(std::make_unique<TraceBuffer>());
+            buffer = trace_buffers.back().get();
+            buffer->tid = trace_buffers.size() - 1;
+            buffer->events.resize(trace_events_per_thread);
+        }
+        thread_buffer.buffer = buffer;
+    }
+    // trace_dump sets trace_dumping before it checks writing, and this sets writing before it checks trace_dumping,
+    // so either the dump waits for this event or the event is dropped
+    buffer->writing.store(true, std::memory_order_seq_cst);
+    if (!trace_dumping.load(std::memory_order_seq_cst)) {
+        buffer->events[buffer->head++ % buffer->events.size()] = { begin, end, name, arg };
+    }
+    buffer->writing.store(false, std::memory_order_release);
+}
+
+static void write_escaped(std::ostream& out, const char *s) {
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            out << '\\';
+        }
+        out << *s;
+    }
+}
+
+bool trace_dump(const std::string& filename) {
+    std::lock_guard lg(trace_mutex);
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        return false;
+    }
+    trace_dumping.store(true, std::memory_order_seq_cst);
+    for (auto& buffer : trace_buffers) {
+        while (buffer->writing.load(std::memory_order_acquire)) {
+            _mm_pause();
+        }
+    }
+
+    double elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start_time).count();
+    double us_per_tick = elapsed_us / std::max<double>(__rdtsc() - trace_start_tsc, 1);
+    auto to_us = [&] (uint64_t tsc) {
+        return ((int64_t)tsc - (int64_t)trace_start_tsc) * us_per_tick;
+    };
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (auto& buffer : trace_buffers) {
+        out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 0, \"tid\": " << buffer->tid
+            << ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+        first = false;
+
+        size_t count = std::min(buffer->head, buffer->events.size());
+        for (size_t i = buffer->head - count; i < buffer->head; ++i) {
+            const TraceEvent& e = buffer->events[i % buffer->events.size()];
+            out << ",\n{\"ph\": \"X\", \"pid\": 0, \"tid\": " << buffer->tid << ", \"name\": \"";
+            write_escaped(out, e.name);
+            out << "\", \"ts\": " << to_us(e.begin) << ", \"dur\": " << (e.end - e.begin) * us_per_tick;
+            if (e.arg >= 0) {
+                out << ", \"args\": {\"value\": " << e.arg << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    trace_dumping.store(false, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,54 @@
+//
+// Created by root on 6/23/25.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <x86intrin.h>
+
+// Timeline tracing. Each thread records begin/end pairs into its own ring buffer (no locks on the hot path),
+// and trace_dump writes everything as a Chrome trace JSON, which chrome://tracing and Perfetto can open. The
+// buffer of a thread that exits is reused by the next new thread. When tracing is disabled a TraceScope costs
+// one relaxed load.
+
+struct TraceEvent {
+    uint64_t begin;  // TSC ticks
+    uint64_t end;
+    const char *name;  // must outlive the trace; use trace_intern for dynamic strings
+    int64_t arg;  // shown as args.value, or omitted if negative
+};
+
+extern std::atomic<bool> trace_active;
+
+// Start recording, keeping at most events_per_thread of the most recent events on each thread.
+void trace_enable(size_t events_per_thread = 1 << 18);
+// Enable tracing if the SOLVE_2048_TRACE environment variable names an output file, and return that file.
+std::string trace_enable_from_env();
+// Return a pointer to a permanent copy of the string, suitable as an event name.
+const char *trace_intern(const std::string& name);
+// Record a finished event on the calling thread.
+void trace_record(const char *name, uint64_t begin, uint64_t end, int64_t arg);
+// Write all recorded events to a Chrome trace JSON file. Threads may keep recording; events they finish while
+// the file is written are dropped.
+bool trace_dump(const std::string& filename);
+
+struct TraceScope {
+    const char *name;
+    int64_t arg;
+    uint64_t begin;
+
+    explicit TraceScope(const char *name, int64_t arg = -1) : name(name), arg(arg),
+        begin(trace_active.load(std::memory_order_relaxed) ? __rdtsc() : 0) {}
+
+    ~TraceScope() {
+        if (begin) {
+            trace_record(name, begin, __rdtsc(), arg);
+        }
+    }
+};
+
+#endif //TRACE_H